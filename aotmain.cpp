@@ -0,0 +1,150 @@
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <time.h>
+#include "scvaltypes.h"
+#include "scvalvmt.h"
+#include "tinyxmlhooks.h"
+// generated in the pre-build step: scval -gencpp books_validator.h ScvalValidateBooks
+// and scval -gencpptyped books_typed_validator.h ScvalValidateTypedBooks
+#include "books_validator.h"
+#include "books_typed_validator.h"
+
+//===---------------------------------------------------------------------------===//
+// Cross-checks the ahead-of-time books validators against the VM, on books.xml
+// and variations of it, then compares their speed.
+//===---------------------------------------------------------------------------===//
+struct Variation
+{
+  const char* find;     // text of books.xml, every occurrence is replaced
+  const char* replace;
+  int expected;         // 1 valid, 0 not valid
+};
+static const Variation g_variations[]={
+  { "", "", 1 }, // as is
+  { "<title>XML Developer's Guide</title>", "", 0 },
+  { "<genre>Computer</genre>", "<genre>Computer</genre><genre>Computer</genre>", 0 },
+  { "<book id=\"bk101\">", "<book>", 0 },
+  { "<catalog>", "<catalog><book id=\"bk100\"><author/></book>", 0 },
+  { "</catalog>", "<book id=\"bk113\"/></catalog>", 0 },
+  { "<description>", "<unknown/><description>", 0 },
+  { "<book id=\"bk101\">", "<book id=\"bk101\" color=\"red\">", 0 },
+  { "<price>44.95</price>", "<price>cheap</price>", 0 },
+  { "<publish_date>2000-10-01</publish_date>", "<publish_date>October 2000</publish_date>", 0 },
+  { "catalog>", "library>", 0 },
+};
+// typed attributes, only in g_booksTypedSchema
+static const Variation g_typedVariations[]={
+  { "", "", 1 },
+  { "<book id=\"bk101\">", "<book id=\"bk101\" pages=\"320\" rating=\"4.5\" available=\"true\">", 1 },
+  { "<book id=\"bk101\">", "<book id=\"bk101\" pages=\"-5\" rating=\"-.5\">", 1 },
+  { "<book id=\"bk101\">", "<book id=\"bk101\" pages=\"320pp\">", 0 },
+  { "<book id=\"bk101\">", "<book id=\"bk101\" pages=\"\">", 0 },
+  { "<book id=\"bk101\">", "<book id=\"bk101\" pages=\"-\">", 0 },
+  { "<book id=\"bk101\">", "<book id=\"bk101\" rating=\".\">", 0 },
+  { "<book id=\"bk101\">", "<book id=\"bk101\" rating=\"4.5.1\">", 0 },
+  { "<book id=\"bk101\">", "<book id=\"bk101\" available=\"maybe\">", 0 },
+  { "<book id=\"bk101\">", "<book id=\"bk101\" pages=\"320\" color=\"red\">", 0 },
+  { "<price>44.95</price>", "<price>44,95</price>", 0 },
+};
+
+bool LoadText( const char* filename, std::string& out )
+{
+  FILE* f = fopen( filename, "rb" );
+  if ( !f )
+    return false;
+  char buff[4096];
+  size_t n;
+  while ( (n=fread(buff,1,sizeof(buff),f)) > 0 )
+    out.append( buff, n );
+  fclose( f );
+  return true;
+}
+
+double ElapsedSecs( clock_t start )
+{
+  return double(clock()-start)/CLOCKS_PER_SEC;
+}
+
+// Validates every variation by the VM and the ahead-of-time validator, the mismatches
+// between them or with the expected result
+int CrossCheck( const char* name, const std::string& books, const ScvalVMCode& bytecode,
+                const Variation* variations, int noVariations, bool (*aotValidate)( TinyXMLHooks&, const ScvalCheckTable* ) )
+{
+  // also with the checks registered, instead of the Check of the hook
+  ScvalCheckTable checks;
+  ScvalVMT<TinyXMLHooks> staticValidator;
+  if ( !TinyXMLHooks::RegisterChecks( checks ) || !TinyXMLHooks::RegisterChecks( staticValidator ) || !staticValidator.Bind( bytecode ) )
+    return 1;
+  int mismatches = 0;
+  for ( int i = 0; i < noVariations; ++i )
+  {
+    std::string text = books;
+    const Variation& v = variations[i];
+    const size_t findLen = strlen( v.find ), replaceLen = strlen( v.replace );
+    for ( size_t at = findLen ? text.find( v.find ) : std::string::npos; at != std::string::npos; at = text.find( v.find, at+replaceLen ) )
+      text.replace( at, findLen, v.replace );
+
+    TinyXMLHooks xmlHook;
+    if ( !xmlHook.Parse( text.c_str() ) )
+    {
+      printf( "%s variation %d: not parsed\n", name, i );
+      ++mismatches;
+      continue;
+    }
+    const bool vmRes = ScvalValidate( bytecode, &xmlHook );
+    xmlHook.Rewind();
+    const bool aotRes = aotValidate( xmlHook, NULL );
+    xmlHook.Rewind();
+    const bool aotRegisteredRes = aotValidate( xmlHook, &checks );
+    xmlHook.Rewind();
+    const bool vmtRegisteredRes = staticValidator.Validate( xmlHook );
+    const bool registeredAgree = aotRegisteredRes == aotRes && vmtRegisteredRes == aotRes;
+    const bool expected = v.expected != 0;
+    printf( "%s variation %d: vm=%s aot=%s%s\n", name, i, vmRes?"OK":"invalid", aotRes?"OK":"invalid",
+      vmRes != expected ? " (unexpected)" : ( !registeredAgree ? " (registered checks differ)" : "" ) );
+    if ( vmRes != aotRes || vmRes != expected || !registeredAgree )
+      ++mismatches;
+  }
+  return mismatches;
+}
+
+int main( int argc, char** argv )
+{
+  const char* xmlfile = argc > 1 ? argv[1] : "books.xml";
+  std::string books;
+  ScvalVMCode bytecode, typedBytecode;
+  if ( !LoadText( xmlfile, books ) || !ScvalCompile( g_booksSchema, bytecode ) || !ScvalCompile( g_booksTypedSchema, typedBytecode ) )
+  {
+    printf( "Error loading %s or building scval bytecode\n", xmlfile );
+    return 1;
+  }
+
+  int mismatches = CrossCheck( "books", books, bytecode, g_variations, sizeof(g_variations)/sizeof(g_variations[0]), ScvalValidateBooks<TinyXMLHooks> );
+  mismatches += CrossCheck( "typed books", books, typedBytecode, g_typedVariations, sizeof(g_typedVariations)/sizeof(g_typedVariations[0]), ScvalValidateTypedBooks<TinyXMLHooks> );
+
+  // speed, same document over and over
+  const int noRuns = 20000;
+  TinyXMLHooks xmlHook;
+  xmlHook.Parse( books.c_str() );
+  ScvalValidator validator( bytecode, VMENGINE_THREADED );
+  clock_t start = clock();
+  for ( int i = 0; i < noRuns; ++i )
+  {
+    xmlHook.Rewind();
+    validator.Validate( &xmlHook );
+  }
+  const double vmSecs = ElapsedSecs( start );
+  start = clock();
+  for ( int i = 0; i < noRuns; ++i )
+  {
+    xmlHook.Rewind();
+    ScvalValidateBooks( xmlHook );
+  }
+  const double aotSecs = ElapsedSecs( start );
+  printf( "%d runs: vm(threaded) %.3fs, aot %.3fs\n", noRuns, vmSecs, aotSecs );
+
+  if ( mismatches )
+    printf( "%d mismatches between the VM, the ahead-of-time validators and the expected results\n", mismatches );
+  return mismatches ? 1 : 0;
+}
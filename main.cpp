@@ -1,104 +1,86 @@
 #include <stdio.h>
+#include <string.h>
 #include "scvaltypes.h"
-#include "tinyxml2/tinyxml2.h"
-#include <stack>
+#include "scvalvmt.h"
+#include "tinyxmlhooks.h"
+#include "tinyxmlstreamhooks.h"
+#include "tinyxmlrecordhooks.h"
+#include "tinyxmlparallel.h"
+#include "scvalscanhooks.h"
+#include <string>
+#include <vector>
+#include <stdlib.h>
+#include <time.h>
+#include <new>
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#pragma comment(lib, "psapi.lib")
+#else
+#include <sys/time.h>
+#include <sys/resource.h>
+#endif
 
-// Provide callbacks for specific operations in the validator,
-// based on TinyXML library.
-class TinyXMLHooks : public ScvalInstHook
+// Allocations through new of the whole program, for the steady state of the
+// benchmarks. Atomic, the workers of the parallel validation allocate too.
+static volatile long g_allocations = 0;
+static long CountAllocations( long added )
+{
+#ifdef _WIN32
+  return InterlockedExchangeAdd( &g_allocations, added )+added;
+#else
+  return __sync_add_and_fetch( &g_allocations, added );
+#endif
+}
+void* operator new( size_t size )
+{
+  CountAllocations( 1 );
+  void* mem = malloc( size ? size : 1 );
+  if ( !mem )
+    throw std::bad_alloc();
+  return mem;
+}
+void* operator new[]( size_t size ){ return operator new( size ); }
+void operator delete( void* mem ){ free( mem ); }
+void operator delete[]( void* mem ){ free( mem ); }
+void operator delete( void* mem, size_t ){ free( mem ); }
+void operator delete[]( void* mem, size_t ){ free( mem ); }
+// The allocations since it was created
+class AllocationCount
 {
 public:
-  TinyXMLHooks(const char* xmlfile) : m_xmlElmt(0), m_xmlAttr(0)
-  {
-    if ( doc.LoadFile(xmlfile) == tinyxml2::XML_SUCCESS )
-      m_xmlElmt = doc.FirstChildElement();
-    else
-      doc.PrintError();
-  }
-  virtual const char* Do( ScvalVMOpcode opcode, ScvalHashID typeName=INVALIDHASH, const char* value=0 )
-  {
-    switch ( opcode )
-    {
-    case VM_LDEN: 
-      return m_xmlElmt ? m_xmlElmt->Name() : NULL;
-    case VM_LDEV: 
-      return m_xmlElmt ? m_xmlElmt->GetText() : NULL;
-    case VM_LDAN: 
-      return m_xmlAttr ? m_xmlAttr->Name() : NULL;
-    case VM_LDAV:
-      return m_xmlAttr ? m_xmlAttr->Value() : NULL;
-    case VM_DOWN: 
-      m_elmstack.push( m_xmlElmt );
-      m_xmlElmt = m_xmlElmt->FirstChildElement(); 
-      break;
-    case VM_UP  : 
-      m_xmlElmt = m_elmstack.top();
-      m_elmstack.pop();
-      break;
-    case VM_GATT:
-      m_xmlAttr = m_xmlElmt->FirstAttribute(); 
-      break;
-    case VM_NATT:
-      m_xmlAttr = m_xmlAttr->Next(); 
-      break;
-    case VM_NEXT:
-      m_xmlElmt = m_xmlElmt->NextSiblingElement(); 
-      break;
-    case VM_CALL:
-        if ( typeName == ScvalHash("AUTHOR") )      return (const char*)CheckAuthor(value);
-        else if ( typeName == ScvalHash("DATE") )   return (const char*)CheckDate(value);
-        else if ( typeName == ScvalHash("PRICE") )  return (const char*)CheckPrice(value);
-        return 0;
-      break;
-    }
-    return NULL;
-  }
-protected:
-  int CheckAuthor(const char* authorStr)
-  {
-    // might check a DB with Authors (for example)
-
-    return 1;
-  }
-  int CheckDate(const char* dateStr)
-  {
-    // check syntax and semantic
-
-    return 1;
-  }
-  int CheckPrice(const char* priceStr)
-  {
-    // syntax correct? price range correct?
-    return 1;
-  }
-protected:
-  tinyxml2::XMLDocument doc;
-  tinyxml2::XMLElement* m_xmlElmt;
-  const tinyxml2::XMLAttribute* m_xmlAttr;
-  std::stack<tinyxml2::XMLElement*> m_elmstack;
+  AllocationCount():m_start(CountAllocations( 0 )){}
+  long Get()const{ return CountAllocations( 0 )-m_start; }
+private:
+  long m_start;
 };
 
+#ifndef SCVAL_NO_STATS
+void PrintStats( const ScvalVMStats* stats )
+{
+  if ( !stats )
+    return;
+  const char* opnames[]={
+    "lden", "ldev", "ldan", "ldav", "cmps", "cmpi", 
+    "je", "jne", "jg", "jmp", "clr", "inc", 
+    "chkn", "chkc",
+    "down", "up", "gatt", "natt", "next",
+    "ret", "call", "lenj", "lanj", "cjni", "switch", "jsr" };
+  printf( "%d instructions executed\n", stats->m_executed );
+  for ( int i = 0; i < VM_NOOPCODES; ++i )
+    if ( stats->m_opCount[i] || stats->m_hookCount[i] )
+      printf( "  %-6s %8d executed %8d hook calls\n", opnames[i], stats->m_opCount[i], stats->m_hookCount[i] );
+  printf( "  %8d loads hashed by the hook\n", stats->m_hashedLoads );
+  printf( "  %8d batched enumerations\n", stats->m_enumerations );
+  for ( unsigned int i = 0; i < stats->m_noCalls; ++i )
+    printf( "  call 0x%08x %8d\n", stats->m_calls[i].typeName, stats->m_calls[i].count );
+}
+#endif
 void TestBooks()
 {
-  const char* schema ="\
-  @author #AUTHOR\
-  @date #DATE\
-  @price #PRICE\
-  !catalog\
-  {\
-    *book[id(str)]\
-    {\
-        !author(author)\
-        !title(str)\
-        !genre(str)\
-        !price(price)\
-        !publish_date(date)\
-        !description(str)\
-    }\
-  }";
   printf( "AST\n====\n" );
   ScvalVMCode bytecode;
-  if ( ! ScvalCompile( schema, bytecode ) )
+  if ( ! ScvalCompile( g_booksSchema, bytecode ) )
   {
     printf( "Error building scval bytecode\n" );
   }
@@ -120,14 +102,1546 @@ void TestBooks()
   // and the proper custom data type check
   TinyXMLHooks xmlHook("books.xml");
   printf( "\nValidating xml...\n" );
-  if ( ! ScvalValidate( bytecode, &xmlHook ) )
+  ScvalValidator validator;
+  TinyXMLHooks::RegisterChecks( validator );
+  if ( ! validator.Bind( bytecode ) )
+    printf( "Error, custom types without check\n" );
+#ifndef SCVAL_NO_STATS
+  validator.EnableStats( true );
+#endif
+  if ( ! validator.Validate( &xmlHook ) )
+    printf( "Error, XML is not valid\n" );
+  else
+    printf( "OK\n" );
+#ifndef SCVAL_NO_STATS
+  PrintStats( validator.GetStats() );
+#endif
+
+  // the same file streamed, without loading the document
+  printf( "\nValidating xml stream...\n" );
+  TinyXMLStreamHooks streamHook;
+#ifndef SCVAL_NO_STATS
+  validator.EnableStats( false );
+#endif
+  if ( !streamHook.LoadFile( "books.xml" ) || !validator.Validate( &streamHook ) || !streamHook.Finish() )
+    printf( "Error, XML is not valid\n" );
+  else
+    printf( "OK, %d levels in memory\n", (int)streamHook.MaxDepth() );
+
+  // and by records, only one book in memory
+  printf( "\nValidating xml by records...\n" );
+  TinyXMLRecordHooks recordHook;
+  if ( !recordHook.LoadFile( "books.xml" ) || !validator.Validate( &recordHook ) || !recordHook.Finish() )
+    printf( "Error, XML is not valid\n" );
+  else
+    printf( "OK, %d records, the largest of %d bytes\n", (int)recordHook.Records(), (int)recordHook.MaxRecord() );
+
+  // and by several workers, the books split among them by chunks
+  printf( "\nValidating xml by 4 workers...\n" );
+  TinyXMLParallelValidator<TinyXMLHooks> parallelValidator( 4, 2 );
+  TinyXMLHooks::RegisterChecks( parallelValidator );
+  xmlHook.Rewind();
+  if ( !parallelValidator.Bind( bytecode ) || !parallelValidator.Validate( xmlHook ) )
+    printf( "Error, XML is not valid\n" );
+  else
+    printf( "OK\n" );
+
+  // and scanned in place, neither the DOM nor copies of the text
+  printf( "\nValidating xml scanned in place...\n" );
+  ScvalScanHooks scanHook;
+  if ( !scanHook.LoadFile( "books.xml" ) || !validator.Validate( &scanHook ) || !scanHook.Finish() )
+    printf( "Error, XML is not valid\n" );
+  else
+    printf( "OK\n" );
+
+  // and pushed by chunks, as if it came from a socket
+  printf( "\nValidating xml pushed by chunks...\n" );
+  TinyXMLPushValidator pushValidator( validator );
+  pushValidator.Begin();
+  FILE* file = fopen( "books.xml", "rb" );
+  bool valid = file != 0;
+  char chunk[256];
+  size_t len;
+  while ( valid && (len = fread( chunk, 1, sizeof(chunk), file )) > 0 )
+    valid = pushValidator.Feed( chunk, len );
+  if ( file )
+    fclose( file );
+  if ( !valid || !pushValidator.End() )
     printf( "Error, XML is not valid\n" );
   else
     printf( "OK\n" );
 }
 
-int main()
+//===---------------------------------------------------------------------------===//
+// Benchmarks
+//===---------------------------------------------------------------------------===//
+// One book entry of the generated catalogs
+int FormatBook( char* tmp, int i )
+{
+  static const char* genres[]={ "Computer", "Fantasy", "Romance", "Horror", "Science Fiction" };
+  return sprintf( tmp,
+    "  <book id=\"bk%d\">\n"
+    "    <author>Author, Number %d</author>\n"
+    "    <title>Title of the book %d</title>\n"
+    "    <genre>%s</genre>\n"
+    "    <price>%d.95</price>\n"
+    "    <publish_date>2000-%02d-%02d</publish_date>\n"
+    "    <description>Description of the book number %d.</description>\n"
+    "  </book>\n", 
+    i, i%1000, i, genres[i%5], i%100, 1+i%12, 1+i%28, i );
+}
+// Generates a books.xml like catalog with noBooks entries
+void GenerateBooksCorpus( std::string& out, int noBooks )
+{
+  char tmp[512];
+  out = "<?xml version=\"1.0\"?>\n<catalog>\n";
+  for ( int i = 0; i < noBooks; ++i )
+  {
+    FormatBook( tmp, i );
+    out += tmp;
+  }
+  out += "</catalog>\n";
+}
+// Writes a catalog of about noMBytes to a file, for the loading benchmarks
+bool WriteBooksCorpus( const char* outFile, int noMBytes )
+{
+  FILE* file = fopen( outFile, "wb" );
+  if ( !file )
+    return false;
+  char tmp[512];
+  double size = fprintf( file, "<?xml version=\"1.0\"?>\n<catalog>\n" );
+  for ( int i = 0; size < noMBytes*1024.0*1024.0; ++i )
+    size += fwrite( tmp, 1, FormatBook( tmp, i ), file );
+  fprintf( file, "</catalog>\n" );
+  fclose( file );
+  printf( "%s written (%.0f bytes)\n", outFile, size );
+  return true;
+}
+double ElapsedSecs( clock_t start )
+{
+  return double(clock()-start)/CLOCKS_PER_SEC;
+}
+// clock() is the processor time in some hosts, the loading waits for the disk
+double WallSecs()
+{
+#ifdef _WIN32
+  LARGE_INTEGER counter, frequency;
+  QueryPerformanceCounter( &counter );
+  QueryPerformanceFrequency( &frequency );
+  return double(counter.QuadPart)/frequency.QuadPart;
+#else
+  timeval now;
+  gettimeofday( &now, 0 );
+  return now.tv_sec+now.tv_usec/1000000.0;
+#endif
+}
+// Peak of the process resident memory
+double PeakMemoryMB()
+{
+#ifdef _WIN32
+  PROCESS_MEMORY_COUNTERS counters;
+  if ( !GetProcessMemoryInfo( GetCurrentProcess(), &counters, sizeof(counters) ) )
+    return 0.0;
+  return counters.PeakWorkingSetSize/(1024.0*1024.0);
+#else
+  rusage usage;
+  getrusage( RUSAGE_SELF, &usage );
+#ifdef __APPLE__
+  return usage.ru_maxrss/(1024.0*1024.0);
+#else
+  return usage.ru_maxrss/1024.0;
+#endif
+#endif
+}
+// Loads and validates a books catalog file, one method per process as the
+// peak memory is the one of the process: read into a buffer (XMLDocument::LoadFile),
+// mapped in memory (XMLDocument::LoadFileMapped), streamed, by records or scanned in place
+bool BenchLoad( const char* method, const char* xmlFile )
+{
+  ScvalVMCode bytecode;
+  ScvalValidator validator;
+  TinyXMLHooks::RegisterChecks( validator );
+  if ( !ScvalCompile( g_booksSchema, bytecode ) || !validator.Bind( bytecode ) )
+  {
+    printf( "Error building scval bytecode\n" );
+    return false;
+  }
+  bool valid;
+  double loadSecs = 0.0;
+  const double start = WallSecs();
+  if ( strcmp( method, "stream" ) == 0 )
+  {
+    TinyXMLStreamHooks streamHook;
+    valid = streamHook.LoadFile( xmlFile ) && validator.Validate( &streamHook ) && streamHook.Finish();
+  }
+  else if ( strcmp( method, "records" ) == 0 )
+  {
+    TinyXMLRecordHooks recordHook;
+    valid = recordHook.LoadFile( xmlFile ) && validator.Validate( &recordHook ) && recordHook.Finish();
+  }
+  else if ( strcmp( method, "scan" ) == 0 )
+  {
+    ScvalScanHooks scanHook;
+    valid = scanHook.LoadFile( xmlFile );
+    loadSecs = WallSecs()-start;
+    valid = valid && validator.Validate( &scanHook ) && scanHook.Finish();
+  }
+  else
+  {
+    TinyXMLHooks xmlHook;
+    valid = xmlHook.LoadFile( xmlFile, strcmp( method, "mapped" ) == 0 );
+    loadSecs = WallSecs()-start;
+    valid = valid && validator.Validate( &xmlHook );
+  }
+  printf( "%-8s: %s, %.3f secs (loading %.3f), peak memory %.1f MB\n", method, valid?"valid":"not valid", 
+    WallSecs()-start, loadSecs, PeakMemoryMB() );
+  return valid;
+}
+// books.xml with its books repeated up to size bytes
+bool ScaleBooksFile( std::string& out, size_t size )
+{
+  std::string books;
+  FILE* file = fopen( "books.xml", "rb" );
+  char chunk[4096];
+  size_t len;
+  while ( file && (len = fread( chunk, 1, sizeof(chunk), file )) > 0 )
+    books.append( chunk, len );
+  if ( file )
+    fclose( file );
+  const size_t first = books.find( "<book " ), last = books.rfind( "</catalog>" );
+  if ( first == std::string::npos || last == std::string::npos || last < first )
+    return false;
+  out.assign( books, 0, first );
+  while ( out.size() < size )
+    out.append( books, first, last-first );
+  out.append( books, last, std::string::npos );
+  return true;
+}
+// Parsing only, in each scan mode of the parser (XMLUtil::SetScanMode): the
+// same document of books.xml scaled up parsed again up to noMBytes
+void BenchParse( int noMBytes )
+{
+  std::string corpus;
+  if ( !ScaleBooksFile( corpus, size_t(noMBytes < 64 ? noMBytes : 64)*1024*1024 ) )
+  {
+    printf( "Error reading books.xml\n" );
+    return;
+  }
+  const char* names[]={ "", "scalar", "sse2", "avx2" };
+  const tinyxml2::XMLUtil::ScanMode best = tinyxml2::XMLUtil::SetScanMode( tinyxml2::XMLUtil::SCAN_AUTO );
+  const int noRuns = int( (noMBytes*1024.0*1024.0+corpus.size()-1)/corpus.size() );
+  tinyxml2::XMLDocument doc;
+  doc.SetArena( true );
+  for ( int m = tinyxml2::XMLUtil::SCAN_SCALAR; m <= best; ++m )
+  {
+    tinyxml2::XMLUtil::SetScanMode( (tinyxml2::XMLUtil::ScanMode)m );
+    bool parsed = true;
+    const clock_t start = clock();
+    for ( int r = 0; r < noRuns; ++r )
+      parsed = doc.Parse( corpus.c_str(), corpus.size() ) == tinyxml2::XML_SUCCESS && parsed;
+    const double secs = ElapsedSecs(start);
+    printf( "%-8s: %s, %.0f MB in %.3f secs, %.2f MB/sec\n", names[m], parsed?"parsed":"error", 
+      corpus.size()*double(noRuns)/(1024.0*1024.0), secs, secs > 0 ? corpus.size()*double(noRuns)/secs/(1024.0*1024.0) : 0.0 );
+  }
+  tinyxml2::XMLUtil::SetScanMode( tinyxml2::XMLUtil::SCAN_AUTO );
+}
+// Validation of a catalog by 1 up to maxWorkers workers, the books split among
+// them, against a single VM. Wall time, the processor time adds up the threads.
+void BenchParallel( const ScvalVMCode& bytecode, TinyXMLHooks& xmlHook, size_t size, unsigned int maxWorkers, int noRuns )
 {
-  TestBooks();
+  const ScvalVMEngine engine = ScvalJitSupported() ? VMENGINE_JIT : VMENGINE_THREADED;
+  const double noMBytes = size*double(noRuns)/(1024.0*1024.0);
+  ScvalValidator validator;
+  TinyXMLHooks::RegisterChecks( validator );
+  validator.Bind( bytecode, engine );
+  // the first run decodes the texts of the DOM, not timed
+  xmlHook.Rewind();
+  bool valid = validator.Validate( &xmlHook );
+  double start = WallSecs();
+  for ( int r = 0; r < noRuns; ++r )
+  {
+    xmlHook.Rewind();
+    valid = validator.Validate( &xmlHook ) && valid;
+  }
+  const double singleSecs = WallSecs()-start;
+  printf( "single VM : %s, %.3f secs, %.2f MB/sec\n", valid?"valid":"not valid", singleSecs, 
+    singleSecs > 0 ? noMBytes/singleSecs : 0.0 );
+  for ( unsigned int w = 1; w <= maxWorkers; w = w < maxWorkers && w*2 > maxWorkers ? maxWorkers : w*2 )
+  {
+    TinyXMLParallelValidator<TinyXMLHooks> parallelValidator( w );
+    TinyXMLHooks::RegisterChecks( parallelValidator );
+    valid = parallelValidator.Bind( bytecode, engine );
+    start = WallSecs();
+    for ( int r = 0; r < noRuns; ++r )
+    {
+      xmlHook.Rewind();
+      valid = parallelValidator.Validate( xmlHook ) && valid;
+    }
+    const double secs = WallSecs()-start;
+    printf( "%2u workers: %s, %.3f secs, %.2f MB/sec, %.2fx\n", w, valid?"valid":"not valid", secs, 
+      secs > 0 ? noMBytes/secs : 0.0, secs > 0 ? singleSecs/secs : 0.0 );
+    if ( w == maxWorkers )
+      break;
+  }
+}
+// The same on books.xml scaled up to noMBytes
+void BenchParallel( int noMBytes, unsigned int maxWorkers )
+{
+  ScvalVMCode bytecode;
+  std::string corpus;
+  if ( !ScvalCompile( g_booksSchema, bytecode ) || !ScaleBooksFile( corpus, size_t(noMBytes)*1024*1024 ) )
+  {
+    printf( "Error building scval bytecode or reading books.xml\n" );
+    return;
+  }
+  TinyXMLHooks xmlHook;
+  if ( !xmlHook.Parse( corpus.c_str() ) )
+    return;
+  printf( "Validating %d MB by up to %u workers...\n", noMBytes, maxWorkers );
+  BenchParallel( bytecode, xmlHook, corpus.size(), maxWorkers, 3 );
+}
+void BenchEngines( const ScvalVMCode& bytecode, TinyXMLHooks& xmlHook, int noRuns )
+{
+  const char* names[]={ "switch", "threaded", "jit" };
+  const ScvalVMEngine engines[]={ VMENGINE_SWITCH, VMENGINE_THREADED, VMENGINE_JIT };
+  const int noEngines = ScvalJitSupported() ? 3 : 2;
+  // The operations of the code, counted by a run of the switch engine: the
+  // same for every engine (the native code doesn't count them), all rates
+  // are of this count, unknown without statistics
+  double instructions = 0;
+#ifndef SCVAL_NO_STATS
+  {
+    ScvalValidator validator( bytecode, VMENGINE_SWITCH );
+    validator.EnableStats( true );
+    xmlHook.Rewind();
+    validator.Validate( &xmlHook );
+    instructions = validator.GetStats() ? double(validator.GetStats()->m_executed)*noRuns : 0;
+  }
+#endif
+  for ( int e = 0; e < noEngines; ++e )
+  {
+    ScvalValidator validator( bytecode, engines[e] );
+    // the first run decodes or translates the code, not timed
+    xmlHook.Rewind();
+    validator.Validate( &xmlHook );
+    bool valid = true;
+    clock_t start = clock();
+    for ( int r = 0; r < noRuns; ++r )
+    {
+      xmlHook.Rewind();
+      valid = validator.Validate( &xmlHook ) && valid;
+    }
+    double secs = ElapsedSecs(start);
+    printf( "%-8s: %s, %.0f instructions in %.3f secs, %.2f M instructions/sec\n", 
+      names[e], valid?"valid":"not valid", instructions, secs, 
+      secs > 0 ? instructions/secs/1000000.0 : 0.0 );
+  }
+  // the switch engine caching the checks of the custom types
+  {
+    ScvalValidator validator( bytecode );
+    validator.EnableCallCache( 4096 );
+    validator.SetCallCacheable( ScvalHash("AUTHOR") );
+    validator.SetCallCacheable( ScvalHash("DATE") );
+    validator.SetCallCacheable( ScvalHash("PRICE") );
+    bool valid = true;
+    clock_t start = clock();
+    for ( int r = 0; r < noRuns; ++r )
+    {
+      xmlHook.Rewind();
+      valid = validator.Validate( &xmlHook ) && valid;
+    }
+    double secs = ElapsedSecs(start);
+    const ScvalCallCache& cache = validator.GetCallCache();
+    printf( "%-8s: %s, %.0f instructions in %.3f secs, %.2f M instructions/sec, %u hits %u misses\n", 
+      "cached", valid?"valid":"not valid", instructions, secs, 
+      secs > 0 ? instructions/secs/1000000.0 : 0.0, cache.m_hits, cache.m_misses );
+  }
+  // the switch engine calling the registered checks instead of the hook
+  {
+    ScvalValidator validator;
+    TinyXMLHooks::RegisterChecks( validator );
+    validator.Bind( bytecode );
+    bool valid = true;
+    clock_t start = clock();
+    for ( int r = 0; r < noRuns; ++r )
+    {
+      xmlHook.Rewind();
+      valid = validator.Validate( &xmlHook ) && valid;
+    }
+    double secs = ElapsedSecs(start);
+    printf( "%-8s: %s, %.0f instructions in %.3f secs, %.2f M instructions/sec\n", 
+      "checks", valid?"valid":"not valid", instructions, secs, 
+      secs > 0 ? instructions/secs/1000000.0 : 0.0 );
+  }
+  // the switch engine deferring the checks to batches
+  {
+    ScvalValidator validator( bytecode );
+    validator.EnableDeferredChecks( TinyXMLHooks::CheckBatch );
+    bool valid = true;
+    clock_t start = clock();
+    for ( int r = 0; r < noRuns; ++r )
+    {
+      xmlHook.Rewind();
+      valid = validator.Validate( &xmlHook ) && valid;
+    }
+    double secs = ElapsedSecs(start);
+    printf( "%-8s: %s, %.0f instructions in %.3f secs, %.2f M instructions/sec\n", 
+      "deferred", valid?"valid":"not valid", instructions, secs, 
+      secs > 0 ? instructions/secs/1000000.0 : 0.0 );
+  }
+  // the switch engine with the hook statically bound
+  ScvalVMT<TinyXMLHooks> staticValidator( bytecode );
+  bool valid = true;
+  clock_t start = clock();
+  for ( int r = 0; r < noRuns; ++r )
+  {
+    xmlHook.Rewind();
+    valid = staticValidator.Validate( xmlHook ) && valid;
+  }
+  double secs = ElapsedSecs(start);
+  printf( "%-8s: %s, %.0f instructions in %.3f secs, %.2f M instructions/sec\n", 
+    "static", valid?"valid":"not valid", instructions, secs, 
+    secs > 0 ? instructions/secs/1000000.0 : 0.0 );
+}
+// Per document fixed cost: a fresh VM per document (ScvalValidate) against
+// a session that keeps the VM state between documents (ScvalValidator)
+void BenchSession( const ScvalVMCode& bytecode, int noDocs )
+{
+  std::string smallDoc;
+  GenerateBooksCorpus( smallDoc, 1 );
+  TinyXMLHooks xmlHook;
+  if ( !xmlHook.Parse( smallDoc.c_str() ) )
+    return;
+
+  clock_t start = clock();
+  for ( int d = 0; d < noDocs; ++d )
+  {
+    xmlHook.Rewind();
+    ScvalValidate( bytecode, &xmlHook );
+  }
+  const double secsValidate = ElapsedSecs(start);
+
+  ScvalValidator validator( bytecode );
+  start = clock();
+  for ( int d = 0; d < noDocs; ++d )
+  {
+    xmlHook.Rewind();
+    validator.Validate( &xmlHook );
+  }
+  const double secsSession = ElapsedSecs(start);
+  printf( "ScvalValidate : %.3f usecs/document\n", secsValidate*1000000.0/noDocs );
+  printf( "ScvalValidator: %.3f usecs/document\n", secsSession*1000000.0/noDocs );
+}
+// Stream of documents of different sizes: a hook per document against one
+// hook reused for all of them (its document in arena mode)
+void BenchReuse( const ScvalVMCode& bytecode, int noDocs )
+{
+  std::string docs[2];
+  GenerateBooksCorpus( docs[0], 1 );
+  GenerateBooksCorpus( docs[1], 20 );
+  ScvalValidator validator( bytecode );
+  AllocationCount newHookAllocations;
+  clock_t start = clock();
+  for ( int d = 0; d < noDocs; ++d )
+  {
+    TinyXMLHooks xmlHook;
+    if ( xmlHook.Parse( docs[d%2].c_str() ) )
+      validator.Validate( &xmlHook );
+  }
+  double secs = ElapsedSecs(start);
+  printf( "new hook: %.3f usecs/document, %.2f allocations/document\n", 
+    secs*1000000.0/noDocs, double(newHookAllocations.Get())/noDocs );
+
+  TinyXMLHooks xmlHook;
+  // the first documents allocate the blocks and buffer
+  for ( int d = 0; d < 2; ++d )
+    if ( xmlHook.Parse( docs[d].c_str() ) )
+      validator.Validate( &xmlHook );
+  AllocationCount reusedAllocations;
+  start = clock();
+  for ( int d = 0; d < noDocs; ++d )
+  {
+    if ( xmlHook.Parse( docs[d%2].c_str() ) )
+      validator.Validate( &xmlHook );
+  }
+  secs = ElapsedSecs(start);
+  printf( "reused  : %.3f usecs/document, %.2f allocations/document, %d pool blocks\n", 
+    secs*1000000.0/noDocs, double(reusedAllocations.Get())/noDocs, xmlHook.PoolBlocks() );
+}
+// An element type with many allowed children, compare chains against the hashed switch
+void BenchWide( int noAlternatives, int noChildren )
+{
+  char name[16];
+  std::string schema = "!root{";
+  for ( int i = 0; i < noAlternatives; ++i )
+  {
+    sprintf_s( name, " *e%02d(str)", i );
+    schema += name;
+  }
+  schema += "}";
+  std::string doc = "<root>";
+  srand( 4321 );
+  for ( int i = 0; i < noChildren; ++i )
+  {
+    sprintf_s( name, "<e%02d>", rand()%noAlternatives );
+    doc += name;
+    doc += "x</";
+    doc += name+1;
+  }
+  doc += "</root>";
+  TinyXMLHooks xmlHook;
+  ScvalVMCode chainBytecode, switchBytecode;
+  if ( !xmlHook.Parse( doc.c_str() ) || 
+       !ScvalCompile( schema.c_str(), chainBytecode, COMPILE_NOSWITCH ) ||
+       !ScvalCompile( schema.c_str(), switchBytecode ) )
+    return;
+  printf( "\nBenchmarking %d children of %d alternatives, compare chains...\n", noChildren, noAlternatives );
+  BenchEngines( chainBytecode, xmlHook, 10 );
+  printf( "\nBenchmarking %d children of %d alternatives, hashed switch...\n", noChildren, noAlternatives );
+  BenchEngines( switchBytecode, xmlHook, 10 );
+}
+// Parsing and validation of the whole document: loading the DOM first against streaming it
+// and scanning it in place
+void BenchStream( const ScvalVMCode& bytecode, const std::string& corpus, int noRuns )
+{
+  ScvalValidator validator;
+  TinyXMLHooks::RegisterChecks( validator );
+  if ( !validator.Bind( bytecode ) )
+    return;
+  bool valid = true;
+  clock_t start = clock();
+  for ( int r = 0; r < noRuns; ++r )
+  {
+    TinyXMLHooks xmlHook;
+    valid = xmlHook.Parse( corpus.c_str() ) && validator.Validate( &xmlHook ) && valid;
+  }
+  double secs = ElapsedSecs(start);
+  printf( "%-8s: %s, %.3f secs, %.2f MB/sec\n", "dom", valid?"valid":"not valid", secs, 
+    secs > 0 ? corpus.size()*noRuns/secs/(1024.0*1024.0) : 0.0 );
+  valid = true;
+  start = clock();
+  for ( int r = 0; r < noRuns; ++r )
+  {
+    TinyXMLStreamHooks streamHook;
+    valid = streamHook.Parse( corpus.c_str(), corpus.size() ) && validator.Validate( &streamHook ) && 
+            streamHook.Finish() && valid;
+  }
+  secs = ElapsedSecs(start);
+  printf( "%-8s: %s, %.3f secs, %.2f MB/sec\n", "stream", valid?"valid":"not valid", secs, 
+    secs > 0 ? corpus.size()*noRuns/secs/(1024.0*1024.0) : 0.0 );
+  valid = true;
+  start = clock();
+  for ( int r = 0; r < noRuns; ++r )
+  {
+    TinyXMLRecordHooks recordHook;
+    valid = recordHook.Parse( corpus.c_str(), corpus.size() ) && validator.Validate( &recordHook ) && 
+            recordHook.Finish() && valid;
+  }
+  secs = ElapsedSecs(start);
+  printf( "%-8s: %s, %.3f secs, %.2f MB/sec\n", "records", valid?"valid":"not valid", secs, 
+    secs > 0 ? corpus.size()*noRuns/secs/(1024.0*1024.0) : 0.0 );
+  valid = true;
+  start = clock();
+  for ( int r = 0; r < noRuns; ++r )
+  {
+    ScvalScanHooks scanHook;
+    valid = scanHook.Parse( corpus.c_str(), corpus.size() ) && validator.Validate( &scanHook ) && 
+            scanHook.Finish() && valid;
+  }
+  secs = ElapsedSecs(start);
+  printf( "%-8s: %s, %.3f secs, %.2f MB/sec\n", "scan", valid?"valid":"not valid", secs, 
+    secs > 0 ? corpus.size()*noRuns/secs/(1024.0*1024.0) : 0.0 );
+}
+void BenchBooks()
+{
+  ScvalVMCode bytecode;
+  if ( ! ScvalCompile( g_booksSchema, bytecode ) )
+  {
+    printf( "Error building scval bytecode\n" );
+    return;
+  }
+  std::string corpus;
+  GenerateBooksCorpus( corpus, 100000 );
+  TinyXMLHooks xmlHook;
+  if ( !xmlHook.Parse( corpus.c_str() ) )
+    return;
+  printf( "\nBenchmarking %d bytes corpus...\n", (int)corpus.size() );
+  BenchEngines( bytecode, xmlHook, 10 );
+
+  ScvalVMCode unfusedBytecode;
+  if ( ScvalCompile( g_booksSchema, unfusedBytecode, COMPILE_NOFUSION ) )
+  {
+    printf( "\nBenchmarking without superinstructions...\n" );
+    BenchEngines( unfusedBytecode, xmlHook, 10 );
+  }
+  printf( "\nBenchmarking the validation by workers...\n" );
+  BenchParallel( bytecode, xmlHook, corpus.size(), 8, 5 );
+  printf( "\nBenchmarking the parser on books.xml scaled up...\n" );
+  BenchParse( 512 );
+  printf( "\nBenchmarking parsing and validation...\n" );
+  BenchStream( bytecode, corpus, 5 );
+  printf( "\nBenchmarking small documents...\n" );
+  BenchSession( bytecode, 10000 );
+  printf( "\nBenchmarking a stream of documents...\n" );
+  BenchReuse( bytecode, 10000 );
+  BenchWide( 80, 200000 );
+}
+
+//===---------------------------------------------------------------------------===//
+// Cross check of all the engines on random schemas and documents
+//===---------------------------------------------------------------------------===//
+const char* g_randomTypes[]={ "str", "int", "real", "bool", "cust" };
+const char* g_randomValues[]={ "text", "42", "4.2", "true", "ok" };
+const char* g_randomBadValues[]={ "", "4x", "4.2.1", "maybe", "Xbad" };
+struct RandomNode
+{
+  std::string name;
+  char mult;   // ! ? * +
+  int type;    // index in g_randomTypes, -1 when it has children
+  bool asType; // attributes and children written as an element type
+  std::vector<RandomNode> attrs;
+  std::vector<RandomNode> children;
+};
+// Custom types fail when the value starts with X
+class RandomHooks : public TinyXMLHooks
+{
+public:
+  // plain: names hashed by the VM, one element at a time
+  RandomHooks( bool plain=false )
+  {
+    doc.SetNameHashing( !plain, !plain );
+    EnableBatching( !plain );
+  }
+  bool Check( ScvalHashID /*typeName*/, const char* value ){ return value && value[0] != 'X'; }
+  static bool CheckCust( const char* value, unsigned int /*len*/, void* /*user*/ ){ return value && value[0] != 'X'; }
+  static void CheckBatch( ScvalDeferredCheck* checks, unsigned int count, void* user )
+  {
+    for ( unsigned int i = 0; i < count; ++i )
+      checks[i].result = CheckCust( checks[i].value, checks[i].len, user );
+  }
+  virtual const char* Do( ScvalVMOpcode opcode, ScvalHashID typeName=INVALIDHASH, const char* value=0 )
+  {
+    if ( opcode == VM_CALL )
+      return (const char*)(size_t)( Check( typeName, value ) ? 1 : 0 );
+    return TinyXMLHooks::Do( opcode, typeName, value );
+  }
+};
+// Names from the parser, one element at a time: a failed validation stops
+// at the same element whatever the VM
+class SteppedHooks : public RandomHooks
+{
+public:
+  SteppedHooks(){ EnableBatching( false ); }
+};
+// Counts the loads the VM asks for, decoded and raw
+class CountingHooks : public SteppedHooks
+{
+public:
+  CountingHooks():m_loads(0), m_rawLoads(0){}
+  virtual void Load( ScvalVMOpcode opcode, ScvalHookString& out ){ ++m_loads; SteppedHooks::Load( opcode, out ); }
+  virtual void LoadRaw( ScvalVMOpcode opcode, ScvalHookString& out ){ ++m_rawLoads; SteppedHooks::LoadRaw( opcode, out ); }
+  void Rewind(){ m_loads = m_rawLoads = 0; SteppedHooks::Rewind(); }
+  unsigned int m_loads;
+  unsigned int m_rawLoads;
+};
+// Index of the child of the root element with the node, -1 for the root
+int RecordOf( const tinyxml2::XMLNode* node )
+{
+  while ( node && node->Parent() && node->Parent()->Parent() && !node->Parent()->Parent()->ToDocument() )
+    node = node->Parent();
+  if ( !node || !node->Parent() || node->Parent()->ToDocument() )
+    return -1;
+  int index = 0;
+  for ( const tinyxml2::XMLElement* e = node->PreviousSiblingElement(); e; e = e->PreviousSiblingElement() )
+    ++index;
+  return index;
+}
+bool Chance( int percent ){ return rand()%100 < percent; }
+void GenerateRandomNode( RandomNode& node, const std::string& name, int depth )
+{
+  static const char mults[]="!?*+";
+  node.name = name;
+  node.mult = mults[rand()%4];
+  node.type = -1;
+  if ( depth >= 3 || Chance(50) )
+    node.type = rand()%5;
+  node.asType = node.type == -1 && depth > 0 && Chance(30);
+  // now and then, wide enough to be compiled as a hashed switch
+  int noAttrs = Chance(40) ? ( Chance(10) ? 8+rand()%4 : 1+rand()%2 ) : 0;
+  for ( int i = 0; i < noAttrs; ++i )
+  {
+    node.attrs.push_back( RandomNode() );
+    RandomNode& a = node.attrs.back();
+    a.name = std::string("at") + char('a'+i);
+    a.mult = Chance(50) ? '!' : '?';
+    a.type = rand()%4;
+    a.asType = false;
+  }
+  if ( node.type == -1 )
+  {
+    int noChildren = depth < 2 && Chance(15) ? 8+rand()%8 : 1+rand()%4;
+    for ( int i = 0; i < noChildren; ++i )
+    {
+      node.children.push_back( RandomNode() );
+      GenerateRandomNode( node.children.back(), name+char('a'+i), depth+1 );
+    }
+  }
+}
+void RandomAttrsToSchema( const RandomNode& node, std::string& out )
+{
+  if ( node.attrs.empty() )
+    return;
+  out += "[";
+  for ( size_t i = 0; i < node.attrs.size(); ++i )
+    out += std::string(" ") + node.attrs[i].mult + node.attrs[i].name + "(" + g_randomTypes[node.attrs[i].type] + ")";
+  out += "]";
+}
+// With typedefs, the nodes marked as types go there as element types
+void RandomNodeToSchema( const RandomNode& node, std::string& out, std::string* typedefs=0 )
+{
+  out += node.mult;
+  out += node.name;
+  if ( node.asType && typedefs )
+  {
+    std::string body = "@t" + node.name + " {";
+    RandomAttrsToSchema( node, body );
+    for ( size_t i = 0; i < node.children.size(); ++i )
+    {
+      body += " ";
+      RandomNodeToSchema( node.children[i], body, typedefs );
+    }
+    *typedefs += body + "} ";
+    out += "(t" + node.name + ")";
+    return;
+  }
+  if ( node.type != -1 )
+    out += std::string("(") + g_randomTypes[node.type] + ")";
+  RandomAttrsToSchema( node, out );
+  if ( node.type == -1 )
+  {
+    out += "{";
+    for ( size_t i = 0; i < node.children.size(); ++i )
+    {
+      out += " ";
+      RandomNodeToSchema( node.children[i], out, typedefs );
+    }
+    out += "}";
+  }
+}
+// Mostly valid documents, with some mistakes here and there
+const char* RandomValue( int type )
+{
+  return Chance(5) && type ? g_randomBadValues[type] : g_randomValues[type];
+}
+void RandomNodeToDocument( const RandomNode& node, std::string& out )
+{
+  out += "<" + node.name;
+  for ( size_t i = 0; i < node.attrs.size(); ++i )
+  {
+    const RandomNode& a = node.attrs[i];
+    if ( (a.mult == '!' && !Chance(3)) || (a.mult == '?' && Chance(50)) )
+      out += " " + a.name + "=\"" + RandomValue(a.type) + "\"";
+  }
+  if ( Chance(2) )
+    out += " unknown=\"1\"";
+  out += ">";
+  if ( node.type != -1 )
+    out += RandomValue(node.type);
+  for ( size_t i = 0; i < node.children.size(); ++i )
+  {
+    const RandomNode& c = node.children[i];
+    int count = 1;
+    switch ( c.mult )
+    {
+    case '?': count = rand()%2; break;
+    case '*': count = rand()%4; break;
+    case '+': count = 1+rand()%3; break;
+    }
+    if ( Chance(3) )
+      count += Chance(50) ? 1 : -1;
+    for ( int j = 0; j < count; ++j )
+      RandomNodeToDocument( c, out );
+  }
+  if ( node.type == -1 && Chance(2) )
+    out += "<unknown/>";
+  out += "</" + node.name + ">";
+}
+void CrossCheckEngines( int noSchemas, int noDocuments )
+{
+  const ScvalVMEngine engines[]={ VMENGINE_SWITCH, VMENGINE_THREADED, VMENGINE_JIT };
+  const int noEngines = ScvalJitSupported() ? 3 : 2;
+  int mismatches = 0, validDocs = 0, totalDocs = 0, earlyRejects = 0;
+  // the reference goes step by step hashing the names in the VM, the others
+  // get them from the parser and walk the batched enumerations. Reused for
+  // all the documents, in arena mode.
+  RandomHooks plainHook( true ), xmlHook;
+  SteppedHooks steppedHook;
+  CountingHooks countingHook;
+  ScvalScanHooks scanHook;
+  srand( 1234 );
+  for ( int s = 0; s < noSchemas; ++s )
+  {
+    RandomNode root;
+    GenerateRandomNode( root, "r", 0 );
+    std::string schema = "@cust #CUST ", inlined = schema, typedefs;
+    RandomNodeToSchema( root, inlined );
+    RandomNodeToSchema( root, schema, &typedefs );
+    schema = typedefs + schema;
+    // the reference is the plain compare chains code in the switch interpreter,
+    // with all the element types inlined
+    ScvalVMCode bytecodes[2], reference;
+    if ( !ScvalCompile( schema.c_str(), bytecodes[0] ) || 
+         !ScvalCompile( schema.c_str(), bytecodes[1], COMPILE_NOFUSION ) ||
+         !ScvalCompile( inlined.c_str(), reference, COMPILE_NOFUSION|COMPILE_NOSWITCH ) )
+    {
+      printf( "Error building scval bytecode for %s\n", schema.c_str() );
+      ++mismatches;
+      continue;
+    }
+    ScvalValidator validators[2][3], deferredValidators[3];
+    ScvalVMT<RandomHooks> staticValidators[2];
+    for ( int b = 0; b < 2; ++b )
+    {
+      for ( int e = 0; e < noEngines; ++e )
+      {
+        // the checks through the hook, and registered in the VM
+        if ( b )
+          validators[b][e].RegisterCheck( ScvalHash("CUST"), RandomHooks::CheckCust );
+        validators[b][e].Bind( bytecodes[b], engines[e] );
+        // small, so the entries collide
+        validators[b][e].EnableCallCache( b ? 0 : 16 );
+        validators[b][e].SetCallCacheable( ScvalHash("CUST") );
+      }
+      if ( b )
+        staticValidators[b].RegisterCheck( ScvalHash("CUST"), RandomHooks::CheckCust );
+      staticValidators[b].Bind( bytecodes[b] );
+    }
+    // small batches, checked in the middle of the document too
+    for ( int e = 0; e < noEngines; ++e )
+    {
+      deferredValidators[e].Bind( bytecodes[0], engines[e] );
+      deferredValidators[e].EnableDeferredChecks( RandomHooks::CheckBatch, 0, 4 );
+      deferredValidators[e].EnableCallCache( e ? 16 : 0 );
+      deferredValidators[e].SetCallCacheable( ScvalHash("CUST") );
+    }
+    // the records by workers, small chunks so the documents are split
+    TinyXMLParallelValidator<SteppedHooks> parallelValidator( 3, 1+s%3 );
+    if ( s%2 )
+      parallelValidator.RegisterCheck( ScvalHash("CUST"), RandomHooks::CheckCust );
+    parallelValidator.Bind( bytecodes[s%2], engines[s%noEngines] );
+    ScvalValidator steppedValidator( bytecodes[0] );
+    // without and with statistics, they mustn't change what the hook is asked
+    ScvalValidator statsValidators[2][3];
+    for ( int t = 0; t < 2; ++t )
+      for ( int e = 0; e < noEngines; ++e )
+      {
+        statsValidators[t][e].RegisterCheck( ScvalHash("CUST"), RandomHooks::CheckCust );
+        statsValidators[t][e].Bind( bytecodes[s%2], engines[e] );
+#ifndef SCVAL_NO_STATS
+        statsValidators[t][e].EnableStats( t == 1 );
+#endif
+      }
+    // a custom type without check can't be bound
+    bool hasCalls = false;
+    for ( unsigned int i = 0; i < bytecodes[0].m_noOperations; ++i )
+      hasCalls = hasCalls || bytecodes[0].m_code[i].opcode == VM_CALL;
+    ScvalValidator unchecked;
+    unchecked.RegisterCheck( ScvalHash("OTHER"), RandomHooks::CheckCust );
+    ScvalVMT<RandomHooks> uncheckedStatic;
+    uncheckedStatic.RegisterCheck( ScvalHash("OTHER"), RandomHooks::CheckCust );
+    if ( unchecked.Bind( bytecodes[0] ) == hasCalls || uncheckedStatic.Bind( bytecodes[0] ) == hasCalls )
+    {
+      printf( "Binding a custom type without check %s\n", hasCalls ? "succeeded" : "failed" );
+      ++mismatches;
+    }
+    for ( int d = 0; d < noDocuments; ++d )
+    {
+      std::string doc;
+      RandomNodeToDocument( root, doc );
+      if ( !plainHook.Parse( doc.c_str() ) || !xmlHook.Parse( doc.c_str() ) )
+        continue;
+      const bool expected = ScvalValidate( reference, &plainHook );
+      bool mismatch = false;
+      for ( int b = 0; b < 2; ++b )
+      {
+        for ( int e = 0; e < noEngines; ++e )
+        {
+          xmlHook.Rewind();
+          mismatch = validators[b][e].Validate( &xmlHook ) != expected || mismatch;
+        }
+        xmlHook.Rewind();
+        mismatch = staticValidators[b].Validate( xmlHook ) != expected || mismatch;
+      }
+      for ( int e = 0; e < noEngines; ++e )
+      {
+        xmlHook.Rewind();
+        mismatch = deferredValidators[e].Validate( &xmlHook ) != expected || mismatch;
+        // a failed check tells the element or attribute where the bad value is
+        const ScvalDeferredCheck* failed = deferredValidators[e].GetFailedCheck();
+        if ( failed )
+        {
+          const tinyxml2::XMLElement* elmt = (const tinyxml2::XMLElement*)failed->node;
+          mismatch = !elmt || !elmt->GetText() || strcmp( elmt->GetText(), failed->value ) != 0 || 
+                     failed->value[0] != 'X' || mismatch;
+        }
+      }
+      // streamed, from memory and from a file read by small chunks
+      for ( int e = 0; e < noEngines; ++e )
+      {
+        TinyXMLStreamHooks streamHook( e ? 64*1024 : 16 );
+        bool loaded;
+        FILE* file = e ? 0 : tmpfile();
+        if ( file )
+        {
+          fwrite( doc.c_str(), 1, doc.size(), file );
+          rewind( file );
+          loaded = streamHook.Open( file );
+        }
+        else
+          loaded = streamHook.Parse( doc.c_str(), doc.size() );
+        const bool valid = loaded && validators[1][e].Validate( &streamHook );
+        mismatch = !streamHook.Finish() || valid != expected || mismatch;
+        if ( file )
+          fclose( file );
+      }
+      // by records, from memory and from a file read by small chunks
+      for ( int e = 0; e < noEngines; ++e )
+      {
+        TinyXMLRecordHooks recordHook( e ? 64*1024 : 16 );
+        bool loaded;
+        FILE* file = e ? 0 : tmpfile();
+        if ( file )
+        {
+          fwrite( doc.c_str(), 1, doc.size(), file );
+          rewind( file );
+          loaded = recordHook.Open( file );
+        }
+        else
+          loaded = recordHook.Parse( doc.c_str(), doc.size() );
+        const bool valid = loaded && validators[1][e].Validate( &recordHook );
+        mismatch = !recordHook.Finish() || valid != expected || mismatch;
+        if ( file )
+          fclose( file );
+      }
+      // scanned in place
+      for ( int e = 0; e < noEngines; ++e )
+      {
+        const bool valid = scanHook.Parse( doc.c_str(), doc.size() ) && validators[1][e].Validate( &scanHook );
+        mismatch = !scanHook.Finish() || valid != expected || mismatch;
+      }
+      // by workers, failing where a single VM fails
+      if ( steppedHook.Parse( doc.c_str() ) )
+      {
+        const bool single = steppedValidator.Validate( &steppedHook );
+        const tinyxml2::XMLElement* failed = steppedHook.Current();
+        steppedHook.Rewind();
+        const bool valid = parallelValidator.Validate( steppedHook );
+        const int record = parallelValidator.GetFailedRecord();
+        mismatch = single != expected || valid != expected || mismatch;
+        mismatch = ( !valid && (parallelValidator.GetFailedElement() != failed || (record >= 0 && record != RecordOf( failed ))) ) || mismatch;
+      }
+      else
+        mismatch = true;
+      // with statistics, the same loads and checks for every engine
+      if ( countingHook.Parse( doc.c_str() ) )
+      {
+        unsigned int calls = 0;
+        for ( int e = 0; e < noEngines; ++e )
+        {
+          countingHook.Rewind();
+          const bool valid = statsValidators[0][e].Validate( &countingHook );
+          const unsigned int loads = countingHook.m_loads, rawLoads = countingHook.m_rawLoads;
+          countingHook.Rewind();
+          const bool statsValid = statsValidators[1][e].Validate( &countingHook );
+#ifndef SCVAL_NO_STATS
+          const ScvalVMStats* stats = statsValidators[1][e].GetStats();
+#else
+          const ScvalVMStats* stats = 0;
+#endif
+          const unsigned int statsCalls = stats ? stats->GetCallCount( ScvalHash("CUST") ) : 0;
+          mismatch = valid != expected || statsValid != expected || mismatch;
+          mismatch = countingHook.m_loads != loads || countingHook.m_rawLoads != rawLoads || mismatch;
+          mismatch = ( stats && stats->m_hookCount[VM_LDEV]+stats->m_hookCount[VM_LDAV]+stats->m_hookCount[VM_LDEN]+stats->m_hookCount[VM_LDAN] != loads+rawLoads ) || mismatch;
+          mismatch = ( e && statsCalls != calls ) || mismatch;
+          calls = statsCalls;
+        }
+      }
+      else
+        mismatch = true;
+      // pushed by small chunks, the VM suspends between them
+      ScvalValidator* pushValidators[]={ &validators[1][0], &deferredValidators[0] };
+      for ( int v = 0; v < 2; ++v )
+      {
+        TinyXMLPushValidator pushValidator( *pushValidators[v] );
+        pushValidator.Begin();
+        bool valid = true;
+        size_t pos = 0;
+        while ( valid && pos < doc.size() )
+        {
+          const size_t len = 1+(pos*7+d)%13;
+          valid = pushValidator.Feed( doc.c_str()+pos, pos+len < doc.size() ? len : doc.size()-pos );
+          pos += len;
+        }
+        earlyRejects += pos < doc.size() ? 1 : 0;
+        valid = valid && pushValidator.End();
+        mismatch = valid != expected || mismatch;
+      }
+      if ( mismatch && ++mismatches < 5 )
+        printf( "Mismatch\nschema: %s\ndocument: %s\n", schema.c_str(), doc.c_str() );
+      validDocs += expected ? 1 : 0;
+      ++totalDocs;
+    }
+  }
+  printf( "%d documents (%d valid) on %d schemas, %d mismatches\n", totalDocs, validDocs, noSchemas, mismatches );
+  printf( "%d pushed documents rejected before the end\n", earlyRejects );
+}
+// Recursive element type. Sections nest up to SCVAL_MAX_CALL_DEPTH levels.
+void CrossCheckSections()
+{
+  const char* schema = 
+    "@section { [ ?id(str) ] !title(str) *para(str) *section(section) }"
+    "!doc{ +section(section) }";
+  const ScvalVMEngine engines[]={ VMENGINE_SWITCH, VMENGINE_THREADED, VMENGINE_JIT };
+  const int noEngines = ScvalJitSupported() ? 3 : 2;
+  ScvalVMCode bytecode;
+  if ( !ScvalCompile( schema, bytecode ) )
+  {
+    printf( "Error building scval bytecode\n" );
+    return;
+  }
+  int mismatches = 0;
+  const int depths[]={ 1, 2, 10, SCVAL_MAX_CALL_DEPTH, SCVAL_MAX_CALL_DEPTH+1 };
+  for ( int i = 0; i < int(sizeof(depths)/sizeof(depths[0])); ++i )
+  {
+    // nested sections, and a bad one (unknown child) at the deepest level when odd
+    for ( int bad = 0; bad < 2; ++bad )
+    {
+      std::string doc = "<doc>";
+      for ( int d = 0; d < depths[i]; ++d )
+        doc += "<section id=\"s\"><title>t</title><para>p</para>";
+      if ( bad )
+        doc += "<section><title>t</title><unknown/></section>";
+      for ( int d = 0; d < depths[i]; ++d ) // with a sibling at the same level
+        doc += "</section><section><title>t</title></section>";
+      doc += "</doc>";
+      const bool expected = !bad && depths[i] <= SCVAL_MAX_CALL_DEPTH;
+      TinyXMLHooks xmlHook;
+      if ( !xmlHook.Parse( doc.c_str() ) )
+        continue;
+      for ( int e = 0; e < noEngines*2; ++e ) // step by step, and batched
+      {
+        xmlHook.Rewind();
+        xmlHook.EnableBatching( e >= noEngines );
+        if ( ScvalValidate( bytecode, &xmlHook, engines[e%noEngines] ) != expected )
+        {
+          printf( "Mismatch, %d nested sections%s, engine %d\n", depths[i], bad?" (bad)":"", e );
+          ++mismatches;
+        }
+      }
+      xmlHook.Rewind();
+      if ( ScvalVMT<TinyXMLHooks>( bytecode ).Validate( xmlHook ) != expected )
+      {
+        printf( "Mismatch, %d nested sections%s, static hook\n", depths[i], bad?" (bad)":"" );
+        ++mismatches;
+      }
+    }
+  }
+  printf( "sections: %d operations, %d mismatches\n", bytecode.m_noOperations, mismatches );
+}
+// TinyXMLHooks without printing the errors, for the documents not well formed
+class QuietHooks : public TinyXMLHooks
+{
+public:
+  bool Parse( const std::string& xmltext )
+  {
+    if ( doc.Parse( xmltext.c_str(), xmltext.size() ) != tinyxml2::XML_SUCCESS )
+      return false;
+    Rewind();
+    return true;
+  }
+  bool HasRoot(){ return doc.FirstChildElement() != 0; }
+};
+bool SameString( const ScvalHookString& a, const ScvalHookString& b )
+{
+  const size_t lenA = a.str ? (a.sized ? a.len : strlen(a.str)) : 0;
+  const size_t lenB = b.str ? (b.sized ? b.len : strlen(b.str)) : 0;
+  return !a.str == !b.str && lenA == lenB && (!a.str || memcmp( a.str, b.str, lenA ) == 0) &&
+         (!a.hashed || !b.hashed || a.hash == b.hash);
+}
+// Reads the elements from the current one to the end of its siblings with
+// both hooks, false when a name or a value differs
+template<typename HookA, typename HookB>
+bool SameReading( HookA& a, HookB& b )
+{
+  ScvalHookString strA, strB;
+  for (;;)
+  {
+    a.ElementName( strA ); b.ElementName( strB );
+    if ( !SameString( strA, strB ) )
+      return false;
+    if ( !strA.str )
+      return true;
+    a.ElementValue( strA ); b.ElementValue( strB );
+    if ( !SameString( strA, strB ) )
+      return false;
+    a.FirstAttribute(); b.FirstAttribute();
+    for (;;)
+    {
+      a.AttributeName( strA ); b.AttributeName( strB );
+      if ( !SameString( strA, strB ) )
+        return false;
+      if ( !strA.str )
+        break;
+      a.AttributeValue( strA ); b.AttributeValue( strB );
+      if ( !SameString( strA, strB ) )
+        return false;
+      a.NextAttribute(); b.NextAttribute();
+    }
+    a.Down(); b.Down();
+    const bool same = SameReading( a, b );
+    a.Up(); b.Up();
+    if ( !same )
+      return false;
+    a.NextElement(); b.NextElement();
+  }
+}
+// Adds what the generated documents don't have: prolog, comments,
+// declarations, white space and new lines, entities and CDATA
+void DecorateDocument( const std::string& doc, std::string& out )
+{
+  static const char* const prologs[]={ "", "\xef\xbb\xbf", "<?xml version=\"1.0\"?>\r\n", "<!DOCTYPE r>\n<!-- c -->" };
+  out = prologs[rand()%4];
+  bool tag = false;
+  char quote = 0;
+  for ( size_t i = 0; i < doc.size(); ++i )
+  {
+    const char c = doc[i];
+    if ( !tag && c == '<' )
+    {
+      if ( Chance(5) ) out += "<!-- a <b> -->";
+      if ( Chance(5) ) out += "<?pi x?>";
+      if ( Chance(5) ) out += "\r\n  ";
+      tag = true;
+    }
+    else if ( !tag && i && doc[i-1] == '>' && Chance(10) )
+    {
+      // a text as CDATA
+      const size_t end = doc.find( '<', i );
+      out += "<![CDATA[" + doc.substr( i, end-i ) + (Chance(20) ? "\r\n]]>" : "]]>");
+      i = end-1;
+      continue;
+    }
+    else if ( tag && c == ' ' && !quote && Chance(10) )
+    {
+      out += " \r\n\t";
+      continue;
+    }
+    else if ( tag && (c == '\"' || c == '\'') )
+      quote = quote == c ? 0 : (quote ? quote : c);
+    else if ( tag && c == '>' && !quote )
+      tag = false;
+    if ( (!tag || quote) && c == 'e' && Chance(10) )
+      out += Chance(50) ? "&#101;" : "&#x65;";
+    else if ( (!tag || quote) && c == 't' && Chance(5) )
+      out += "t&amp;t&lt;&bad;\r";
+    else
+      out += c;
+  }
+  if ( Chance(10) )
+    out += "\n<!-- end -->\n";
+}
+// Breaks the document: cut, a char replaced or removed
+void MutateDocument( std::string& doc )
+{
+  static const char chars[]="<>/=\"' &!?-[]ax";
+  const size_t pos = rand()%doc.size();
+  switch ( rand()%3 )
+  {
+  case 0: doc.resize( pos ); break;
+  case 1: doc[pos] = chars[rand()%(sizeof(chars)-1)]; break;
+  case 2: doc.erase( pos, 1 ); break;
+  }
+}
+// The parser gives the same document, or error, in all its scan modes
+bool SameInScanModes( const std::string& text )
+{
+  const tinyxml2::XMLUtil::ScanMode best = tinyxml2::XMLUtil::SetScanMode( tinyxml2::XMLUtil::SCAN_AUTO );
+  std::string reference;
+  tinyxml2::XMLError referenceError = tinyxml2::XML_SUCCESS;
+  bool same = true;
+  for ( int m = tinyxml2::XMLUtil::SCAN_SCALAR; m <= best; ++m )
+  {
+    tinyxml2::XMLUtil::SetScanMode( (tinyxml2::XMLUtil::ScanMode)m );
+    tinyxml2::XMLDocument doc;
+    const tinyxml2::XMLError error = doc.Parse( text.c_str(), text.size() );
+    tinyxml2::XMLPrinter printer;
+    doc.Print( &printer );
+    if ( m == tinyxml2::XMLUtil::SCAN_SCALAR )
+    {
+      reference = printer.CStr();
+      referenceError = error;
+    }
+    else
+      same = same && error == referenceError && reference == printer.CStr();
+  }
+  tinyxml2::XMLUtil::SetScanMode( tinyxml2::XMLUtil::SCAN_AUTO );
+  return same;
+}
+// The scanner hook reads the same documents and strings as TinyXML:
+// books.xml, a generated catalog and random documents, decorated and broken
+void CrossCheckScanner( int noDocuments )
+{
+  int mismatches = 0, wellFormed = 0, totalDocs = 0, modeMismatches = 0, recordMismatches = 0;
+  QuietHooks xmlHook;
+  ScvalScanHooks scanHook;
+  TinyXMLRecordHooks recordHook;
+  std::string catalog;
+  GenerateBooksCorpus( catalog, 1000 );
+  srand( 4321 );
+  for ( int d = -2; d < noDocuments; ++d )
+  {
+    std::string doc;
+    if ( d == -2 )
+    {
+      FILE* file = fopen( "books.xml", "rb" );
+      char chunk[4096];
+      size_t len;
+      while ( file && (len = fread( chunk, 1, sizeof(chunk), file )) > 0 )
+        doc.append( chunk, len );
+      if ( file )
+        fclose( file );
+    }
+    else if ( d == -1 )
+      doc = catalog;
+    else
+    {
+      RandomNode root;
+      std::string plain;
+      GenerateRandomNode( root, "r", 0 );
+      RandomNodeToDocument( root, plain );
+      DecorateDocument( plain, doc );
+      if ( d%2 )
+        MutateDocument( doc );
+    }
+    // the strings read while scanning, then what's left has to be well formed
+    const bool expected = xmlHook.Parse( doc );
+    bool same = true;
+    if ( scanHook.Parse( doc.c_str(), doc.size() ) && expected )
+      same = SameReading( xmlHook, scanHook );
+    same = same && scanHook.Finish() == expected;
+    // and by records, streaming the root as TinyXMLStreamHooks: a document
+    // without root element is not well formed
+    bool sameRecords = true;
+    const bool expectedRecords = expected && xmlHook.HasRoot();
+    xmlHook.Rewind();
+    if ( recordHook.Parse( doc.c_str(), doc.size() ) && expectedRecords )
+      sameRecords = SameReading( xmlHook, recordHook );
+    sameRecords = sameRecords && recordHook.Finish() == expectedRecords;
+    if ( !sameRecords && ++recordMismatches < 5 )
+      printf( "Mismatch by records, %s by TinyXML\ndocument: %s\n", expected ? "well formed" : "not well formed", doc.c_str() );
+    if ( !SameInScanModes( doc ) && ++modeMismatches < 5 )
+      printf( "Mismatch between the scan modes of the parser\ndocument: %s\n", doc.c_str() );
+    if ( !same && ++mismatches < 5 )
+      printf( "Mismatch, %s by TinyXML\ndocument: %s\n", expected ? "well formed" : "not well formed", doc.c_str() );
+    wellFormed += expected ? 1 : 0;
+    ++totalDocs;
+  }
+  printf( "scanner: %d documents (%d well formed), %d mismatches\n", totalDocs, wellFormed, mismatches );
+  printf( "records: %d mismatches\n", recordMismatches );
+  printf( "parser scan modes: up to %s, %d mismatches\n", 
+    tinyxml2::XMLUtil::GetScanMode() == tinyxml2::XMLUtil::SCAN_AVX2 ? "avx2" : 
+    tinyxml2::XMLUtil::GetScanMode() == tinyxml2::XMLUtil::SCAN_SSE2 ? "sse2" : "scalar", modeMismatches );
+}
+
+//===---------------------------------------------------------------------------===//
+// The hooks leaving the checks of the custom types to the validator fail
+// books.xml without the checks registered, and validate it with them
+//===---------------------------------------------------------------------------===//
+template<typename Hook>
+int CrossCheckRegisteredChecks( const ScvalVMCode& bytecode, const std::string& doc )
+{
+  ScvalValidator unchecked( bytecode ), checked;
+  ScvalVMT<Hook> uncheckedStatic( bytecode ), checkedStatic;
+  TinyXMLHooks::RegisterChecks( checked );
+  TinyXMLHooks::RegisterChecks( checkedStatic );
+  checked.Bind( bytecode );
+  checkedStatic.Bind( bytecode );
+  Hook hook;
+  int mismatches = 0;
+  mismatches += hook.Parse( doc.c_str(), doc.size() ) && unchecked.Validate( &hook ) ? 1 : 0;
+  mismatches += hook.Parse( doc.c_str(), doc.size() ) && uncheckedStatic.Validate( hook ) ? 1 : 0;
+  mismatches += hook.Parse( doc.c_str(), doc.size() ) && checked.Validate( &hook ) ? 0 : 1;
+  mismatches += hook.Parse( doc.c_str(), doc.size() ) && checkedStatic.Validate( hook ) ? 0 : 1;
+  return mismatches;
+}
+void CrossCheckHookChecks()
+{
+  ScvalVMCode bytecode;
+  std::string books;
+  int mismatches = 0;
+  if ( !ScvalCompile( g_booksSchema, bytecode ) || !ScaleBooksFile( books, 1 ) )
+    ++mismatches;
+  mismatches += CrossCheckRegisteredChecks<ScvalScanHooks>( bytecode, books );
+  mismatches += CrossCheckRegisteredChecks<TinyXMLStreamHooks>( bytecode, books );
+  mismatches += CrossCheckRegisteredChecks<TinyXMLRecordHooks>( bytecode, books );
+  printf( "hooks without checks: %d mismatches\n", mismatches );
+}
+// Occurrences of the elements and attributes, compared when their loops end
+void CrossCheckOccurrences()
+{
+  struct Occurrences
+  {
+    const char* schema;
+    const char* doc;
+    bool expected;
+  };
+  static const Occurrences cases[]={
+    { "!r[ !a(str) ?b(str) ]{ !x(str) +y(str) ?z(str) *w(str) }", "<r a=\"1\"><x>1</x><y>1</y></r>", true },
+    { "!r[ !a(str) ?b(str) ]{ !x(str) +y(str) ?z(str) *w(str) }", "<r a=\"1\" b=\"1\"><w>1</w><y>1</y><z>1</z><y>1</y><x>1</x><w>1</w></r>", true },
+    { "!r[ !a(str) ?b(str) ]{ !x(str) +y(str) ?z(str) *w(str) }", "<r><x>1</x><y>1</y></r>", false },
+    { "!r[ !a(str) ?b(str) ]{ !x(str) +y(str) ?z(str) *w(str) }", "<r a=\"1\"><y>1</y></r>", false },
+    { "!r[ !a(str) ?b(str) ]{ !x(str) +y(str) ?z(str) *w(str) }", "<r a=\"1\"><x>1</x><x>1</x><y>1</y></r>", false },
+    { "!r[ !a(str) ?b(str) ]{ !x(str) +y(str) ?z(str) *w(str) }", "<r a=\"1\"><x>1</x></r>", false },
+    { "!r[ !a(str) ?b(str) ]{ !x(str) +y(str) ?z(str) *w(str) }", "<r a=\"1\"><x>1</x><y>1</y><z>1</z><z>1</z></r>", false },
+    { "!r[ !a(str) ?b(str) ]{ !x(str) +y(str) ?z(str) *w(str) }", "<r a=\"1\"/>", false },
+    // the counters of the siblings are not the ones of the elements inside
+    { "!r{ *a{ !x(str) } ?b(str) }", "<r><b>1</b><a><x>1</x></a><a><x>1</x></a></r>", true },
+    { "!r{ *a{ !x(str) } ?b(str) }", "<r><b>1</b><a><x>1</x><x>1</x></a></r>", false },
+    { "!r{ *a{ *x(str) } *c{ !y(str) } }", "<r><a><x>1</x><x>1</x></a><c><y>1</y></c></r>", true },
+    { "@t{ !x(str) } !r{ *a(t) ?b(str) }", "<r><b>1</b><a><x>1</x></a><a><x>1</x></a></r>", true },
+    { "@t{ !x(str) } !r{ *a(t) ?b(str) }", "<r><a><x>1</x></a><a/></r>", false }
+  };
+  const int noCases = int(sizeof(cases)/sizeof(cases[0]));
+  const ScvalVMEngine engines[]={ VMENGINE_SWITCH, VMENGINE_THREADED, VMENGINE_JIT };
+  const int noEngines = ScvalJitSupported() ? 3 : 2;
+  int mismatches = 0;
+  for ( int i = 0; i < noCases; ++i )
+  {
+    ScvalVMCode bytecode;
+    TinyXMLHooks xmlHook;
+    bool mismatch = !ScvalCompile( cases[i].schema, bytecode ) || !xmlHook.Parse( cases[i].doc );
+    for ( int e = 0; e < noEngines*2 && !mismatch; ++e ) // step by step, and batched
+    {
+      xmlHook.Rewind();
+      xmlHook.EnableBatching( e >= noEngines );
+      mismatch = ScvalValidate( bytecode, &xmlHook, engines[e%noEngines] ) != cases[i].expected;
+    }
+    xmlHook.Rewind();
+    mismatch = ScvalVMT<TinyXMLHooks>( bytecode ).Validate( xmlHook ) != cases[i].expected || mismatch;
+    if ( mismatch )
+    {
+      printf( "Mismatch, occurrences\nschema: %s\ndocument: %s\n", cases[i].schema, cases[i].doc );
+      ++mismatches;
+    }
+  }
+  printf( "occurrences: %d documents, %d mismatches\n", noCases, mismatches );
+}
+// The native types int and real, from the values alone and in documents
+// (an element without text is a missing value)
+void CrossCheckNativeTypes()
+{
+  struct NativeValue
+  {
+    const char* value;
+    bool isInteger;
+    bool isReal;
+  };
+  static const NativeValue values[]={
+    { "0", true, true }, { "42", true, true }, { "-5", true, true }, { "+7", true, true },
+    { "4.5", false, true }, { "-.5", false, true }, { "5.", false, true }, { "+0.25", false, true },
+    { "", false, false }, { "-", false, false }, { ".", false, false }, { "-.", false, false },
+    { "4.5.1", false, false }, { "32p", false, false }, { " 1", false, false }, { "1e3", false, false },
+    { "--1", false, false }, { "1-", false, false }
+  };
+  const int noValues = int(sizeof(values)/sizeof(values[0]));
+  const ScvalVMEngine engines[]={ VMENGINE_SWITCH, VMENGINE_THREADED, VMENGINE_JIT };
+  const int noEngines = ScvalJitSupported() ? 3 : 2;
+  int mismatches = 0;
+  ScvalVMCode bytecode;
+  if ( !ScvalCompile( "!r{ ?i(int) ?f(real) }", bytecode ) )
+    ++mismatches;
+  mismatches += ScvalVM::IsInteger( 0 ) || ScvalVM::IsReal( 0 ) ? 1 : 0;
+  for ( int i = 0; i <= noValues; ++i )
+  {
+    // and the elements without text last
+    const bool missing = i == noValues;
+    const char* value = missing ? "" : values[i].value;
+    const bool isInteger = !missing && values[i].isInteger;
+    const bool isReal = !missing && values[i].isReal;
+    if ( !missing && ( ScvalVM::IsInteger( value ) != isInteger || ScvalVM::IsReal( value ) != isReal ) )
+    {
+      printf( "Mismatch, native value \"%s\"\n", value );
+      ++mismatches;
+    }
+    for ( int t = 0; t < 2; ++t )
+    {
+      const char* name = t ? "f" : "i";
+      const bool expected = t ? isReal : isInteger;
+      const std::string doc = missing ? std::string("<r><")+name+"/></r>" : std::string("<r><")+name+">"+value+"</"+name+"></r>";
+      TinyXMLHooks xmlHook;
+      if ( !xmlHook.Parse( doc.c_str() ) )
+        continue;
+      bool mismatch = false;
+      for ( int e = 0; e < noEngines; ++e )
+      {
+        xmlHook.Rewind();
+        mismatch = ScvalValidate( bytecode, &xmlHook, engines[e] ) != expected || mismatch;
+      }
+      xmlHook.Rewind();
+      mismatch = ScvalVMT<TinyXMLHooks>( bytecode ).Validate( xmlHook ) != expected || mismatch;
+      if ( mismatch )
+      {
+        printf( "Mismatch, native types document: %s\n", doc.c_str() );
+        ++mismatches;
+      }
+    }
+  }
+  printf( "native types: %d values, %d mismatches\n", noValues, mismatches );
+}
+// A check registered again, the cached results of the one before are forgotten
+bool CheckAnyValue( const char* /*value*/, unsigned int /*len*/, void* /*user*/ ){ return true; }
+bool CheckNoValue( const char* /*value*/, unsigned int /*len*/, void* /*user*/ ){ return false; }
+void CrossCheckCachedChecks()
+{
+  const ScvalVMEngine engines[]={ VMENGINE_SWITCH, VMENGINE_THREADED, VMENGINE_JIT };
+  const int noEngines = ScvalJitSupported() ? 3 : 2;
+  int mismatches = 0;
+  ScvalVMCode bytecode;
+  TinyXMLHooks xmlHook;
+  if ( !ScvalCompile( "@cust #CUST !r{ +c(cust) }", bytecode ) || !xmlHook.Parse( "<r><c>1</c><c>2</c></r>" ) )
+    ++mismatches;
+  for ( int e = 0; e < noEngines; ++e )
+  {
+    ScvalValidator validator;
+    validator.EnableCallCache( 16 );
+    validator.SetCallCacheable( ScvalHash("CUST") );
+    validator.RegisterCheck( ScvalHash("CUST"), CheckAnyValue );
+    validator.Bind( bytecode, engines[e] );
+    xmlHook.Rewind();
+    mismatches += validator.Validate( &xmlHook ) ? 0 : 1;
+    // replaced when bound, and before binding again
+    validator.RegisterCheck( ScvalHash("CUST"), CheckNoValue );
+    xmlHook.Rewind();
+    mismatches += validator.Validate( &xmlHook ) ? 1 : 0;
+    validator.RegisterCheck( ScvalHash("CUST"), CheckAnyValue );
+    xmlHook.Rewind();
+    mismatches += validator.Validate( &xmlHook ) ? 0 : 1;
+    validator.RegisterCheck( ScvalHash("CUST"), CheckNoValue );
+    validator.Bind( bytecode, engines[e] );
+    xmlHook.Rewind();
+    mismatches += validator.Validate( &xmlHook ) ? 1 : 0;
+  }
+  printf( "cached checks: %d mismatches\n", mismatches );
+}
+// Elements skipped by the streaming hooks, nested deeper than the levels
+// read so far
+void CrossCheckDeepSkips()
+{
+  ScvalVMCode bytecode;
+  int mismatches = 0;
+  if ( !ScvalCompile( "!r{ *t(str) }", bytecode ) )
+    ++mismatches;
+  ScvalValidator validator( bytecode );
+  const int depths[]={ 1, 16, 40, 200 };
+  for ( int i = 0; i < int(sizeof(depths)/sizeof(depths[0])); ++i )
+  {
+    // and an unknown element after them when odd
+    for ( int bad = 0; bad < 2; ++bad )
+    {
+      std::string doc = "<r><t>";
+      for ( int d = 0; d < depths[i]; ++d )
+        doc += "<a>";
+      for ( int d = 0; d < depths[i]; ++d )
+        doc += "</a>";
+      doc += bad ? "</t><t>x</t><u/></r>" : "</t><t>x</t></r>";
+      TinyXMLHooks xmlHook;
+      const bool expected = xmlHook.Parse( doc.c_str() ) && validator.Validate( &xmlHook );
+      bool mismatch = expected == (bad != 0);
+      for ( int e = 0; e < 2; ++e ) // from memory and from a file read by small chunks
+      {
+        FILE* file = e ? tmpfile() : 0;
+        if ( file )
+        {
+          fwrite( doc.c_str(), 1, doc.size(), file );
+          rewind( file );
+        }
+        TinyXMLStreamHooks streamHook( file ? 16 : 64*1024 );
+        bool loaded = file ? streamHook.Open( file ) : streamHook.Parse( doc.c_str(), doc.size() );
+        mismatch = ( loaded && validator.Validate( &streamHook ) ) != expected || mismatch;
+        if ( file )
+          rewind( file );
+        TinyXMLRecordHooks recordHook( file ? 16 : 64*1024 );
+        loaded = file ? recordHook.Open( file ) : recordHook.Parse( doc.c_str(), doc.size() );
+        mismatch = ( loaded && validator.Validate( &recordHook ) ) != expected || mismatch;
+        if ( file )
+          fclose( file );
+      }
+      ScvalScanHooks scanHook;
+      mismatch = ( scanHook.Parse( doc.c_str(), doc.size() ) && validator.Validate( &scanHook ) ) != expected || mismatch;
+      if ( mismatch )
+      {
+        printf( "Mismatch, %d nested elements skipped%s\n", depths[i], bad?" (bad)":"" );
+        ++mismatches;
+      }
+    }
+  }
+  printf( "deep skips: %d mismatches\n", mismatches );
+}
+
+//===---------------------------------------------------------------------------===//
+// Writes the books validator as C++ source, used by the scvalaot project
+//===---------------------------------------------------------------------------===//
+bool GenerateBooksCpp( const char* outFile, const char* functionName, const char* schema=g_booksSchema )
+{
+  ScvalVMCode bytecode;
+  if ( !ScvalCompile( schema, bytecode ) )
+  {
+    printf( "Error building scval bytecode\n" );
+    return false;
+  }
+  if ( !ScvalGenerateCpp( bytecode, functionName, outFile ) )
+  {
+    printf( "Error writing %s\n", outFile );
+    return false;
+  }
+  printf( "%s written (%s)\n", outFile, functionName );
+  return true;
+}
+
+int main( int argc, char** argv )
+{
+  if ( argc > 2 && strcmp(argv[1],"-gencpp") == 0 )
+    return GenerateBooksCpp( argv[2], argc > 3 ? argv[3] : "ScvalValidateBooks" ) ? 0 : 1;
+  if ( argc > 2 && strcmp(argv[1],"-gencpptyped") == 0 )
+    return GenerateBooksCpp( argv[2], argc > 3 ? argv[3] : "ScvalValidateTypedBooks", g_booksTypedSchema ) ? 0 : 1;
+  if ( argc > 3 && strcmp(argv[1],"-gencorpus") == 0 )
+    return WriteBooksCorpus( argv[3], atoi(argv[2]) ) ? 0 : 1;
+  if ( argc > 3 && strcmp(argv[1],"-benchload") == 0 )
+    return BenchLoad( argv[2], argv[3] ) ? 0 : 1;
+  if ( argc > 2 && strcmp(argv[1],"-benchparse") == 0 )
+  {
+    BenchParse( atoi(argv[2]) );
+    return 0;
+  }
+  if ( argc > 2 && strcmp(argv[1],"-benchparallel") == 0 )
+  {
+    BenchParallel( atoi(argv[2]), argc > 3 ? (unsigned int)atoi(argv[3]) : 32 );
+    return 0;
+  }
+  if ( argc > 1 && strcmp(argv[1],"-bench") == 0 )
+    BenchBooks();
+  else if ( argc > 1 && strcmp(argv[1],"-crosscheck") == 0 )
+  {
+    CrossCheckEngines( 200, 50 );
+    CrossCheckSections();
+    CrossCheckScanner( 20000 );
+    CrossCheckHookChecks();
+    CrossCheckOccurrences();
+    CrossCheckNativeTypes();
+    CrossCheckCachedChecks();
+    CrossCheckDeepSkips();
+  }
+  else
+    TestBooks();
   return 0;
 }
\ No newline at end of file
@@ -1,4 +1,5 @@
 #include "scvaltypes.h"
+#include "scvalvmt.h"
 #include <string.h>
 #include <stdio.h>
 #include <locale>
@@ -10,19 +11,496 @@ void ScvalVMContext::Clear()
 {
   SAFEFREE(m_regCounters);  
   SAFEFREE(m_regStrHashes);
-  for ( int i=0; i < m_stringCount; ++i )
-    SAFEFREE(m_regStrings[i]);
   SAFEFREE(m_regStrings);
+  if ( m_regBuffers )
+  {
+    for ( int i=0; i < m_stringCount; ++i )
+      SAFEFREE(m_regBuffers[i]);
+  }
+  SAFEFREE(m_regBuffers);
+  SAFEFREE(m_regBufferCaps);
+  SAFEFREE(m_frames);
   m_cmpRes = 0;
-  m_stringCount=0;
+  m_counterCount = m_stringCount = m_frameCount = 0;
 }
-void ScvalVMContext::Init( int regC, int regS )
+bool ScvalVMContext::Init( int regC, int regS, int noFrames )
 {
   Clear();
   m_regCounters = (unsigned short*)calloc(regC+1,sizeof(unsigned short));
   m_regStrHashes = (ScvalHashID*)calloc(regS+1,sizeof(ScvalHashID));
-  m_regStrings = (const char**)calloc(regS+1,sizeof(const char*));
+  m_regStrings = (ScvalVMString*)calloc(regS+1,sizeof(ScvalVMString));
+  m_regBuffers = (char**)calloc(regS+1,sizeof(char*));
+  m_regBufferCaps = (unsigned int*)calloc(regS+1,sizeof(unsigned int));
+  m_frames = (ScvalVMFrame*)calloc(noFrames,sizeof(ScvalVMFrame));
+  m_counterCount = regC+1;
   m_stringCount = regS+1;
+  m_frameCount = noFrames;
+  if ( !m_regCounters || !m_regStrHashes || !m_regStrings || !m_regBuffers || !m_regBufferCaps || !m_frames )
+  {
+    Clear();
+    return false;
+  }
+  return true;
+}
+bool ScvalVMContext::Init( const ScvalVMCode& code )
+{
+  // element type subroutines have their registers in a new frame above the caller
+  // ones, each nesting level moves the base at most one frame (all the registers)
+  bool hasJsr = false;
+  for ( unsigned int i = 0; i < code.m_noOperations && !hasJsr; ++i )
+    hasJsr = code.m_code[i].opcode == VM_JSR;
+  const unsigned int frameRegs = (code.m_maxRegCounter > code.m_maxRegStrings ? code.m_maxRegCounter : code.m_maxRegStrings)+1;
+  const unsigned int extraRegs = hasJsr ? frameRegs*SCVAL_MAX_CALL_DEPTH : 0;
+  return Init( code.m_maxRegCounter+extraRegs, code.m_maxRegStrings+extraRegs, SCVAL_MAX_CALL_DEPTH+1 );
+}
+// Back to the initial state, keeping the allocated registers and buffers
+void ScvalVMContext::Reset()
+{
+  memset( m_regCounters, 0, sizeof(unsigned short)*m_counterCount );
+  memset( m_regStrHashes, 0, sizeof(ScvalHashID)*m_stringCount );
+  memset( m_regStrings, 0, sizeof(ScvalVMString)*m_stringCount );
+  m_cmpRes = 0;
+  m_checkStrReg = 0;
+}
+// Loads a hook string in a register and returns its hash. Temporary hook
+// strings are copied into the register buffer, which only grows, and
+// terminated there: a sized one may be a span of the text of the hook.
+ScvalHashID ScvalVMContext::LoadString( int reg, const ScvalHookString& hstr )
+{
+  ScvalVMString& r = m_regStrings[reg];
+  const char* str = hstr.str;
+  ScvalHashID hash;
+  if ( !str || !hstr.sized )
+    hash = ScvalHashLen( str, r.len );
+  else
+  {
+    // supplied by the hook, no need to look for the end of the string
+    r.len = hstr.len;
+    hash = hstr.hashed ? hstr.hash : ScvalHashN( str, r.len );
+  }
+  if ( !str || m_stableStrings )
+  {
+    r.str = str;
+    return hash;
+  }
+  if ( m_regBufferCaps[reg] < r.len+1 )
+  {
+    SAFEFREE(m_regBuffers[reg]);
+    m_regBuffers[reg] = (char*)malloc( r.len+1 );
+    m_regBufferCaps[reg] = m_regBuffers[reg] ? r.len+1 : 0;
+    if ( !m_regBuffers[reg] )
+    {
+      r.str = 0; r.len = 0;
+      return hash;
+    }
+  }
+  memcpy( m_regBuffers[reg], str, r.len );
+  m_regBuffers[reg][r.len] = 0;
+  r.str = m_regBuffers[reg];
+  return hash;
+}
+// A value the code doesn't inspect (VM_RAWVALUE): it's neither hashed nor
+// copied, the register only tells whether there is one.
+ScvalHashID ScvalVMContext::LoadRaw( int reg, const ScvalHookString& hstr )
+{
+  ScvalVMString& r = m_regStrings[reg];
+  r.str = hstr.str;
+  r.len = hstr.str && hstr.sized ? hstr.len : 0;
+  return 0;
+}
+//===---------------------------------------------------------------------------===//
+// Batched enumerations
+//===---------------------------------------------------------------------------===//
+void ScvalVMBatch::Clear()
+{
+  SAFEFREE(m_items);
+  SAFEFREE(m_levels);
+  m_levelCap = 0;
+  m_depth = m_overflow = 0;
+  m_enabled = false;
+}
+void ScvalVMBatch::Reset()
+{
+  m_depth = m_overflow = 0;
+  m_probed = false;
+  if ( !m_levels )
+  {
+    m_levels = (ScvalVMBatchLevel*)malloc( sizeof(ScvalVMBatchLevel)*16 );
+    m_items = (ScvalHookItem*)malloc( sizeof(ScvalHookItem)*16*2*SCVAL_BATCH_SIZE );
+    m_levelCap = m_levels && m_items ? 16 : 0;
+  }
+  m_enabled = m_levelCap != 0;
+  if ( m_enabled )
+    memset( m_levels, 0, sizeof(ScvalVMBatchLevel) );
+}
+// first window of children or attributes, -1 when they go step by step
+int ScvalVMBatch::Fill( ScvalInstHook* hook, ScvalVMOpcode opcode, ScvalHookItem* window )
+{
+  const int n = hook->Enumerate( opcode, 0, window, SCVAL_BATCH_SIZE );
+  if ( n < 0 && !m_probed )
+    m_enabled = false; // not supported, back to the per step protocol
+  m_probed = true;
+  return n;
+}
+// item at the cursor of a window, the next window is enumerated when a full one is consumed
+const ScvalHookItem* ScvalVMBatch::Cursor( ScvalInstHook* hook, ScvalVMOpcode opcode, 
+                                           ScvalHookItem* window, unsigned int& count, unsigned int& cur )
+{
+  if ( cur == count && count == SCVAL_BATCH_SIZE )
+  {
+    const int n = hook->Enumerate( opcode, window[count-1].node, window, SCVAL_BATCH_SIZE );
+    count = n > 0 ? (unsigned int)n : 0;
+    cur = 0;
+  }
+  return cur < count ? window+cur : 0;
+}
+void ScvalVMBatch::LoadBatched( ScvalInstHook* hook, ScvalVMOpcode opcode, ScvalHookString& out, bool raw )
+{
+  ScvalVMBatchLevel& level = m_levels[m_depth];
+  const ScvalHookItem* item;
+  switch ( m_overflow ? VM_NOOPCODES : opcode )
+  {
+  case VM_LDEN:
+  case VM_LDEV:
+    if ( !level.children )
+      break;
+    item = Cursor( hook, VM_NEXT, Children(m_depth), level.count, level.cur );
+    if ( item )
+      out = opcode==VM_LDEN ? item->name : item->value;
+    else
+      out.Set( 0 );
+    return;
+  case VM_LDAN:
+  case VM_LDAV:
+    if ( !level.attrs )
+      break;
+    item = Cursor( hook, VM_GATT, Attributes(m_depth), level.attrCount, level.attrCur );
+    if ( item )
+      out = opcode==VM_LDAN ? item->name : item->value;
+    else
+      out.Set( 0 );
+    return;
+  default: break;
+  }
+  raw ? hook->LoadRaw( opcode, out ) : hook->Load( opcode, out );
+}
+void ScvalVMBatch::NavigateBatched( ScvalInstHook* hook, ScvalVMOpcode opcode )
+{
+  ScvalVMBatchLevel* level = m_levels+m_depth;
+  if ( m_overflow )
+  {
+    if ( opcode == VM_DOWN ) ++m_overflow;
+    else if ( opcode == VM_UP ) --m_overflow;
+    hook->Do( opcode );
+    return;
+  }
+  switch ( opcode )
+  {
+  case VM_NEXT:
+    if ( !level->children )
+      break;
+    ++level->cur;
+    return;
+  case VM_NATT:
+    if ( !level->attrs )
+      break;
+    ++level->attrCur;
+    return;
+  case VM_GATT:
+  case VM_DOWN:
+    // the hook is only moved to the current child when it needs to be there
+    if ( level->children )
+    {
+      const ScvalHookItem* item = Cursor( hook, VM_NEXT, Children(m_depth), level->count, level->cur );
+      if ( item )
+        hook->Select( item->node );
+    }
+    if ( opcode == VM_GATT )
+    {
+      const int n = Fill( hook, VM_GATT, Attributes(m_depth) );
+      level->attrs = n >= 0;
+      level->attrCount = n > 0 ? (unsigned int)n : 0;
+      level->attrCur = 0;
+      if ( level->attrs )
+        return;
+      break;
+    }
+    hook->Do( VM_DOWN );
+    if ( m_depth+1 >= m_levelCap )
+    {
+      const unsigned int cap = m_levelCap*2;
+      ScvalVMBatchLevel* levels = (ScvalVMBatchLevel*)realloc( m_levels, sizeof(ScvalVMBatchLevel)*cap );
+      if ( levels )
+        m_levels = levels;
+      ScvalHookItem* items = levels ? (ScvalHookItem*)realloc( m_items, sizeof(ScvalHookItem)*cap*2*SCVAL_BATCH_SIZE ) : 0;
+      if ( !items )
+      {
+        // the levels below go on step by step
+        ++m_overflow;
+        return;
+      }
+      m_items = items;
+      m_levelCap = cap;
+    }
+    level = m_levels + ++m_depth;
+    memset( level, 0, sizeof(ScvalVMBatchLevel) );
+    {
+      const int n = Fill( hook, VM_NEXT, Children(m_depth) );
+      level->children = n >= 0;
+      level->count = n > 0 ? (unsigned int)n : 0;
+    }
+    return;
+  case VM_UP:
+    if ( m_depth )
+      --m_depth;
+    break;
+  default: break;
+  }
+  hook->Do( opcode );
+}
+void* ScvalVMBatch::Position( ScvalInstHook* hook )
+{
+  if ( m_enabled && !m_overflow )
+  {
+    const ScvalVMBatchLevel& level = m_levels[m_depth];
+    if ( m_lastLoad == VM_LDAV && level.attrs )
+      return level.attrCur < level.attrCount ? Attributes(m_depth)[level.attrCur].node : 0;
+    if ( m_lastLoad == VM_LDEV && level.children )
+      return level.cur < level.count ? Children(m_depth)[level.cur].node : 0;
+  }
+  return hook->Position( m_lastLoad );
+}
+//===---------------------------------------------------------------------------===//
+// Deferred checks of the custom types
+//===---------------------------------------------------------------------------===//
+void ScvalDeferredChecks::Clear()
+{
+  SAFEFREE(m_checks);
+  SAFEFREE(m_offsets);
+  SAFEFREE(m_text);
+  m_count = m_cap = 0;
+  m_textSize = m_textCap = 0;
+  m_index = 0;
+  m_func = 0;
+  m_user = 0;
+  m_failed = false;
+}
+bool ScvalDeferredChecks::Init( ScvalBatchCheckFunc func, void* user, unsigned int batchSize )
+{
+  Clear();
+  if ( !func )
+    return true;
+  if ( !batchSize )
+    batchSize = 1;
+  m_checks = (ScvalDeferredCheck*)malloc( sizeof(ScvalDeferredCheck)*batchSize );
+  m_offsets = (unsigned int*)malloc( sizeof(unsigned int)*batchSize );
+  if ( !m_checks || !m_offsets )
+  {
+    Clear();
+    return false;
+  }
+  m_cap = batchSize;
+  m_func = func;
+  m_user = user;
+  return true;
+}
+bool ScvalDeferredChecks::Add( ScvalHashID typeName, const ScvalVMString& value, ScvalHashID valueHash, void* node, bool copy )
+{
+  ScvalDeferredCheck& check = m_checks[m_count];
+  check.typeName = typeName;
+  check.value = value.str;
+  check.len = value.len;
+  check.valueHash = valueHash;
+  check.node = node;
+  check.index = m_index++;
+  check.result = true;
+  m_offsets[m_count] = ~0u;
+  if ( copy && value.str )
+  {
+    // the text may move when growing, the pointers are set when checking
+    if ( m_textSize+value.len+1 > m_textCap )
+    {
+      unsigned int cap = m_textCap ? m_textCap : 256;
+      while ( cap < m_textSize+value.len+1 )
+        cap *= 2;
+      char* text = (char*)realloc( m_text, cap );
+      if ( !text )
+        return false;
+      m_text = text;
+      m_textCap = cap;
+    }
+    memcpy( m_text+m_textSize, value.str, value.len+1 );
+    m_offsets[m_count] = m_textSize;
+    m_textSize += value.len+1;
+  }
+  ++m_count;
+  return true;
+}
+bool ScvalDeferredChecks::Check()
+{
+  for ( unsigned int i = 0; i < m_count; ++i )
+    if ( m_offsets[i] != ~0u )
+      m_checks[i].value = m_text+m_offsets[i];
+  m_func( m_checks, m_count, m_user );
+  for ( unsigned int i = 0; i < m_count; ++i )
+    if ( !m_checks[i].result )
+    {
+      m_failure = m_checks[i];
+      m_failed = true;
+      return false;
+    }
+  return true;
+}
+//===---------------------------------------------------------------------------===//
+// Checks registered for the custom types
+//===---------------------------------------------------------------------------===//
+void ScvalCheckTable::Clear()
+{
+  SAFEFREE(m_checks);
+  SAFEFREE(m_calls);
+  m_noChecks = 0;
+  m_hookCalls = false;
+}
+bool ScvalCheckTable::RegisterCheck( ScvalHashID typeName, ScvalCheckFunc func, void* user )
+{
+  unsigned int c = 0;
+  while ( c < m_noChecks && m_checks[c].typeName != typeName )
+    ++c;
+  if ( !func )
+  {
+    if ( c < m_noChecks )
+      m_checks[c] = m_checks[--m_noChecks];
+    return true;
+  }
+  if ( c == m_noChecks )
+  {
+    ScvalCheck* checks = (ScvalCheck*)realloc( m_checks, sizeof(ScvalCheck)*(m_noChecks+1) );
+    if ( !checks )
+      return false;
+    m_checks = checks;
+    ++m_noChecks;
+  }
+  m_checks[c].typeName = typeName;
+  m_checks[c].func = func;
+  m_checks[c].user = user;
+  return true;
+}
+// The check of every VM_CALL of the code, by the data address of its type
+// name. Fails when checks are registered and a type has none.
+bool ScvalCheckTable::Resolve( const ScvalVMCode& code )
+{
+  SAFEFREE(m_calls);
+  m_hookCalls = false;
+  if ( code.m_noConstData )
+  {
+    m_calls = (ScvalCheck*)malloc( sizeof(ScvalCheck)*code.m_noConstData );
+    if ( !m_calls )
+      return false;
+  }
+  for ( unsigned int i = 0; i < code.m_noOperations; ++i )
+  {
+    if ( code.m_code[i].opcode != VM_CALL )
+      continue;
+    const unsigned int dataAddr = code.m_code[i].GetDataAddr();
+    ScvalCheck& check = m_calls[dataAddr];
+    check.typeName = code.m_constData[dataAddr];
+    check.func = 0;
+    check.user = 0;
+    unsigned int c = 0;
+    while ( c < m_noChecks && m_checks[c].typeName != check.typeName )
+      ++c;
+    if ( c < m_noChecks )
+      check = m_checks[c];
+    else if ( m_noChecks )
+      return false;
+    else
+      m_hookCalls = true;
+  }
+  return true;
+}
+//===---------------------------------------------------------------------------===//
+// Cache of VM_CALL results
+//===---------------------------------------------------------------------------===//
+void ScvalCallCache::Clear()
+{
+  SAFEFREE(m_entries);
+  SAFEFREE(m_cacheable);
+  m_mask = 0;
+  m_noCacheable = 0;
+  m_hits = m_misses = 0;
+}
+bool ScvalCallCache::Init( unsigned int noEntries )
+{
+  SAFEFREE(m_entries);
+  m_mask = 0;
+  if ( !noEntries )
+    return true;
+  unsigned int size = 1;
+  while ( size < noEntries )
+    size <<= 1;
+  m_entries = (ScvalCallCacheEntry*)malloc( sizeof(ScvalCallCacheEntry)*size );
+  if ( !m_entries )
+    return false;
+  m_mask = size-1;
+  Flush();
+  return true;
+}
+void ScvalCallCache::Flush()
+{
+  for ( unsigned int i = 0; m_entries && i <= m_mask; ++i )
+    m_entries[i].len = SCVAL_CALL_CACHE_MAXLEN+1;
+}
+bool ScvalCallCache::SetCacheable( ScvalHashID typeName, bool cacheable )
+{
+  for ( unsigned int i = 0; i < m_noCacheable; ++i )
+    if ( m_cacheable[i] == typeName )
+    {
+      if ( !cacheable )
+        m_cacheable[i] = m_cacheable[--m_noCacheable];
+      return true;
+    }
+  if ( !cacheable )
+    return true;
+  ScvalHashID* types = (ScvalHashID*)realloc( m_cacheable, sizeof(ScvalHashID)*(m_noCacheable+1) );
+  if ( !types )
+    return false;
+  m_cacheable = types;
+  m_cacheable[m_noCacheable++] = typeName;
+  return true;
+}
+bool ScvalCallCache::IsCacheable( ScvalHashID typeName )const
+{
+  for ( unsigned int i = 0; i < m_noCacheable; ++i )
+    if ( m_cacheable[i] == typeName )
+      return true;
+  return false;
+}
+bool ScvalCallCache::Lookup( ScvalHashID typeName, const ScvalVMString& value, ScvalHashID valueHash, int& result )
+{
+  if ( value.len > SCVAL_CALL_CACHE_MAXLEN || !IsCacheable( typeName ) )
+    return false;
+  const ScvalCallCacheEntry& entry = m_entries[(valueHash ^ typeName) & m_mask];
+  if ( entry.len == value.len && entry.valueHash == valueHash && entry.typeName == typeName &&
+       ( !value.len || memcmp( entry.value, value.str, value.len ) == 0 ) )
+  {
+    ++m_hits;
+    result = entry.result;
+    return true;
+  }
+  ++m_misses;
+  return false;
+}
+void ScvalCallCache::Store( ScvalHashID typeName, const ScvalVMString& value, ScvalHashID valueHash, int result )
+{
+  if ( value.len > SCVAL_CALL_CACHE_MAXLEN || !IsCacheable( typeName ) )
+    return;
+  ScvalCallCacheEntry& entry = m_entries[(valueHash ^ typeName) & m_mask];
+  entry.typeName = typeName;
+  entry.valueHash = valueHash;
+  entry.len = value.len;
+  entry.result = result;
+  if ( value.len )
+    memcpy( entry.value, value.str, value.len );
 }
 //===---------------------------------------------------------------------------===//
 //===---------------------------------------------------------------------------===//
@@ -42,109 +520,668 @@ void ScvalVMCode::Clear()
 void ScvalVM::Clear()
 {
   m_mainCtx.Clear();
+  m_batch.Clear();
+  m_callCache.Clear();
+  m_deferred.Clear();
+  m_checks.Clear();
+  SAFEFREE(m_threaded);
+  m_threadedCap = 0;
+  m_threadedReady = false;
+  FreeJit();
+#ifndef SCVAL_NO_STATS
+  SAFEFREE(m_stats.m_calls);
+  m_stats.m_noCalls = 0;
+#endif
+  m_code = 0;
 }
+bool ScvalVM::Bind( const ScvalVMCode* code )
+{
+  m_code = 0;
+  m_threadedReady = false;
+  FreeJit();
+  if ( !code || !m_mainCtx.Init( *code ) )
+    return false;
+  if ( !m_checks.Resolve( *code ) )
+    return false;
+#ifndef SCVAL_NO_STATS
+  // one call counter per custom type (a VM_CALL each)
+  SAFEFREE(m_stats.m_calls);
+  m_stats.m_noCalls = 0;
+  for ( unsigned int i = 0; i < code->m_noOperations; ++i )
+    m_stats.m_noCalls += code->m_code[i].opcode == VM_CALL ? 1 : 0;
+  if ( m_stats.m_noCalls )
+  {
+    m_stats.m_calls = (ScvalVMCallStats*)malloc( sizeof(ScvalVMCallStats)*m_stats.m_noCalls );
+    if ( !m_stats.m_calls )
+    {
+      m_stats.m_noCalls = 0;
+      return false;
+    }
+    unsigned int n = 0;
+    for ( unsigned int i = 0; i < code->m_noOperations; ++i )
+      if ( code->m_code[i].opcode == VM_CALL )
+      {
+        m_stats.m_calls[n].typeName = code->m_constData[code->m_code[i].GetDataAddr()];
+        m_stats.m_calls[n++].count = 0;
+      }
+  }
+#endif
+  m_code = code;
+  return true;
+}
+bool ScvalVM::RegisterCheck( ScvalHashID typeName, ScvalCheckFunc func, void* user )
+{
+  if ( !m_checks.RegisterCheck( typeName, func, user ) )
+    return false;
+  // the cached results are of the checks registered before
+  m_callCache.Flush();
+  if ( m_code && !m_checks.Resolve( *m_code ) )
+  {
+    m_code = 0;
+    return false;
+  }
+  return true;
+}
+// VM_CALL of the deferred checks, the value is added to the batch and passes.
+// Unless the batch is full or the cache knows it fails, then the batch is
+// checked and the run stops when one of its checks fails.
+int ScvalVM::DeferCheck( ScvalInstHook* hook, const ScvalCheck& check, int reg )
+{
+  const ScvalVMString& value = m_mainCtx.m_regStrings[reg];
+  const ScvalHashID valueHash = m_mainCtx.m_regStrHashes[reg];
+  int result = 1;
+  if ( ScvalVMStats* stats = RunStats() )
+    stats->CountCall( check.typeName );
+  if ( m_callCache.IsEnabled() && m_callCache.Lookup( check.typeName, value, valueHash, result ) && result )
+    return 1;
+  if ( !m_deferred.Add( check.typeName, value, valueHash, m_batch.Position( hook ), !m_mainCtx.m_stableStrings ) )
+    return 0;
+  if ( result && !m_deferred.IsFull() )
+    return 1;
+  return CheckDeferred() ? 1 : 0;
+}
+// Checks the pending values, their results go to the cache
+bool ScvalVM::CheckDeferred()
+{
+  if ( !m_deferred.m_count )
+    return true;
+  const bool passed = m_deferred.Check();
+  for ( unsigned int i = 0; m_callCache.IsEnabled() && i < m_deferred.m_count; ++i )
+  {
+    const ScvalDeferredCheck& check = m_deferred.m_checks[i];
+    const ScvalVMString value = { check.value, check.len };
+    m_callCache.Store( check.typeName, value, check.valueHash, check.result ? 1 : 0 );
+  }
+  // the failed value stays there until the next run
+  if ( passed )
+    m_deferred.Drop();
+  return passed;
+}
+#ifndef SCVAL_NO_STATS
+//===---------------------------------------------------------------------------===//
+// Hook in between the VM and the user hook counting the calls, only used
+// while collecting statistics so the engines don't pay for it otherwise.
+//===---------------------------------------------------------------------------===//
+class ScvalStatsHook : public ScvalInstHook
+{
+public:
+  ScvalStatsHook( ScvalInstHook* hook, ScvalVMStats& stats ):m_hook(hook), m_stats(stats){}
+  virtual bool StableStrings(){ return m_hook->StableStrings(); }
+  virtual bool Checks(){ return m_hook->Checks(); }
+  virtual const char* Do( ScvalVMOpcode opcode, ScvalHashID typeName=INVALIDHASH, const char* value=0 )
+  {
+    // the calls by custom type are counted by the VM, whoever checks them
+    if ( opcode < VM_NOOPCODES )
+      m_stats.m_hookCount[opcode]++;
+    return m_hook->Do( opcode, typeName, value );
+  }
+  virtual void Load( ScvalVMOpcode opcode, ScvalHookString& out )
+  {
+    m_stats.m_hookCount[opcode]++;
+    m_hook->Load( opcode, out );
+    if ( out.hashed )
+      m_stats.m_hashedLoads++;
+  }
+  virtual void LoadRaw( ScvalVMOpcode opcode, ScvalHookString& out )
+  {
+    m_stats.m_hookCount[opcode]++;
+    m_hook->LoadRaw( opcode, out );
+  }
+  virtual int Enumerate( ScvalVMOpcode opcode, void* after, ScvalHookItem* items, unsigned int max )
+  {
+    m_stats.m_enumerations++;
+    return m_hook->Enumerate( opcode, after, items, max );
+  }
+  virtual void Select( void* node ){ m_hook->Select( node ); }
+  virtual void* Position( ScvalVMOpcode opcode ){ return m_hook->Position( opcode ); }
+  virtual bool Starved(){ return m_hook->Starved(); }
+private:
+  ScvalInstHook* m_hook;
+  ScvalVMStats& m_stats;
+};
+#endif
+bool ScvalVM::Run( ScvalInstHook* hook )
+{
+  if ( !CanRun( hook ) )
+    return false;
+  m_resumable = m_stopAtRecords = false;
+  BeginRun( hook );
+  return EndRun( RunEngine( hook, m_engine ) );
+}
+ScvalVMStatus ScvalVM::Start( ScvalInstHook* hook )
+{
+  if ( !CanRun( hook ) )
+    return VMSTATUS_INVALID;
+  m_resumable = true;
+  m_stopAtRecords = false;
+  BeginRun( hook );
+  return Continue( hook );
+}
+ScvalVMStatus ScvalVM::StartRecords( ScvalInstHook* hook )
+{
+  if ( !CanRun( hook ) )
+    return VMSTATUS_INVALID;
+  m_resumable = false;
+  m_stopAtRecords = true;
+  BeginRun( hook );
+  return Continue( hook );
+}
+// The slices of the records are done, the counters of the loop are theirs and
+// the run goes on where the loop exits
+ScvalVMStatus ScvalVM::ResumeRecords( ScvalInstHook* hook, const unsigned short* counters )
+{
+  if ( !m_code || !m_suspended || !m_atRecords )
+    return VMSTATUS_INVALID;
+  unsigned short* R_CNTS = m_mainCtx.m_regCounters+m_mainCtx.m_base;
+  for ( unsigned int i = 0; i < m_records.noCounters; ++i )
+    R_CNTS[m_records.counter+i] += counters[i];
+  m_pc = m_records.endPc;
+  m_atRecords = false;
+  return Continue( hook );
+}
+ScvalVMStatus ScvalVM::Resume( ScvalInstHook* hook )
+{
+  if ( !m_code || !m_suspended )
+    return VMSTATUS_INVALID;
+  return Continue( hook );
+}
+ScvalVMStatus ScvalVM::Continue( ScvalInstHook* hook )
+{
+  m_atRecords = false;
+  const bool result = RunEngine( hook, VMENGINE_SWITCH );
+  if ( m_suspended )
+    return m_atRecords ? VMSTATUS_RECORDS : VMSTATUS_SUSPENDED;
+  return EndRun( result ) ? VMSTATUS_VALID : VMSTATUS_INVALID;
+}
+void ScvalVM::BeginRun( ScvalInstHook* hook )
+{
+  m_suspended = false;
+  m_mainCtx.Reset();
+  m_mainCtx.m_stableStrings = hook->StableStrings();
+  m_batch.Reset();
+  m_deferred.Reset();
+#ifndef SCVAL_NO_STATS
+  if ( m_statsEnabled )
+    m_stats.Reset();
+#endif
+}
+bool ScvalVM::RunEngine( ScvalInstHook* hook, ScvalVMEngine engine )
+{
+#ifndef SCVAL_NO_STATS
+  ScvalStatsHook statsHook( hook, m_stats );
+  if ( m_statsEnabled )
+    hook = &statsHook;
+#endif
+  switch ( engine )
+  {
+  case VMENGINE_THREADED: return RunThreaded( hook );
+  case VMENGINE_JIT     : return RunJit( hook );
+  default               : return RunSwitch( hook );
+  }
+}
+bool ScvalVM::EndRun( bool result )
+{
+#ifndef SCVAL_NO_STATS
+  if ( m_statsEnabled )
+    for ( int i = 0; i < VM_NOOPCODES; ++i )
+      m_stats.m_executed += m_stats.m_opCount[i];
+#endif
+  if ( !m_deferred.IsEnabled() )
+    return result;
+  // the values pending of checking, unless the document is already not valid
+  if ( !result )
+  {
+    if ( !m_deferred.m_failed )
+      m_deferred.Drop();
+    return false;
+  }
+  return CheckDeferred();
+}
+#ifndef SCVAL_NO_STATS
+const ScvalVMStats* ScvalVM::GetStats()const
+{
+  return m_statsEnabled ? &m_stats : 0;
+}
+#endif
 bool ScvalVM::Run( const ScvalVMCode* code, ScvalInstHook* hook )
 {
-  m_mainCtx.Init( code->m_maxRegCounter, code->m_maxRegStrings );
-  m_pc = m_opExecuted = 0;
-  register int& CMPRES = m_mainCtx.m_cmpRes;
-  ScvalHashID* R_HASHES = m_mainCtx.m_regStrHashes;
-  const char** R_STRS = m_mainCtx.m_regStrings;
-  unsigned short* R_CNTS = m_mainCtx.m_regCounters;
+  return Bind( code ) && Run( hook );
+}
+// The operations of the switch engine on the hook, for ScvalRunSwitch
+class ScvalVM::SwitchExec
+{
+public:
+  SwitchExec( ScvalVM& vm, ScvalInstHook* hook ):m_vm(vm), m_hook(hook)
+#ifndef SCVAL_NO_STATS
+    , m_opStats(vm.m_statsEnabled ? vm.m_stats.m_opCount : 0)
+#endif
+  {}
+  void Count( unsigned char opcode )
+  {
+#ifndef SCVAL_NO_STATS
+    if ( m_opStats && opcode < VM_NOOPCODES )
+      m_opStats[opcode]++;
+#else
+    (void)opcode;
+#endif
+  }
+  void Load( ScvalVMOpcode opcode, ScvalHookString& out, bool raw ){ m_vm.m_batch.Load( m_hook, opcode, out, raw ); }
+  bool Navigate( ScvalVMOpcode opcode )
+  {
+    m_vm.m_batch.Navigate( m_hook, opcode );
+    if ( !m_vm.m_resumable || !m_hook->Starved() )
+      return true;
+    m_vm.m_suspended = true;
+    return false;
+  }
+  bool StopAtRecords( unsigned int clrPc, unsigned int base )
+  {
+    if ( !m_vm.m_stopAtRecords || !m_vm.StopAtRecords( clrPc, base ) )
+      return false;
+    m_vm.m_suspended = true;
+    return true;
+  }
+  int Call( unsigned int check, int reg )
+  {
+    if ( m_vm.m_deferred.IsEnabled() )
+      return m_vm.DeferCheck( m_hook, m_vm.m_checks.m_calls[check], reg );
+    return m_vm.m_callCache.Call( m_hook, m_vm.m_checks.m_calls[check], m_vm.m_mainCtx.m_regStrings[reg],
+                                  m_vm.m_mainCtx.m_regStrHashes[reg], m_vm.RunStats() );
+  }
+private:
+  ScvalVM& m_vm;
+  ScvalInstHook* m_hook;
+#ifndef SCVAL_NO_STATS
+  unsigned int* m_opStats;
+#endif
+};
+bool ScvalVM::RunSwitch( ScvalInstHook* hook )
+{
+  SwitchExec exec( *this, hook );
+  const bool resume = m_suspended;
+  m_suspended = false;
+  return ScvalRunSwitch( exec, m_code, m_mainCtx, m_pc, resume );
+}
+// The loop of the records headed by the VM_CLR at clrPc, where the run stops
+// unless it is in a subroutine or doesn't look like the loop of the children
+bool ScvalVM::StopAtRecords( unsigned int clrPc, unsigned int base )
+{
+  const ScvalVMCode* code = m_code;
+  const ScvalVMOperation& clr = code->m_code[clrPc];
+  if ( base != 0 || clrPc+3 >= code->m_noOperations || code->m_code[clrPc+3].opcode != VM_JE )
+    return false;
+  m_records.loopPc = clrPc+1;
+  m_records.endPc = code->m_code[clrPc+3].GetAddr();
+  m_records.counter = clr.op0;
+  m_records.noCounters = clr.op1;
+  m_atRecords = true;
+  return true;
+}
+//===---------------------------------------------------------------------------===//
+// Threaded engine. The code segment is decoded once per binding into slots with
+// resolved operands, plus two extra slots at the end: one for the normal end
+// of the program and another one for the error address. That way no bounds
+// check on pc is needed per instruction.
+// GCC/Clang jump straight to the next handler (computed gotos), other
+// compilers go through a single switch over the decoded opcode.
+//===---------------------------------------------------------------------------===//
+#if defined(__GNUC__) || defined(__clang__)
+#define SCVAL_COMPUTED_GOTO
+#endif
+enum
+{
+  VMT_END=VM_NOOPCODES, // pseudo opcodes only existing in the decoded code
+  VMT_ERR,
+  VMT_BAD
+};
+#ifndef SCVAL_NO_STATS
+#define VMT_COUNT() { if ( opStats ) ++opStats[op->opcode]; }
+#else
+#define VMT_COUNT()
+#endif
+#ifdef SCVAL_COMPUTED_GOTO
+#define VMT_DISPATCH() { op = ops+pc++; VMT_COUNT(); goto *op->handler; }
+#else
+#define VMT_DISPATCH() goto l_dispatch
+#endif
+bool ScvalVM::RunThreaded( ScvalInstHook* hook )
+{
+#ifdef SCVAL_COMPUTED_GOTO
+  static const void* handlers[]={
+    &&l_lden, &&l_ldev, &&l_ldan, &&l_ldav, &&l_cmps, &&l_cmpi,
+    &&l_je, &&l_jne, &&l_jg, &&l_jmp, &&l_clr, &&l_inc,
+    &&l_chkn, &&l_chkc, &&l_down, &&l_up, &&l_gatt, &&l_natt, &&l_next,
+    &&l_ret, &&l_call, &&l_lenj, &&l_lanj, &&l_cjni, &&l_swch, &&l_jsr,
+    &&l_end, &&l_err, &&l_bad };
+#endif
+  const ScvalVMCode* code = m_code;
+  m_pc = 0;
+
+  // decoding (only the first run after binding)
   const unsigned int maxPC = code->m_noOperations;
-  while ( m_pc < maxPC )
+  const unsigned int endSlot = maxPC;
+  const unsigned int errSlot = maxPC+1;
+  if ( !m_threadedReady ) 
   {
-    register const ScvalVMOperation& operation = code->m_code[m_pc++];
-    m_opExecuted++;
-    switch ( operation.opcode )
+    if ( m_threadedCap < maxPC+2 )
     {
-    case VM_LDEN: 
-    case VM_LDEV: 
-    case VM_LDAN: 
-    case VM_LDAV: 
+      SAFEFREE(m_threaded);
+      m_threaded = (ScvalVMThreadedOp*)malloc( sizeof(ScvalVMThreadedOp)*(maxPC+2) );
+      if ( !m_threaded )
       {
-        const char* retStr = hook->Do( (ScvalVMOpcode)operation.opcode );
-        R_HASHES[operation.op0] = ScvalHash( retStr ); 
-        SAFEFREE(R_STRS[operation.op0]);
-        R_STRS[operation.op0] = _strdup(retStr);
-      }break;    
-    case VM_CMPS: 
+        m_threadedCap = 0;
+        return false;
+      }
+      m_threadedCap = maxPC+2;
+    }
+    for ( unsigned int i = 0; i < maxPC+2; ++i )
+    {
+      ScvalVMThreadedOp& t = m_threaded[i];
+      t.arg = t.jmp = 0; t.reg = t.imm = 0;
+      if ( i >= maxPC )
       {
-        unsigned int dataAddr = operation.GetDataAddr();
-        const int op2 = dataAddr==VM_NILDATA ? 0 : code->m_constData[dataAddr];
-        CMPRES = R_HASHES[operation.op0] - op2; 
-      }break;
-    case VM_CMPI: 
-      CMPRES = R_CNTS[operation.op0] - operation.op1; 
-      R_CNTS[operation.op0]=0;
-      break;    
-    case VM_JE: 
-      if ( CMPRES == 0 )
-        m_pc = operation.GetAddr();
-      break;
-    case VM_JNE:
-      if ( CMPRES != 0 )
-        m_pc = operation.GetAddr();
-      break;
-    case VM_JG: 
-      if ( CMPRES > 0 )
-        m_pc = operation.GetAddr();
-      break;
-    case VM_JMP:
-      m_pc = operation.GetAddr();
-    case VM_CLR: break;
-    case VM_INC: 
-      R_CNTS[operation.op0]++; 
-      break;
-    case VM_CHKN:
-      switch ( operation.op1 ) // native type to check
+        t.opcode = i==endSlot ? VMT_END : VMT_ERR;
+      }
+      else
       {
-      case 0: if ( !IsReal(R_STRS[operation.op0]) ) m_pc = VM_ERRADDR; break;
-      case 1: break;
-      case 2: if ( !IsInteger(R_STRS[operation.op0]) ) m_pc = VM_ERRADDR; break;
-      case 3: if ( !IsBool(R_HASHES[operation.op0] ) ) m_pc = VM_ERRADDR; break;
-      }break;
-    case VM_CHKC:
-      m_mainCtx.m_checkStrReg = operation.op0;
-      m_lastPc = m_pc; // stack of 1 level of depth
-      m_pc = operation.GetDataAddr();// in chkc operation, only 2 bytes for address
-      break;
-    case VM_DOWN: 
-    case VM_UP  : 
-    case VM_GATT: 
-    case VM_NATT: 
-    case VM_NEXT: 
-      hook->Do( (ScvalVMOpcode)operation.opcode ); 
-      break;
-    case VM_RET:
-      m_pc = m_lastPc;
-      break;
-    case VM_CALL:
-      CMPRES = int(hook->Do( (ScvalVMOpcode)operation.opcode, code->m_constData[operation.GetDataAddr()], R_STRS[m_mainCtx.m_checkStrReg] ));
-      break;
-    default: return false;
+        const ScvalVMOperation& operation = code->m_code[i];
+        t.opcode = operation.opcode < VM_NOOPCODES ? operation.opcode : (unsigned char)VMT_BAD;
+        t.reg = operation.op0;
+        t.imm = operation.op1;
+        switch ( operation.opcode )
+        {
+        case VM_CMPS:
+          {
+            unsigned int dataAddr = operation.GetDataAddr();
+            t.arg = dataAddr==VM_NILDATA ? 0 : code->m_constData[dataAddr];
+          }break;
+        case VM_JE:
+        case VM_JNE:
+        case VM_JG:
+        case VM_JMP:
+          {
+            unsigned int addr = operation.GetAddr();
+            t.arg = addr==VM_ERRADDR ? errSlot : ( addr < maxPC ? addr : endSlot );
+          }break;
+        case VM_CHKC:
+        case VM_JSR:
+          {
+            unsigned int addr = operation.GetDataAddr();
+            t.arg = addr < maxPC ? addr : endSlot;
+          }break;
+        case VM_CALL:
+          t.arg = operation.GetDataAddr();
+          break;
+        case VM_SWITCH:
+          t.arg = operation.GetDataAddr();
+          break;
+        case VM_LENJ:
+        case VM_LANJ:
+          if ( i+2 < maxPC )
+          {
+            unsigned int addr = code->m_code[i+2].GetAddr();
+            t.jmp = addr==VM_ERRADDR ? errSlot : ( addr < maxPC ? addr : endSlot );
+            t.imm = operation.opcode==VM_LENJ ? VM_LDEN : VM_LDAN;
+          }
+          else t.opcode = VMT_BAD;
+          break;
+        case VM_CJNI:
+          if ( i+2 < maxPC )
+          {
+            unsigned int addr = code->m_code[i+1].GetAddr();
+            t.arg = code->m_constData[operation.GetDataAddr()];
+            t.jmp = addr==VM_ERRADDR ? errSlot : ( addr < maxPC ? addr : endSlot );
+            t.imm = code->m_code[i+2].op0;
+          }
+          else t.opcode = VMT_BAD;
+          break;
+        }
+      }
+#ifdef SCVAL_COMPUTED_GOTO
+      t.handler = handlers[t.opcode];
+#else
+      t.handler = 0;
+#endif
     }
+    m_threadedReady = true;
   }
-  printf( "%d instructions executed\n", m_opExecuted );
-  // this special pc address is considered that there was an error
-  return m_pc != VM_ERRADDR;
+
+  // execution
+  const ScvalVMThreadedOp* ops = m_threaded;
+  const ScvalVMThreadedOp* op = 0;
+  unsigned int pc = 0;
+  int cmpRes = 0;
+  bool result = true;
+  // registers of the current frame
+  unsigned int base = 0;
+  ScvalHashID* R_HASHES = m_mainCtx.m_regStrHashes;
+  const ScvalVMString* R_STRS = m_mainCtx.m_regStrings;
+  unsigned short* R_CNTS = m_mainCtx.m_regCounters;
+  ScvalVMFrame* frames = m_mainCtx.m_frames;
+  unsigned int sp = 0;
+#ifndef SCVAL_NO_STATS
+  unsigned int opCounts[VMT_BAD+1]; // pseudo opcodes included
+  unsigned int* opStats = 0;
+  if ( m_statsEnabled )
+  {
+    memset( opCounts, 0, sizeof(opCounts) );
+    opStats = opCounts;
+  }
+#endif
+  VMT_DISPATCH();
+
+#ifndef SCVAL_COMPUTED_GOTO
+l_dispatch:
+  op = ops+pc++;
+  VMT_COUNT();
+  switch ( op->opcode )
+  {
+  case VM_LDEN: goto l_lden;  case VM_LDEV: goto l_ldev;
+  case VM_LDAN: goto l_ldan;  case VM_LDAV: goto l_ldav;
+  case VM_CMPS: goto l_cmps;  case VM_CMPI: goto l_cmpi;
+  case VM_JE  : goto l_je;    case VM_JNE : goto l_jne;
+  case VM_JG  : goto l_jg;    case VM_JMP : goto l_jmp;
+  case VM_CLR : goto l_clr;   case VM_INC : goto l_inc;
+  case VM_CHKN: goto l_chkn;  case VM_CHKC: goto l_chkc;
+  case VM_DOWN: goto l_down;  case VM_UP  : goto l_up;
+  case VM_GATT: goto l_gatt;  case VM_NATT: goto l_natt;
+  case VM_NEXT: goto l_next;  case VM_RET : goto l_ret;
+  case VM_CALL: goto l_call;  case VM_LENJ: goto l_lenj;
+  case VM_LANJ: goto l_lanj;  case VM_CJNI: goto l_cjni;
+  case VM_SWITCH: goto l_swch; case VM_JSR: goto l_jsr;
+  case VMT_END: goto l_end;   case VMT_ERR: goto l_err;
+  default: goto l_bad;
+  }
+#endif
+
+l_lden:
+l_ldev:
+l_ldan:
+l_ldav:
+  {
+    ScvalHookString retStr;
+    if ( op->imm == VM_RAWVALUE )
+    {
+      m_batch.Load( hook, (ScvalVMOpcode)op->opcode, retStr, true );
+      R_HASHES[op->reg] = m_mainCtx.LoadRaw( base+op->reg, retStr );
+    }
+    else
+    {
+      m_batch.Load( hook, (ScvalVMOpcode)op->opcode, retStr );
+      R_HASHES[op->reg] = m_mainCtx.LoadString( base+op->reg, retStr );
+    }
+  }
+  VMT_DISPATCH();
+l_cmps:
+  cmpRes = int(R_HASHES[op->reg] - op->arg);
+  VMT_DISPATCH();
+l_cmpi:
+  cmpRes = R_CNTS[op->reg] - op->imm;
+  R_CNTS[op->reg] = 0;
+  VMT_DISPATCH();
+l_je:
+  if ( cmpRes == 0 ) pc = op->arg;
+  VMT_DISPATCH();
+l_jne:
+  if ( cmpRes != 0 ) pc = op->arg;
+  VMT_DISPATCH();
+l_jg:
+  if ( cmpRes > 0 ) pc = op->arg;
+  VMT_DISPATCH();
+l_jmp:
+  pc = op->arg;
+  VMT_DISPATCH();
+l_clr:
+  VMT_DISPATCH();
+l_inc:
+  R_CNTS[op->reg]++;
+  VMT_DISPATCH();
+l_chkn:
+  switch ( op->imm ) // native type to check
+  {
+  case 0: if ( !IsReal(R_STRS[op->reg].str) ) goto l_err; break;
+  case 1: break;
+  case 2: if ( !IsInteger(R_STRS[op->reg].str) ) goto l_err; break;
+  case 3: if ( !IsBool(R_HASHES[op->reg]) ) goto l_err; break;
+  }
+  VMT_DISPATCH();
+l_chkc:
+  if ( sp >= (unsigned int)m_mainCtx.m_frameCount )
+    goto l_err;
+  m_mainCtx.m_checkStrReg = base+op->reg;
+  frames[sp].retPc = pc;
+  frames[sp++].base = base;
+  pc = op->arg;
+  VMT_DISPATCH();
+l_jsr:
+  if ( sp >= SCVAL_MAX_CALL_DEPTH )
+    goto l_err;
+  frames[sp].retPc = pc;
+  frames[sp++].base = base;
+  base += op->reg;
+  R_HASHES = m_mainCtx.m_regStrHashes+base;
+  R_STRS = m_mainCtx.m_regStrings+base;
+  R_CNTS = m_mainCtx.m_regCounters+base;
+  pc = op->arg;
+  VMT_DISPATCH();
+l_down:
+l_up:
+l_gatt:
+l_natt:
+l_next:
+  m_batch.Navigate( hook, (ScvalVMOpcode)op->opcode );
+  VMT_DISPATCH();
+l_ret:
+  if ( sp == 0 )
+    goto l_err;
+  pc = frames[--sp].retPc;
+  base = frames[sp].base;
+  R_HASHES = m_mainCtx.m_regStrHashes+base;
+  R_STRS = m_mainCtx.m_regStrings+base;
+  R_CNTS = m_mainCtx.m_regCounters+base;
+  VMT_DISPATCH();
+l_call:
+  if ( m_deferred.IsEnabled() )
+    cmpRes = DeferCheck( hook, m_checks.m_calls[op->arg], m_mainCtx.m_checkStrReg );
+  else
+    cmpRes = m_callCache.Call( hook, m_checks.m_calls[op->arg], m_mainCtx.m_regStrings[m_mainCtx.m_checkStrReg], m_mainCtx.m_regStrHashes[m_mainCtx.m_checkStrReg], RunStats() );
+  VMT_DISPATCH();
+l_lenj:
+l_lanj:
+  {
+    ScvalHookString retStr;
+    m_batch.Load( hook, (ScvalVMOpcode)op->imm, retStr );
+    cmpRes = R_HASHES[op->reg] = m_mainCtx.LoadString( base+op->reg, retStr );
+    pc = cmpRes==0 ? op->jmp : pc+2;
+  }
+  VMT_DISPATCH();
+l_cjni:
+  cmpRes = int(R_HASHES[op->reg] - op->arg);
+  if ( cmpRes != 0 )
+    pc = op->jmp;
+  else
+  {
+    R_CNTS[op->imm]++;
+    pc += 2;
+  }
+  VMT_DISPATCH();
+l_swch:
+  pc = ScvalSwitchTarget( code->m_constData+op->arg, R_HASHES[op->reg] );
+  if ( pc >= maxPC )
+    pc = pc==VM_ERRADDR ? errSlot : endSlot;
+  VMT_DISPATCH();
+l_bad:
+  result = false;
+  m_pc = pc-1;
+  goto l_exit;
+l_end:
+  m_pc = maxPC;
+  goto l_exit;
+l_err:
+  m_pc = VM_ERRADDR;
+  result = false;
+l_exit:
+  m_mainCtx.m_cmpRes = cmpRes;
+#ifndef SCVAL_NO_STATS
+  if ( opStats ) // the pseudo opcodes are not instructions
+    memcpy( m_stats.m_opCount, opCounts, sizeof(m_stats.m_opCount) );
+#endif
+  return result;
 }
+#undef VMT_DISPATCH
+#undef VMT_COUNT
+
+// [+-]digits, a missing or empty value is not a number
 bool ScvalVM::IsInteger( const char* str )
 {
-  while ( *str && isdigit(*str++) ) 
-  {}
-  return !*str;
+  if ( !str )
+    return false;
+  if ( *str == '-' || *str == '+' )
+    ++str;
+  const char* digits = str;
+  while ( isdigit((unsigned char)*str) )
+    ++str;
+  return str != digits && !*str;
 }
+// [+-]digits[.digits], with a digit at least on one side of the point
 bool ScvalVM::IsReal( const char* str )
 {
-  int nopoints=0;
-  do
+  if ( !str )
+    return false;
+  if ( *str == '-' || *str == '+' )
+    ++str;
+  const char* digits = str;
+  while ( isdigit((unsigned char)*str) )
+    ++str;
+  bool hasDigits = str != digits;
+  if ( *str == '.' )
   {
-    while ( *str && isdigit(*str++) ) 
-    {}
-    if ( *str == '.' ) nopoints++;
-  }while (*str && nopoints<=1);
-  return !*str && nopoints<=1; 
+    digits = ++str;
+    while ( isdigit((unsigned char)*str) )
+      ++str;
+    hasDigits = hasDigits || str != digits;
+  }
+  return hasDigits && !*str;
 }
 static const ScvalHashID g_hTrue = ScvalHash("true");
 static const ScvalHashID g_hFalse= ScvalHash("false");
@@ -157,9 +1194,21 @@ bool ScvalVM::IsBool( ScvalHashID strhash )
 }
 //===---------------------------------------------------------------------------===//
 //===---------------------------------------------------------------------------===//
-bool ScvalValidate(const ScvalVMCode& inBytecode, ScvalInstHook* xmlReader )
+bool ScvalValidator::Bind( const ScvalVMCode& code, ScvalVMEngine engine )
+{
+  m_vm.SetEngine( engine );
+  return m_vm.Bind( &code );
+}
+bool ScvalValidator::Validate( ScvalInstHook* xmlReader )
+{
+  return m_vm.Run( xmlReader );
+}
+//===---------------------------------------------------------------------------===//
+//===---------------------------------------------------------------------------===//
+bool ScvalValidate(const ScvalVMCode& inBytecode, ScvalInstHook* xmlReader, ScvalVMEngine engine )
 {
   ScvalVM vm;
+  vm.SetEngine( engine );
   return vm.Run( &inBytecode, xmlReader );
 }
 
@@ -210,6 +1259,33 @@ bool ScvalSaveToBinary( const ScvalVMCode& inBytecode, void** outBinChunk, unsig
   return true;
 }
 
+//===---------------------------------------------------------------------------===//
+// The loop of the records alone: the first operation jumps to the loop and its
+// exit to the end of the code. The rest stays, the records may call subroutines.
+//===---------------------------------------------------------------------------===//
+bool ScvalRecordsCode( const ScvalVMCode& code, const ScvalVMRecords& records, ScvalVMCode& outBytecode )
+{
+  outBytecode.Clear();
+  if ( records.loopPc == 0 || records.loopPc >= code.m_noOperations || records.endPc >= code.m_noOperations )
+    return false;
+  outBytecode.m_code = (ScvalVMOperation*)malloc( sizeof(ScvalVMOperation)*code.m_noOperations );
+  outBytecode.m_constData = (ScvalHashID*)malloc( sizeof(ScvalHashID)*(code.m_noConstData ? code.m_noConstData : 1) );
+  if ( !outBytecode.m_code || !outBytecode.m_constData )
+  {
+    outBytecode.Clear();
+    return false;
+  }
+  outBytecode.m_noOperations = code.m_noOperations;
+  outBytecode.m_noConstData = code.m_noConstData;
+  outBytecode.m_maxRegCounter = code.m_maxRegCounter;
+  outBytecode.m_maxRegStrings = code.m_maxRegStrings;
+  memcpy( outBytecode.m_code, code.m_code, sizeof(ScvalVMOperation)*code.m_noOperations );
+  memcpy( outBytecode.m_constData, code.m_constData, sizeof(ScvalHashID)*code.m_noConstData );
+  outBytecode.m_code[0].Set( VM_JMP ).SetAddr( records.loopPc );
+  outBytecode.m_code[records.endPc].Set( VM_JMP ).SetAddr( code.m_noOperations );
+  return true;
+}
+
 //===---------------------------------------------------------------------------===//
 //===---------------------------------------------------------------------------===//
 void ScvalBinaryDeallocate( void** binChunk )
@@ -166,6 +166,24 @@ ScvalHashID ScvalHash(const char* str)
 {
   return (ScvalHashID)Hash(str);
 }
+ScvalHashID ScvalHashLen(const char* str, unsigned int& outLen)
+{
+  outLen = 0;
+  if ( !str ) return 0;
+  const char* sym = str;
+  int hash = 5381;
+  while (*sym)
+    hash = ((hash << 5) + hash) ^ *(sym++);
+  outLen = (unsigned int)(sym-str);
+  return (ScvalHashID)hash;
+}
+ScvalHashID ScvalHashN(const char* str, unsigned int len)
+{
+  int hash = 5381;
+  for ( unsigned int i = 0; i < len; ++i )
+    hash = ((hash << 5) + hash) ^ str[i];
+  return (ScvalHashID)hash;
+}
 void ScvalAST::AddChildNode( ScvalHandle hParent, ScvalHandle hChild )
 {
   if ( hParent == INVALIDHANDLE )
@@ -260,7 +278,7 @@ class ScvalParser
 public:
   ScvalParser(){}
   bool Parse( const char* text);
-  bool GenerateCode(ScvalVMCode& outByteCode);
+  bool GenerateCode(ScvalVMCode& outByteCode, unsigned int flags);
 
 private:
   bool ParseTypedef();
@@ -268,6 +286,7 @@ private:
   bool ParseTypedefExpr();
   bool ParseTypedefEnum();
   bool ParseTypedefList();
+  bool ParseTypedefElement();
   bool ParseElementDef();
   bool ParseElement();
   bool ParseAttributeList();
@@ -280,10 +299,20 @@ private:
 };
 struct ScvalASTGenCodeData
 {
+  ScvalASTGenCodeData():m_maxRegCounter(0), m_maxRegStrings(0), m_flags(0), m_records(false){}
   unsigned int m_maxRegCounter;
   unsigned int m_maxRegStrings;
+  unsigned int m_flags;
+  bool m_records; // the children of the next element body are the records (of the root)
   ScvalStaticDynArray<ScvalVMOperation,256,256> m_code;
   ScvalSet<ScvalHashID,64> m_constData;
+  ScvalStaticDynArray<ScvalHashID,64,256> m_switchData; // appended to m_constData at the end
+  ScvalStaticDynArray<unsigned int,32,32> m_subCalls; // chkc/jsr ops, with the typedef leaf as address until resolved
+};
+struct ScvalASTSubroutine
+{
+  ScvalHandle leaf;  // typedef name
+  unsigned int addr; // code of its type check or element type
 };
 
 #define CONSUME() g_lexer.NextToken(&g_token)
@@ -318,12 +347,12 @@ bool ScvalParser::Parse( const char* text )
 #endif
   return true;  
 }
-bool ScvalParser::GenerateCode( ScvalVMCode& valCode )
+bool ScvalParser::GenerateCode( ScvalVMCode& valCode, unsigned int flags )
 {
   valCode.Clear();
   if ( m_ast.IsEmpty() ) 
     return false;
-  if ( !m_ast.GenerateCode(valCode) )
+  if ( !m_ast.GenerateCode(valCode, flags) )
     return false;  
   return true;
 }
@@ -346,8 +375,30 @@ bool ScvalParser::ParseTypedefBody()
     EXPECTEDLEAF(TOK_ID,AST_ID);    
     return true;
   }
+  if ( g_token.token == TOK_O_B )
+  {
+    CONSUME();
+    return ParseTypedefElement();
+  }
   return false;
 }
+// Element type: { [attributes] children }. The attributes and children
+// nodes hang from the typedef, as they do from an element.
+bool ScvalParser::ParseTypedefElement()
+{
+  // attributes optional
+  if ( g_token.token == TOK_O_S )
+  { 
+    CONSUME(); 
+    NODESCOPE(AST_ATTRS);
+    if ( !ParseAttributeList() )
+      return false;    
+  }
+  NODESCOPE(AST_CHILDREN);
+  while ( ParseElementDef() );
+  EXPECTED(TOK_C_B);
+  return true;
+}
 bool ScvalParser::ParseTypedefExpr()
 {
   switch ( g_token.token )
@@ -472,13 +523,13 @@ void ScvalPrintCode( ScvalVMCode& code )
     "je  ", "jne ", "jg  ", "jmp ", "clr ", "inc ", 
     "chkn", "chkc",
     "down", "up  ", "gatt", "natt", "next",
-    "ret ", "call"};
+    "ret ", "call", "lenj", "lanj", "cjni", "swch", "jsr "};
     const int opcount[]={ 
       1, 1, 1, 1, 3, 2,
-      3, 3, 3, 3, 0, 1, 
+      3, 3, 3, 3, 2, 1, 
       2, 3, 
       0, 0, 0, 0, 0, 
-      0, 3 };
+      0, 3, 1, 1, 3, 3, 3 };
       for ( unsigned int i = 0; i < code.m_noOperations; ++i )
       {
         ScvalVMOperation& op = code.m_code[i];
@@ -500,11 +551,91 @@ void ScvalPrintCode( ScvalVMCode& code )
       printf( "Program size=%d bytes\n", code.m_noOperations*sizeof(ScvalVMOperation) + code.m_noConstData*sizeof(ScvalHashID) );
 #endif
 }
-bool ScvalAST::GenerateCode(ScvalVMCode& code)
+//===---------------------------------------------------------------------------===//
+// Superinstructions. Rewrites the head of the most common sequences with a fused
+// opcode. The rest of the sequence stays in place as operands of the fused
+// operation, so no address changes and a jump into the middle is still valid.
+//===---------------------------------------------------------------------------===//
+static void FuseOperations( ScvalASTGenCodeData& code )
+{
+  const unsigned int noOps = code.m_code.GetSize();
+  for ( unsigned int i = 0; i+2 < noOps; ++i )
+  {
+    ScvalVMOperation& a = code.m_code.Get(i);
+    const ScvalVMOperation& b = code.m_code.Get(i+1);
+    const ScvalVMOperation& c = code.m_code.Get(i+2);
+    if ( (a.opcode == VM_LDEN || a.opcode == VM_LDAN) && b.opcode == VM_CMPS && 
+         b.op0 == a.op0 && b.GetDataAddr() == VM_NILDATA && c.opcode == VM_JE )
+    {
+      a.opcode = a.opcode == VM_LDEN ? VM_LENJ : VM_LANJ;
+      i += 2;
+    }
+    else if ( a.opcode == VM_CMPS && a.GetDataAddr() != VM_NILDATA && 
+              b.opcode == VM_JNE && c.opcode == VM_INC )
+    {
+      a.opcode = VM_CJNI;
+      i += 2;
+    }
+  }
+}
+//===---------------------------------------------------------------------------===//
+// Hashed switch over the children names. Elements/attributes with many
+// alternatives jump straight to the body of the matching one instead of
+// comparing them in order. The compare chain stays after the switch (the
+// bodies are inside it), only its compares become dead code.
+// The table is built in m_switchData (see ScvalSwitchTarget for the
+// layout) and rebased at the end of the generation.
+//===---------------------------------------------------------------------------===//
+#ifndef SCVAL_SWITCH_THRESHOLD
+#define SCVAL_SWITCH_THRESHOLD 8 // minimum alternatives to use a switch
+#endif
+static void GenSwitchTable( ScvalASTGenCodeData& code, unsigned int switchAddr, 
+                            ScvalStaticDynArray<unsigned int,32,32>& cases, unsigned int missAddr )
+{
+  unsigned int size = 1;
+  while ( size < cases.GetSize()*2 ) // keeps load factor under 1/2
+    size <<= 1;
+  const unsigned int base = code.m_switchData.GetSize();
+  code.m_switchData.Create() = size-1;
+  for ( unsigned int i = 0; i < size; ++i )
+  {
+    code.m_switchData.Create() = 0;
+    code.m_switchData.Create() = missAddr;
+  }
+  for ( unsigned int i = 0; i < cases.GetSize(); ++i )
+  {
+    // each case starts with cmps r,data; jne; the body is right after
+    const unsigned int caseAddr = cases.Get(i);
+    const ScvalHashID hash = code.m_constData.Get( code.m_code.Get(caseAddr).GetDataAddr() );
+    if ( hash == 0 ) // same as nil, never gets here
+      continue;
+    unsigned int slot = hash & (size-1);
+    while ( code.m_switchData.Get(base+1+slot*2) != 0 && code.m_switchData.Get(base+1+slot*2) != hash )
+      slot = (slot+1) & (size-1);
+    if ( code.m_switchData.Get(base+1+slot*2) == hash ) // repeated name, first one wins as in the chain
+      continue;
+    code.m_switchData.Get(base+1+slot*2) = hash;
+    code.m_switchData.Get(base+2+slot*2) = caseAddr+2;
+  }
+  code.m_code.Get(switchAddr).SetDataAddr( base );
+}
+unsigned int ScvalAST::CountAlternatives( const ScvalASTNode& node )
+{
+  unsigned int count = 0;
+  for ( ScvalHandle h = node.firstchild; h != INVALIDHANDLE; h = GetNode(h).sibling )
+  {
+    const ScvalASTNodeType type = GetNode(h).type;
+    if ( type == AST_ONE || type == AST_ONE_MORE || type == AST_ZERO_MORE || type == AST_ZERO_ONE )
+      ++count;
+  }
+  return count;
+}
+bool ScvalAST::GenerateCode(ScvalVMCode& code, unsigned int flags)
 {
   // main code
   unsigned int lastOp=0;
   ScvalASTGenCodeData genCode;
+  genCode.m_flags = flags;
   ScvalASTNode& root = GetNode(ROOTHANDLE);
   ScvalHandle h=root.firstchild;
   while ( h != INVALIDHANDLE )
@@ -512,15 +643,18 @@ bool ScvalAST::GenerateCode(ScvalVMCode& code)
     ScvalASTNode& n = GetNode(h);
     if ( n.type == AST_CHILDREN )
     {
+      genCode.m_records = true;
       if ( !GenCodeChildrenElements(genCode,n,0,0) )
         return false;
+      genCode.m_records = false;
       lastOp = genCode.m_code.GetSize();
       genCode.m_code.Create().Set( VM_JMP );
     }
     h = n.sibling;
   }
 
-  // Subroutines for type checking
+  // Subroutines for type checking and element types
+  ScvalStaticDynArray<ScvalASTSubroutine,32,32> subs;
   h=root.firstchild;
   while ( h != INVALIDHANDLE )
   {
@@ -528,17 +662,9 @@ bool ScvalAST::GenerateCode(ScvalVMCode& code)
     if ( n.type == AST_TYPEDEF )
     {
       ScvalASTNode& nFirst = GetNode(n.firstchild);
-      // search for call to this type in the whole code, and substitute with correct addr
-      for ( unsigned int i = 0; i < genCode.m_code.GetSize(); ++i )
-      {
-        ScvalVMOperation& op = genCode.m_code.Get(i);
-        if ( op.opcode == VM_CHKC )
-        {
-          ScvalHandle lh = nFirst.leaf;
-          if ( op.GetDataAddr() == lh )
-            op.SetDataAddr( genCode.m_code.GetSize() );
-        }
-      }
+      ScvalASTSubroutine& sub = subs.Create();
+      sub.leaf = nFirst.leaf;
+      sub.addr = genCode.m_code.GetSize();
       // generate code for this type check
       if ( nFirst.sibling != INVALIDHANDLE )
       {
@@ -552,6 +678,11 @@ bool ScvalAST::GenerateCode(ScvalVMCode& code)
           genCode.m_code.Create().Set( VM_CALL ).SetDataAddr(dataAddr);
           genCode.m_code.Create().Set( VM_JE ).SetAddr( VM_ERRADDR );
           }break;
+        case AST_ATTRS    : // element type, its registers start at 0 in the frame
+        case AST_CHILDREN :
+          if ( !GenCodeElementBody(genCode, nFirst.sibling, 0, 0) )
+            return false;
+          break;
         case AST_OR       : break;
         case AST_AND      : break;
         }
@@ -561,10 +692,42 @@ bool ScvalAST::GenerateCode(ScvalVMCode& code)
     }
     h = n.sibling;
   }  
+  // calls to the subroutines, the first typedef of a name wins
+  for ( unsigned int i = 0; i < genCode.m_subCalls.GetSize(); ++i )
+  {
+    ScvalVMOperation& op = genCode.m_code.Get( genCode.m_subCalls.Get(i) );
+    unsigned int j = 0;
+    while ( j < subs.GetSize() && subs.Get(j).leaf != op.GetDataAddr() )
+      ++j;
+    if ( j == subs.GetSize() ) // undefined type
+      return false;
+    const unsigned int subAddr = subs.Get(j).addr;
+    if ( subAddr >= VM_NILDATA ) // only 16 bits for the address
+      return false;
+    op.SetDataAddr( subAddr );
+  }
 
   // last main code operation should jump to the end of total code (right after type checking routines)
   genCode.m_code.Get(lastOp).SetAddr( genCode.m_code.GetSize() );
 
+  if ( !(flags & COMPILE_NOFUSION) )
+    FuseOperations( genCode );
+
+  // switch tables go right after the constants
+  const unsigned int noSwitchData = genCode.m_switchData.GetSize();
+  if ( noSwitchData > 0 )
+  {
+    const unsigned int base = genCode.m_constData.GetSize();
+    if ( base+noSwitchData > VM_NILDATA )
+      return false;
+    for ( unsigned int i = 0; i < genCode.m_code.GetSize(); ++i )
+    {
+      ScvalVMOperation& op = genCode.m_code.Get(i);
+      if ( op.opcode == VM_SWITCH )
+        op.SetDataAddr( op.GetDataAddr()+base );
+    }
+  }
+
   // filling final code/data container
   code.Clear();
   if ( genCode.m_code.GetSize() > 0 )
@@ -574,12 +737,15 @@ bool ScvalAST::GenerateCode(ScvalVMCode& code)
     for ( unsigned int i=0; i < code.m_noOperations; ++i )
       code.m_code[i] = genCode.m_code.Get(i);
   }
-  if ( genCode.m_constData.GetSize() > 0 )
+  if ( genCode.m_constData.GetSize()+noSwitchData > 0 )
   {
-    code.m_noConstData = genCode.m_constData.GetSize();
+    const unsigned int noConsts = genCode.m_constData.GetSize();
+    code.m_noConstData = noConsts+noSwitchData;
     code.m_constData = (ScvalHashID*)malloc( sizeof(ScvalHashID)*code.m_noConstData );
-    for ( unsigned int i=0; i < code.m_noConstData; ++i )
+    for ( unsigned int i=0; i < noConsts; ++i )
       code.m_constData[i] = genCode.m_constData.Get(i);
+    for ( unsigned int i=0; i < noSwitchData; ++i )
+      code.m_constData[noConsts+i] = genCode.m_switchData.Get(i);
   }
   code.m_maxRegCounter = genCode.m_maxRegCounter;
   code.m_maxRegStrings = genCode.m_maxRegStrings;
@@ -591,10 +757,21 @@ bool ScvalAST::GenCodeChildrenElements( ScvalASTGenCodeData& code, const ScvalAS
   unsigned int whileAddr = code.m_code.GetSize();
   code.m_code.Create().Set( VM_LDEN, rbs ); 
   code.m_code.Create().Set( VM_CMPS, rbs, 0xff, 0xff ); // cmps with nil
-  ScvalVMOperation& opJe = code.m_code.Create().Set( VM_JE );
+  const unsigned int jeAddr = code.m_code.GetSize(); // index, the array may grow
+  code.m_code.Create().Set( VM_JE );
+  unsigned int switchAddr = VM_ERRADDR;
+  if ( !(code.m_flags & COMPILE_NOSWITCH) && CountAlternatives(node) >= SCVAL_SWITCH_THRESHOLD )
+  {
+    switchAddr = code.m_code.GetSize();
+    code.m_code.Create().Set( VM_SWITCH, rbs );
+  }
   ScvalHandle h=node.firstchild;
   int rc=rbc;
+  // the counters of the alternatives stay in use through the loop, the
+  // elements inside use the ones after them
+  const int rbcInner = rbc+(int)CountAlternatives(node);
   ScvalStaticDynArray<unsigned int,32,32> jmpToNextElm;
+  ScvalStaticDynArray<unsigned int,32,32> cases;
   while ( h != INVALIDHANDLE )
   {
     ScvalASTNode& n = GetNode(h);
@@ -604,21 +781,25 @@ bool ScvalAST::GenCodeChildrenElements( ScvalASTGenCodeData& code, const ScvalAS
     case AST_ONE_MORE:
     case AST_ZERO_MORE:
     case AST_ZERO_ONE: 
-      if ( ! GenCodeChildElement(code, n,rc++,rbs) ) 
+      cases.Create()=code.m_code.GetSize();
+      if ( ! GenCodeChildElement(code, n,rc++,rbcInner,rbs) ) 
         return false;
       jmpToNextElm.Create()=code.m_code.GetSize()-1;
       break;
     }
     h = n.sibling;
   }
+  if ( switchAddr != VM_ERRADDR )
+    GenSwitchTable( code, switchAddr, cases, code.m_code.GetSize() );
   code.m_code.Create().Set(VM_JMP).SetAddr(VM_ERRADDR); // jmp err
   for ( unsigned int i = 0; i < jmpToNextElm.GetSize(); ++i )
     code.m_code.Get(jmpToNextElm.Get(i)).SetAddr( code.m_code.GetSize() );
   code.m_code.Create().Set(VM_NEXT);
   code.m_code.Create().Set(VM_JMP).SetAddr(whileAddr);
+  // no more elements, the occurrences of each one are compared
+  code.m_code.Get(jeAddr).SetAddr( code.m_code.GetSize() );
   if ( ! GenCodeCountersComparison(code, node, rbc) )
     return false;  
-  opJe.SetAddr( code.m_code.GetSize() );
 
   if ( rbs > (int)code.m_maxRegStrings )
     code.m_maxRegStrings = rbs;  
@@ -645,6 +826,9 @@ bool ScvalAST::GenCodeCountersComparison( ScvalASTGenCodeData& code, const Scval
       code.m_code.Create().Set( VM_CMPI, rc++, 1 );
       code.m_code.Create().Set( VM_JG).SetAddr(VM_ERRADDR);// jg err
       break;
+    case AST_ZERO_MORE: // any count, only reset for the next loop using the register
+      code.m_code.Create().Set( VM_CMPI, rc++, 0 );
+      break;
     }
     h = n.sibling;
   }
@@ -659,10 +843,18 @@ bool ScvalAST::GenCodeChildrenAttributes( ScvalASTGenCodeData& code, const Scval
   unsigned int whileAddr=code.m_code.GetSize();
   code.m_code.Create().Set(VM_LDAN, rbs);
   code.m_code.Create().Set(VM_CMPS, rbs, 0xff, 0xff );
-  ScvalVMOperation& opJe = code.m_code.Create().Set(VM_JE);
+  const unsigned int jeAddr = code.m_code.GetSize(); // index, the array may grow
+  code.m_code.Create().Set(VM_JE);
+  unsigned int switchAddr = VM_ERRADDR;
+  if ( !(code.m_flags & COMPILE_NOSWITCH) && CountAlternatives(node) >= SCVAL_SWITCH_THRESHOLD )
+  {
+    switchAddr = code.m_code.GetSize();
+    code.m_code.Create().Set( VM_SWITCH, rbs );
+  }
   ScvalHandle h=node.firstchild;
   int rc=rbc;
   ScvalStaticDynArray<unsigned int,32,32> jmpToNextAtt;
+  ScvalStaticDynArray<unsigned int,32,32> cases;
   while ( h != INVALIDHANDLE )
   {
     ScvalASTNode& n = GetNode(h);
@@ -672,6 +864,7 @@ bool ScvalAST::GenCodeChildrenAttributes( ScvalASTGenCodeData& code, const Scval
     case AST_ONE_MORE:
     case AST_ZERO_MORE:
     case AST_ZERO_ONE: 
+      cases.Create()=code.m_code.GetSize();
       if ( ! GenCodeChildAttribute(code, n, rc++, rbs) ) 
         return false; 
       jmpToNextAtt.Create()=code.m_code.GetSize()-1;
@@ -679,14 +872,17 @@ bool ScvalAST::GenCodeChildrenAttributes( ScvalASTGenCodeData& code, const Scval
     }
     h = n.sibling;
   }
+  if ( switchAddr != VM_ERRADDR )
+    GenSwitchTable( code, switchAddr, cases, code.m_code.GetSize() );
   code.m_code.Create().Set(VM_JMP).SetAddr(VM_ERRADDR); // jmp err
   for ( unsigned int i = 0; i < jmpToNextAtt.GetSize(); ++i )
     code.m_code.Get(jmpToNextAtt.Get(i)).SetAddr( code.m_code.GetSize() );
   code.m_code.Create().Set( VM_NATT );
   code.m_code.Create().Set( VM_JMP ).SetAddr( whileAddr );
+  // no more attributes, the occurrences of each one are compared
+  code.m_code.Get(jeAddr).SetAddr( code.m_code.GetSize() );
   if ( ! GenCodeCountersComparison(code, node,rbc) )
     return false;  
-  opJe.SetAddr( code.m_code.GetSize() );
   if ( rbs > (int)code.m_maxRegStrings )
     code.m_maxRegStrings = rbs;
   return true;
@@ -696,14 +892,17 @@ bool ScvalAST::GenCodeChildAttribute( ScvalASTGenCodeData& code, const ScvalASTN
   ScvalASTNode& n = GetNode(node.firstchild);
   unsigned int dataAddr = code.m_constData.Set( n.leaf, GetLeaf(n.leaf).id );
   code.m_code.Create().Set( VM_CMPS, rbs ).SetDataAddr(dataAddr);
-  ScvalVMOperation& opJne = code.m_code.Create().Set( VM_JNE );
+  const unsigned int jneAddr = code.m_code.GetSize(); // index, the array may grow
+  code.m_code.Create().Set( VM_JNE );
   code.m_code.Create().Set( VM_INC, rbc );
-  code.m_code.Create().Set( VM_LDAV, rbs+1 );
-  if ( ! GenCodeCheckType(code, GetNode(n.sibling), rbs+1) )
+  // str values are not inspected, the hook can skip their decoding
+  const ScvalASTNode& nType = GetNode(n.sibling);
+  code.m_code.Create().Set( VM_LDAV, rbs+1, nType.type == AST_STR ? VM_RAWVALUE : 0 );
+  if ( ! GenCodeCheckType(code, nType, rbs+1) )
     return false;
   //finish the inner body of the CMPS (when it's true), so jump to the end of if chain (like a switch)
   code.m_code.Create().Set( VM_JMP ); // jmp to natt, the addr will be filled in GenCodeChildrenElemen
-  opJne.SetAddr( code.m_code.GetSize() );
+  code.m_code.Get(jneAddr).SetAddr( code.m_code.GetSize() );
   if ( rbc > (int)code.m_maxRegCounter )
     code.m_maxRegCounter = rbc;
   return true;
@@ -718,7 +917,10 @@ bool ScvalAST::GenCodeCheckType( ScvalASTGenCodeData& code, const ScvalASTNode&
   case AST_BOOL: code.m_code.Create().Set( VM_CHKN, rbs, 3 ); break;
   case AST_ID  :
     {
+      if ( IsElementType(node.leaf) ) // not for values
+        return false;
       code.m_constData.Set( node.leaf, GetLeaf(node.leaf).id );
+      code.m_subCalls.Create() = code.m_code.GetSize();
       code.m_code.Create().Set( VM_CHKC, rbs ).SetDataAddr(node.leaf);
     }break;
   }
@@ -726,54 +928,368 @@ bool ScvalAST::GenCodeCheckType( ScvalASTGenCodeData& code, const ScvalASTNode&
     code.m_maxRegStrings = rbs;
   return true;
 }
-bool ScvalAST::GenCodeChildElement( ScvalASTGenCodeData& code, const ScvalASTNode& node, int rbc, int rbs )
+bool ScvalAST::GenCodeChildElement( ScvalASTGenCodeData& code, const ScvalASTNode& node, int rbc, int rbcInner, int rbs )
 {
   ScvalASTNode& n = GetNode(node.firstchild);
   unsigned int dataAddr = code.m_constData.Set( n.leaf, GetLeaf(n.leaf).id );
   code.m_code.Create().Set( VM_CMPS, rbs ).SetDataAddr( dataAddr );
-  ScvalVMOperation& opJne = code.m_code.Create().Set( VM_JNE );
+  const unsigned int jneAddr = code.m_code.GetSize(); // index, the array may grow
+  code.m_code.Create().Set( VM_JNE );
   code.m_code.Create().Set( VM_INC, rbc );
-  ScvalHandle h = GetNode(node.firstchild).sibling;
+  const ScvalHandle hType = n.sibling;
+  if ( hType != INVALIDHANDLE && GetNode(hType).type == AST_ID && IsElementType(GetNode(hType).leaf) )
+  {
+    // the element type brings the attributes and children, call it with a
+    // new frame right above the registers in use here
+    if ( GetNode(hType).sibling != INVALIDHANDLE )
+      return false;
+    const int base = rbcInner > rbs ? rbcInner : rbs+1;
+    code.m_subCalls.Create() = code.m_code.GetSize();
+    code.m_code.Create().Set( VM_JSR, (unsigned char)base ).SetDataAddr( GetNode(hType).leaf );
+  }
+  else if ( !GenCodeElementBody(code, hType, rbcInner, rbs+1) )
+    return false;
+  //finish the inner body of the CMPS (when it's true), so jump to the end of if chain (like a switch)
+  code.m_code.Create().Set( VM_JMP ); // jmp to next, the addr will be filled in GenCodeChildrenElements
+  code.m_code.Get(jneAddr).SetAddr( code.m_code.GetSize() );
+  if ( rbc > (int)code.m_maxRegCounter )
+    code.m_maxRegCounter = rbc;
+  if ( rbs > (int)code.m_maxRegStrings )
+    code.m_maxRegStrings = rbs;
+  return true;
+}
+// Type, attributes and children of an element, from the node hFirst on
+bool ScvalAST::GenCodeElementBody( ScvalASTGenCodeData& code, ScvalHandle hFirst, int rbc, int rbs )
+{
+  ScvalHandle h = hFirst;
   while ( h != INVALIDHANDLE )
   {
     ScvalASTNode& n = GetNode(h);
     switch ( n.type )
     {
     case AST_ATTRS: 
-      if ( ! GenCodeChildrenAttributes(code, n, rbc+1, rbs+1) )
+      if ( ! GenCodeChildrenAttributes(code, n, rbc, rbs) )
         return false;
       break;
     case AST_CHILDREN: 
+      {
       code.m_code.Create().Set( VM_DOWN );
-      if ( ! GenCodeChildrenElements(code, n, rbc+1, rbs+1) )
+      // the loop over the children of the root, headed by its counters (see ScvalVMRecords)
+      const bool records = code.m_records;
+      if ( records )
+        code.m_code.Create().Set( VM_CLR, (unsigned char)rbc, (unsigned char)CountAlternatives(n) );
+      code.m_records = false;
+      if ( ! GenCodeChildrenElements(code, n, rbc, rbs) )
         return false; 
+      code.m_records = records;
       code.m_code.Create().Set( VM_UP );
-      break;
+      }break;
     default:
       if ( n.leaf != INVALIDHANDLE )
       {
-        code.m_code.Create().Set( VM_LDEV, rbs+1 );
-        if ( !GenCodeCheckType(code, n, rbs+1) )
+        code.m_code.Create().Set( VM_LDEV, rbs, n.type == AST_STR ? VM_RAWVALUE : 0 );
+        if ( !GenCodeCheckType(code, n, rbs) )
           return false;
       }
     }
     h = n.sibling;
   }
-  //finish the inner body of the CMPS (when it's true), so jump to the end of if chain (like a switch)
-  code.m_code.Create().Set( VM_JMP ); // jmp to next, the addr will be filled in GenCodeChildrenElements
-  opJne.SetAddr( code.m_code.GetSize() );
-  if ( rbc > (int)code.m_maxRegCounter )
-    code.m_maxRegCounter = rbc;
-  if ( rbs > (int)code.m_maxRegStrings )
-    code.m_maxRegStrings = rbs;
   return true;
 }
+// True when the typedef of this name is an element type
+bool ScvalAST::IsElementType( ScvalHandle hLeaf )
+{
+  for ( ScvalHandle h = GetNode(ROOTHANDLE).firstchild; h != INVALIDHANDLE; h = GetNode(h).sibling )
+  {
+    const ScvalASTNode& n = GetNode(h);
+    if ( n.type != AST_TYPEDEF || GetNode(n.firstchild).leaf != hLeaf )
+      continue;
+    const ScvalHandle hBody = GetNode(n.firstchild).sibling;
+    return hBody != INVALIDHANDLE && ( GetNode(hBody).type == AST_ATTRS || GetNode(hBody).type == AST_CHILDREN );
+  }
+  return false;
+}
 //===---------------------------------------------------------------------------===//
 //===---------------------------------------------------------------------------===//
-bool ScvalCompile(const char* text, ScvalVMCode& outBytecode )
+bool ScvalCompile(const char* text, ScvalVMCode& outBytecode, unsigned int flags )
 {
   ScvalParser parser;
-  return parser.Parse(text) && parser.GenerateCode(outBytecode);
+  return parser.Parse(text) && parser.GenerateCode(outBytecode, flags);
+}
+
+//===---------------------------------------------------------------------------===//
+// AHEAD OF TIME GENERATION
+// Translates the bytecode into a C++ function template over the hook type, which
+// has the per operation methods of ScvalInstHookT. Every
+// operation becomes a labeled statement, jumps become gotos, constants are
+// folded as immediates and registers become locals, so there is no dispatch
+// nor code/data segment left at run time. The chkc/jsr call stack is a local
+// array of return sites and frame bases, ret resolves the site by a switch.
+// Registers are only relative to the frame base (b) when there are element
+// type subroutines.
+//===---------------------------------------------------------------------------===//
+static unsigned int AotTarget( const ScvalVMCode& code, unsigned int addr )
+{
+  // anything out of the program (but the error) finishes it normally
+  return (addr >= code.m_noOperations && addr != VM_ERRADDR) ? code.m_noOperations : addr;
+}
+static void AotLabel( FILE* f, const ScvalVMCode& code, unsigned int addr )
+{
+  addr = AotTarget( code, addr );
+  if ( addr == VM_ERRADDR )
+    fprintf( f, "goto L_err;" );
+  else if ( addr == code.m_noOperations )
+    fprintf( f, "goto L_end;" );
+  else
+    fprintf( f, "goto L_%u;", addr );
+}
+bool ScvalGenerateCpp( const ScvalVMCode& code, const char* functionName, const char* outFile )
+{
+  const unsigned int n = code.m_noOperations;
+  if ( !functionName || !outFile || (n && !code.m_code) )
+    return false;
+
+  // which operations are jump targets or return sites (need a label)
+  unsigned char* labeled = (unsigned char*)calloc( n+1, 1 );
+  ScvalHashID* types = (ScvalHashID*)malloc( sizeof(ScvalHashID)*(n+1) ); // custom types of the calls
+  if ( !labeled || !types )
+  {
+    free( labeled );
+    free( types );
+    return false;
+  }
+  bool hasChkc = false, hasJsr = false;
+  for ( unsigned int i = 0; i < n; ++i )
+  {
+    const ScvalVMOperation& op = code.m_code[i];
+    switch ( op.opcode )
+    {
+    case VM_JE: case VM_JNE: case VM_JG: case VM_JMP:
+      if ( op.GetAddr() != VM_ERRADDR )
+        labeled[AotTarget(code,op.GetAddr())] = 1;
+      break;
+    case VM_CHKC:
+    case VM_JSR:
+      labeled[AotTarget(code,op.GetDataAddr())] = 1;
+      labeled[i+1] = 1;
+      hasChkc = true;
+      hasJsr = hasJsr || op.opcode == VM_JSR;
+      break;
+    case VM_SWITCH:
+      {
+        const ScvalHashID* table = code.m_constData+op.GetDataAddr();
+        for ( unsigned int j = 0; j <= table[0]; ++j )
+          if ( table[2+j*2] != VM_ERRADDR )
+            labeled[AotTarget(code,table[2+j*2])] = 1;
+      }break;
+    }
+  }
+
+  FILE* f = fopen( outFile, "wt" );
+  if ( !f )
+  {
+    free( labeled );
+    free( types );
+    return false;
+  }
+  fprintf( f, "// Generated by scval from the compiled schema. Do not edit.\n" );
+  fprintf( f, "// %u operations, %u constants\n", n, code.m_noConstData );
+  fprintf( f, "#include \"scvaltypes.h\"\n" );
+  fprintf( f, "#include <ctype.h>\n" );
+  fprintf( f, "#include <stddef.h>\n" );
+  fprintf( f, "#include <string.h>\n\n" );
+  fprintf( f, "#ifndef SCVAL_AOT_HELPERS\n#define SCVAL_AOT_HELPERS\n" );
+  fprintf( f, "namespace scvalaot\n{\n" );
+  fprintf( f, "inline ScvalHashID Hash( const char* sym )\n{\n" );
+  fprintf( f, "  if ( !sym ) return 0;\n  int hash = 5381;\n" );
+  fprintf( f, "  while (*sym)\n    hash = ((hash << 5) + hash) ^ *(sym++);\n" );
+  fprintf( f, "  return (ScvalHashID)hash;\n}\n" );
+  // as ScvalVM::IsInteger and ScvalVM::IsReal
+  fprintf( f, "inline bool IsInteger( const char* str )\n{\n" );
+  fprintf( f, "  if ( !str )\n    return false;\n  if ( *str == '-' || *str == '+' )\n    ++str;\n" );
+  fprintf( f, "  const char* digits = str;\n  while ( isdigit((unsigned char)*str) )\n    ++str;\n" );
+  fprintf( f, "  return str != digits && !*str;\n}\n" );
+  fprintf( f, "inline bool IsReal( const char* str )\n{\n" );
+  fprintf( f, "  if ( !str )\n    return false;\n  if ( *str == '-' || *str == '+' )\n    ++str;\n" );
+  fprintf( f, "  const char* digits = str;\n  while ( isdigit((unsigned char)*str) )\n    ++str;\n" );
+  fprintf( f, "  bool hasDigits = str != digits;\n  if ( *str == '.' )\n  {\n    digits = ++str;\n" );
+  fprintf( f, "    while ( isdigit((unsigned char)*str) )\n      ++str;\n    hasDigits = hasDigits || str != digits;\n  }\n" );
+  fprintf( f, "  return hasDigits && !*str;\n}\n" );
+  fprintf( f, "inline const ScvalCheck* FindCheck( const ScvalCheckTable* checks, ScvalHashID typeName )\n{\n" );
+  fprintf( f, "  for ( unsigned int i = 0; checks && i < checks->m_noChecks; ++i )\n" );
+  fprintf( f, "    if ( checks->m_checks[i].typeName == typeName )\n      return checks->m_checks+i;\n  return 0;\n}\n" );
+  fprintf( f, "template<typename Hook>\n" );
+  fprintf( f, "inline bool Check( Hook& hook, const ScvalCheck* check, ScvalHashID typeName, const char* value )\n{\n" );
+  fprintf( f, "  if ( !check )\n    return hook.Check( typeName, value );\n" );
+  fprintf( f, "  return check->func( value, value ? (unsigned int)strlen(value) : 0, check->user );\n}\n" );
+  fprintf( f, "} // namespace scvalaot\n#endif\n\n" );
+  fprintf( f, "// Strings returned by the hook must stay alive during the whole validation.\n" );
+  fprintf( f, "// The custom types are checked by the checks registered in the table, or\n" );
+  fprintf( f, "// by the hook's Check without checks (failing when the hook doesn't check), as\n// ScvalVMT does.\n" );
+  fprintf( f, "template<typename Hook>\nbool %s( Hook& hook, const ScvalCheckTable* checks=0 )\n{\n", functionName );
+  // same register file as the VM (see ScvalVMContext::Init)
+  const unsigned int frameRegs = (code.m_maxRegCounter > code.m_maxRegStrings ? code.m_maxRegCounter : code.m_maxRegStrings)+1;
+  const unsigned int extraRegs = hasJsr ? frameRegs*SCVAL_MAX_CALL_DEPTH : 0;
+  const char* rb = hasJsr ? "b+" : "";
+  fprintf( f, "  unsigned short c[%u] = {0};\n", code.m_maxRegCounter+1+extraRegs );
+  fprintf( f, "  ScvalHashID h[%u] = {0};\n", code.m_maxRegStrings+1+extraRegs );
+  fprintf( f, "  const char* s[%u] = {0};\n", code.m_maxRegStrings+1+extraRegs );
+  fprintf( f, "  ScvalHookString hs; // last load\n" );
+  // the check of every custom type, a missing one fails as binding the VM
+  unsigned int noTypes = 0;
+  for ( unsigned int i = 0; i < n; ++i )
+  {
+    if ( code.m_code[i].opcode != VM_CALL )
+      continue;
+    const ScvalHashID typeName = code.m_constData[code.m_code[i].GetDataAddr()];
+    unsigned int t = 0;
+    while ( t < noTypes && types[t] != typeName )
+      ++t;
+    if ( t == noTypes )
+    {
+      types[noTypes++] = typeName;
+      fprintf( f, "  const ScvalCheck* k%u = scvalaot::FindCheck( checks, 0x%08xu );\n", t, typeName );
+      fprintf( f, "  if ( !k%u && ( (checks && checks->m_noChecks) || !hook.Checks() ) ) return false;\n", t );
+    }
+  }
+  fprintf( f, "  int cmp=0;\n" );
+  fprintf( f, "  unsigned int chk=0;\n" );
+  if ( hasChkc )
+  {
+    fprintf( f, "  unsigned int b=0, sp=0;\n" );
+    fprintf( f, "  unsigned int stk[%u]; // return site and frame base\n", (SCVAL_MAX_CALL_DEPTH+1)*2 );
+  }
+
+  // hook methods (see ScvalInstHookT)
+  static const char* hooknames[]={
+    "ElementName", "ElementValue", "AttributeName", "AttributeValue", 0, 0,
+    0, 0, 0, 0, 0, 0,
+    0, 0,
+    "Down", "Up", "FirstAttribute", "NextAttribute", "NextElement" };
+  for ( unsigned int i = 0; i < n; ++i )
+  {
+    const ScvalVMOperation& op = code.m_code[i];
+    if ( labeled[i] )
+      fprintf( f, "L_%u:\n", i );
+    // superinstructions only rewrite the head, the rest of the sequence follows
+    unsigned char opcode = op.opcode;
+    if ( opcode == VM_LENJ ) opcode = VM_LDEN;
+    else if ( opcode == VM_LANJ ) opcode = VM_LDAN;
+    else if ( opcode == VM_CJNI ) opcode = VM_CMPS;
+    fprintf( f, "  " );
+    switch ( opcode )
+    {
+    case VM_LDEN:
+    case VM_LDEV:
+    case VM_LDAN:
+    case VM_LDAV:
+      if ( op.op1 == VM_RAWVALUE ) // not inspected, neither hashed (see ScvalVMContext::LoadRaw)
+        fprintf( f, "hook.%s( hs ); s[%s%u] = hs.str; h[%s%u] = 0;",
+          opcode == VM_LDEV ? "ElementRawValue" : "AttributeRawValue", rb, op.op0, rb, op.op0 );
+      else
+        fprintf( f, "hook.%s( hs ); s[%s%u] = hs.str; h[%s%u] = hs.hashed && hs.str ? hs.hash : scvalaot::Hash( hs.str );",
+          hooknames[opcode], rb, op.op0, rb, op.op0 );
+      break;
+    case VM_CMPS:
+      if ( op.GetDataAddr() == VM_NILDATA )
+        fprintf( f, "cmp = (int)h[%s%u];", rb, op.op0 );
+      else
+        fprintf( f, "cmp = (int)(h[%s%u] - 0x%08xu);", rb, op.op0, code.m_constData[op.GetDataAddr()] );
+      break;
+    case VM_CMPI:
+      fprintf( f, "cmp = c[%s%u] - %u; c[%s%u]=0;", rb, op.op0, op.op1, rb, op.op0 );
+      break;
+    case VM_JE:  fprintf( f, "if ( cmp == 0 ) " ); AotLabel( f, code, op.GetAddr() ); break;
+    case VM_JNE: fprintf( f, "if ( cmp != 0 ) " ); AotLabel( f, code, op.GetAddr() ); break;
+    case VM_JG:  fprintf( f, "if ( cmp > 0 ) " ); AotLabel( f, code, op.GetAddr() ); break;
+    case VM_JMP: AotLabel( f, code, op.GetAddr() ); break;
+    case VM_CLR: fprintf( f, ";" ); break;
+    case VM_INC: fprintf( f, "++c[%s%u];", rb, op.op0 ); break;
+    case VM_CHKN:
+      switch ( op.op1 ) // native type to check
+      {
+      case 0: fprintf( f, "if ( !scvalaot::IsReal(s[%s%u]) ) goto L_err;", rb, op.op0 ); break;
+      case 2: fprintf( f, "if ( !scvalaot::IsInteger(s[%s%u]) ) goto L_err;", rb, op.op0 ); break;
+      case 3:
+        fprintf( f, "if ( h[%s%u] != 0x%08xu && h[%s%u] != 0x%08xu && h[%s%u] != 0x%08xu && h[%s%u] != 0x%08xu ) goto L_err;",
+          rb, op.op0, ScvalHash("true"), rb, op.op0, ScvalHash("false"), rb, op.op0, ScvalHash("0"), rb, op.op0, ScvalHash("1") );
+        break;
+      default: fprintf( f, ";" ); break;
+      }
+      break;
+    case VM_CHKC:
+      fprintf( f, "if ( sp >= %u ) goto L_err; chk = %s%u; stk[sp++] = %u; stk[sp++] = b; ",
+        (SCVAL_MAX_CALL_DEPTH+1)*2, rb, op.op0, i+1 );
+      AotLabel( f, code, op.GetDataAddr() );
+      break;
+    case VM_JSR:
+      fprintf( f, "if ( sp >= %u ) goto L_err; stk[sp++] = %u; stk[sp++] = b; b += %u; ",
+        SCVAL_MAX_CALL_DEPTH*2, i+1, op.op0 );
+      AotLabel( f, code, op.GetDataAddr() );
+      break;
+    case VM_DOWN:
+    case VM_UP  :
+    case VM_GATT:
+    case VM_NATT:
+    case VM_NEXT:
+      fprintf( f, "hook.%s();", hooknames[opcode] );
+      break;
+    case VM_RET:
+      if ( !hasChkc )
+      {
+        fprintf( f, "return false;" );
+        break;
+      }
+      fprintf( f, "if ( sp == 0 ) goto L_err;\n  b = stk[--sp];\n  switch ( stk[--sp] )\n  {\n" );
+      for ( unsigned int j = 0; j < n; ++j )
+        if ( code.m_code[j].opcode == VM_CHKC || code.m_code[j].opcode == VM_JSR )
+        {
+          fprintf( f, "  case %u: ", j+1 );
+          AotLabel( f, code, j+1 );
+          fprintf( f, "\n" );
+        }
+      fprintf( f, "  default: return false;\n  }" );
+      break;
+    case VM_CALL:
+      {
+        const ScvalHashID typeName = code.m_constData[op.GetDataAddr()];
+        unsigned int t = 0;
+        while ( t < noTypes && types[t] != typeName )
+          ++t;
+        fprintf( f, "cmp = scvalaot::Check( hook, k%u, 0x%08xu, s[chk] ) ? 1 : 0;", t, typeName );
+      }break;
+    case VM_SWITCH: // the compiler builds a jump table or a binary search from it
+      {
+        const ScvalHashID* table = code.m_constData+op.GetDataAddr();
+        unsigned int missAddr = VM_ERRADDR;
+        fprintf( f, "switch ( h[%u] )\n  {\n", op.op0 );
+        for ( unsigned int j = 0; j <= table[0]; ++j )
+        {
+          if ( table[1+j*2] == 0 )
+          {
+            missAddr = table[2+j*2];
+            continue;
+          }
+          fprintf( f, "  case 0x%08xu: ", table[1+j*2] );
+          AotLabel( f, code, table[2+j*2] );
+          fprintf( f, "\n" );
+        }
+        fprintf( f, "  default: " );
+        AotLabel( f, code, missAddr );
+        fprintf( f, "\n  }" );
+      }break;
+    default:
+      fprintf( f, "return false;" );
+      break;
+    }
+    fprintf( f, "\n" );
+  }
+  fprintf( f, "L_end:\n  return true;\nL_err:\n  return false;\n}\n" );
+  free( labeled );
+  free( types );
+  const bool ok = !ferror( f );
+  fclose( f );
+  return ok;
 }
 
 #undef CONSUME
@@ -0,0 +1,415 @@
+#include "scvaltypes.h"
+#include <string.h>
+#include <stdlib.h>
+
+#define SAFEFREE(arp) { if ( arp ){ free((void*)(arp)); (arp)=0; } }
+
+#if defined(_M_X64) || defined(__x86_64__)
+#define SCVAL_JIT_X64
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+#endif
+
+//===---------------------------------------------------------------------------===//
+// Calls from native code back to the VM. Everything touching the hook or the
+// strings goes through them, the native code only does the control flow,
+// hash comparisons and counters.
+//===---------------------------------------------------------------------------===//
+ScvalHashID ScvalVM::JitLoad( ScvalVM* vm, int opcode, int reg )
+{
+  ScvalHookString retStr;
+  vm->m_batch.Load( vm->m_jitHook, (ScvalVMOpcode)opcode, retStr );
+  return vm->m_mainCtx.m_regStrHashes[reg] = vm->m_mainCtx.LoadString( reg, retStr );
+}
+ScvalHashID ScvalVM::JitLoadRaw( ScvalVM* vm, int opcode, int reg )
+{
+  ScvalHookString retStr;
+  vm->m_batch.Load( vm->m_jitHook, (ScvalVMOpcode)opcode, retStr, true );
+  return vm->m_mainCtx.m_regStrHashes[reg] = vm->m_mainCtx.LoadRaw( reg, retStr );
+}
+int ScvalVM::JitNavigate( ScvalVM* vm, int opcode, int )
+{
+  vm->m_batch.Navigate( vm->m_jitHook, (ScvalVMOpcode)opcode );
+  return 0;
+}
+int ScvalVM::JitCheckNative( ScvalVM* vm, int nativeType, int reg )
+{
+  const ScvalVMContext& ctx = vm->m_mainCtx;
+  switch ( nativeType )
+  {
+  case 0: return vm->IsReal( ctx.m_regStrings[reg].str ) ? 1 : 0;
+  case 2: return vm->IsInteger( ctx.m_regStrings[reg].str ) ? 1 : 0;
+  case 3: return vm->IsBool( ctx.m_regStrHashes[reg] ) ? 1 : 0;
+  }
+  return 1;
+}
+int ScvalVM::JitCallback( ScvalVM* vm, int dataAddr, int reg )
+{
+  if ( vm->m_deferred.IsEnabled() )
+    return vm->DeferCheck( vm->m_jitHook, vm->m_checks.m_calls[dataAddr], reg );
+  return vm->m_callCache.Call( vm->m_jitHook, vm->m_checks.m_calls[dataAddr], vm->m_mainCtx.m_regStrings[reg], vm->m_mainCtx.m_regStrHashes[reg], vm->RunStats() );
+}
+
+#ifdef SCVAL_JIT_X64
+//===---------------------------------------------------------------------------===//
+// x86-64 emitter. Register usage of the generated code:
+// rbx = ScvalVM*, r12 = counter registers, r13 = hash registers (both
+// of the current frame), r14d = comparison result, r15d = base of the
+// current frame, ebp = string register argument of the check type
+// subroutine (absolute).
+// Subroutines use the native stack: jsr pushes r12, r13 and r15, chkc
+// keeps the alignment, then both push the return address and the shadow
+// space of the helpers called from the subroutine (see CallSub), which
+// ret drops before returning. The stack pointer at the entry is kept in
+// m_jitStack, to check the depth and to leave from any depth on error.
+//===---------------------------------------------------------------------------===//
+#ifdef _WIN32
+#define JIT_SHADOWSPACE 0x28 // 32 bytes of shadow space + 8 for alignment
+#define JIT_FRAMEPAD    0x20 // shadow space in subroutines
+#else
+#define JIT_SHADOWSPACE 0x08 // alignment only
+#define JIT_FRAMEPAD    0x00
+#endif
+#define JIT_JSRFRAME (32+JIT_FRAMEPAD) // r12, r13, r15, return address and pad
+enum
+{
+  JITLABEL_END=0x1000000, // fixup targets beyond code addresses
+  JITLABEL_ERR
+};
+struct ScvalJitFixup
+{
+  unsigned int offset; // where the rel32 is
+  unsigned int target; // op index or JITLABEL_*
+  unsigned int from;   // offset the rel32 is relative to
+};
+struct ScvalJitEmitter
+{
+  ScvalJitEmitter():m_buf(0), m_size(0), m_cap(0), m_failed(false){}
+  ~ScvalJitEmitter(){ SAFEFREE(m_buf); }
+
+  void Byte( unsigned char b )
+  {
+    if ( m_size >= m_cap )
+    {
+      unsigned int newCap = m_cap ? m_cap*2 : 4096;
+      unsigned char* newBuf = (unsigned char*)realloc( m_buf, newCap );
+      if ( !newBuf ){ m_failed = true; return; }
+      m_buf = newBuf;
+      m_cap = newCap;
+    }
+    m_buf[m_size++] = b;
+  }
+  void Bytes( const char* bytes, int n ){ for ( int i = 0; i < n; ++i ) Byte( (unsigned char)bytes[i] ); }
+  void Imm32( unsigned int v ){ Byte(v&0xff); Byte((v>>8)&0xff); Byte((v>>16)&0xff); Byte((v>>24)&0xff); }
+  void Imm64( unsigned long long v ){ Imm32( (unsigned int)v ); Imm32( (unsigned int)(v>>32) ); }
+  void Rel32( unsigned int target, unsigned int from )
+  {
+    ScvalJitFixup& f = m_fixups.Create();
+    f.offset = m_size;
+    f.target = target;
+    f.from = from;
+    Imm32( 0 );
+  }
+  void Rel32( unsigned int target ){ Rel32( target, m_size+4 ); }
+  enum { ARG_IMM, ARG_EBP, ARG_REG };
+  // helper( vm, a, b ), b is an immediate, ebp or a register of the current frame (r15d+b)
+  void CallHelper( const void* fn, unsigned int a, unsigned int b, int bArg=ARG_IMM )
+  {
+#ifdef _WIN32
+    Bytes( "\x48\x89\xd9", 3 );                  // mov rcx, rbx
+    Byte( 0xba ); Imm32( a );                    // mov edx, a
+    if ( bArg == ARG_EBP ) Bytes( "\x41\x89\xe8", 3 );                    // mov r8d, ebp
+    else if ( bArg == ARG_REG ) { Bytes( "\x45\x8d\x87", 3 ); Imm32( b ); } // lea r8d, [r15+b]
+    else { Bytes( "\x41\xb8", 2 ); Imm32( b ); }                          // mov r8d, b
+#else
+    Bytes( "\x48\x89\xdf", 3 );                  // mov rdi, rbx
+    Byte( 0xbe ); Imm32( a );                    // mov esi, a
+    if ( bArg == ARG_EBP ) Bytes( "\x89\xea", 2 );                         // mov edx, ebp
+    else if ( bArg == ARG_REG ) { Bytes( "\x41\x8d\x97", 3 ); Imm32( b ); } // lea edx, [r15+b]
+    else { Byte( 0xba ); Imm32( b ); }                                      // mov edx, b
+#endif
+    Bytes( "\x48\xb8", 2 ); Imm64( (unsigned long long)(size_t)fn ); // mov rax, fn
+    Bytes( "\xff\xd0", 2 );                      // call rax
+  }
+  void JumpTo( unsigned char cc, unsigned int target ) // cc=0 for unconditional
+  {
+    if ( cc ) { Byte( 0x0f ); Byte( cc ); }
+    else Byte( 0xe9 );
+    Rel32( target );
+  }
+  // as a call, with the shadow space below the return address
+  void CallSub( unsigned int target )
+  {
+    Bytes( "\x48\x8d\x05", 3 );                  // lea rax,[return]
+    const unsigned int retRel = m_size;
+    Imm32( 0 );
+    Byte( 0x50 );                                // push rax
+#if JIT_FRAMEPAD
+    Bytes( "\x48\x83\xec", 3 ); Byte( JIT_FRAMEPAD ); // sub rsp,JIT_FRAMEPAD
+#endif
+    JumpTo( 0, target );
+    const int rel = int(m_size-(retRel+4));
+    if ( !m_failed )
+      memcpy( m_buf+retRel, &rel, 4 );
+  }
+
+  unsigned char* m_buf;
+  unsigned int m_size;
+  unsigned int m_cap;
+  bool m_failed;
+  ScvalStaticDynArray<ScvalJitFixup,256,256> m_fixups;
+};
+typedef int (*ScvalJitEntry)( ScvalVM* vm, unsigned short* counters, ScvalHashID* hashes );
+#endif
+
+//===---------------------------------------------------------------------------===//
+//===---------------------------------------------------------------------------===//
+bool ScvalJitSupported()
+{
+#ifdef SCVAL_JIT_X64
+  return true;
+#else
+  return false;
+#endif
+}
+void ScvalVM::FreeJit()
+{
+#ifdef SCVAL_JIT_X64
+  if ( m_jitCode )
+  {
+#ifdef _WIN32
+    VirtualFree( m_jitCode, 0, MEM_RELEASE );
+#else
+    munmap( m_jitCode, m_jitSize );
+#endif
+  }
+#endif
+  m_jitCode = 0;
+  m_jitSize = 0;
+  m_jitFailed = false;
+}
+// Translates m_code into native code. Every bytecode operation gets its
+// own native block so jumps translate one to one; fused operations are
+// translated as their first operation, the rest of the sequence is after it.
+bool ScvalVM::CompileJit()
+{
+  FreeJit();
+#ifdef SCVAL_JIT_X64
+  const ScvalVMCode* code = m_code;
+  const unsigned int maxPC = code->m_noOperations;
+  unsigned int* opOffsets = (unsigned int*)malloc( sizeof(unsigned int)*(maxPC+1) );
+  if ( !opOffsets )
+    return false;
+  ScvalJitEmitter e;
+
+  // prologue
+  e.Bytes( "\x53\x55\x41\x54\x41\x55\x41\x56\x41\x57", 10 ); // push rbx, rbp, r12-r15
+  e.Bytes( "\x48\x83\xec", 3 ); e.Byte( JIT_SHADOWSPACE );  // sub rsp, JIT_SHADOWSPACE
+#ifdef _WIN32
+  e.Bytes( "\x48\x89\xcb\x49\x89\xd4\x4d\x89\xc5", 9 );     // mov rbx,rcx; mov r12,rdx; mov r13,r8
+#else
+  e.Bytes( "\x48\x89\xfb\x49\x89\xf4\x49\x89\xd5", 9 );     // mov rbx,rdi; mov r12,rsi; mov r13,rdx
+#endif
+  e.Bytes( "\x45\x31\xf6\x31\xed\x45\x31\xff", 8 );         // xor r14d,r14d; xor ebp,ebp; xor r15d,r15d
+  const unsigned int stackOffset = (unsigned int)((char*)&m_jitStack - (char*)this);
+  e.Bytes( "\x48\x89\xa3", 3 ); e.Imm32( stackOffset );      // mov [rbx+m_jitStack],rsp
+
+  for ( unsigned int i = 0; i < maxPC; ++i )
+  {
+    const ScvalVMOperation& operation = code->m_code[i];
+    opOffsets[i] = e.m_size;
+    const unsigned int addr = operation.GetAddr();
+    const unsigned int target = addr==VM_ERRADDR ? (unsigned int)JITLABEL_ERR : ( addr < maxPC ? addr : (unsigned int)JITLABEL_END );
+    switch ( operation.opcode )
+    {
+    case VM_LENJ:
+    case VM_LANJ:
+    case VM_LDEN:
+    case VM_LDEV:
+    case VM_LDAN:
+    case VM_LDAV:
+      {
+        unsigned int opc = operation.opcode;
+        if ( opc == VM_LENJ ) opc = VM_LDEN;
+        else if ( opc == VM_LANJ ) opc = VM_LDAN;
+        const bool raw = operation.op1 == VM_RAWVALUE;
+        e.CallHelper( raw ? (const void*)&ScvalVM::JitLoadRaw : (const void*)&ScvalVM::JitLoad, opc, operation.op0, ScvalJitEmitter::ARG_REG );
+      }break;
+    case VM_CJNI:
+    case VM_CMPS:
+      {
+        unsigned int dataAddr = operation.GetDataAddr();
+        const unsigned int op2 = dataAddr==VM_NILDATA ? 0 : code->m_constData[dataAddr];
+        e.Bytes( "\x45\x8b\xb5", 3 ); e.Imm32( operation.op0*sizeof(ScvalHashID) );        // mov r14d,[r13+reg]
+        e.Bytes( "\x41\x81\xee", 3 ); e.Imm32( op2 );                                       // sub r14d,op2
+      }break;
+    case VM_CMPI:
+      e.Bytes( "\x45\x0f\xb7\xb4\x24", 5 ); e.Imm32( operation.op0*sizeof(unsigned short) ); // movzx r14d,word [r12+reg]
+      e.Bytes( "\x41\x81\xee", 3 ); e.Imm32( operation.op1 );                                // sub r14d,op1
+      e.Bytes( "\x66\x41\xc7\x84\x24", 5 ); e.Imm32( operation.op0*sizeof(unsigned short) ); // mov word [r12+reg],0
+      e.Byte( 0 ); e.Byte( 0 );
+      break;
+    case VM_JE : e.Bytes( "\x45\x85\xf6", 3 ); e.JumpTo( 0x84, target ); break; // test r14d,r14d; je
+    case VM_JNE: e.Bytes( "\x45\x85\xf6", 3 ); e.JumpTo( 0x85, target ); break; // test r14d,r14d; jne
+    case VM_JG : e.Bytes( "\x45\x85\xf6", 3 ); e.JumpTo( 0x8f, target ); break; // test r14d,r14d; jg
+    case VM_JMP: e.JumpTo( 0, target ); break;
+    case VM_CLR: break;
+    case VM_INC:
+      e.Bytes( "\x66\x41\xff\x84\x24", 5 ); e.Imm32( operation.op0*sizeof(unsigned short) ); // inc word [r12+reg]
+      break;
+    case VM_CHKN:
+      if ( operation.op1 == 1 ) // str, nothing to check
+        break;
+      e.CallHelper( (const void*)&ScvalVM::JitCheckNative, operation.op1, operation.op0, ScvalJitEmitter::ARG_REG );
+      e.Bytes( "\x85\xc0", 2 ); e.JumpTo( 0x84, JITLABEL_ERR );                            // test eax,eax; je err
+      break;
+    case VM_CHKC:
+      {
+        const unsigned int subAddr = operation.GetDataAddr();
+        e.Bytes( "\x41\x8d\xaf", 3 ); e.Imm32( operation.op0 );                             // lea ebp,[r15+reg]
+        e.Bytes( "\x48\x83\xec\x08", 4 );                                                   // sub rsp,8
+        e.CallSub( subAddr < maxPC ? subAddr : (unsigned int)JITLABEL_END );
+        e.Bytes( "\x48\x83\xc4\x08", 4 );                                                   // add rsp,8
+      }break;
+    case VM_JSR:
+      {
+        const unsigned int subAddr = operation.GetDataAddr();
+        e.Bytes( "\x48\x8b\x83", 3 ); e.Imm32( stackOffset );                               // mov rax,[rbx+m_jitStack]
+        e.Bytes( "\x48\x29\xe0", 3 );                                                      // sub rax,rsp
+        e.Bytes( "\x48\x3d", 2 ); e.Imm32( SCVAL_MAX_CALL_DEPTH*JIT_JSRFRAME );              // cmp rax,max depth
+        e.JumpTo( 0x83, JITLABEL_ERR );                                                     // jae err
+        e.Bytes( "\x41\x54\x41\x55\x41\x57", 6 );                                           // push r12; push r13; push r15
+        e.Bytes( "\x49\x81\xc4", 3 ); e.Imm32( operation.op0*sizeof(unsigned short) );      // add r12,base*2
+        e.Bytes( "\x49\x81\xc5", 3 ); e.Imm32( operation.op0*sizeof(ScvalHashID) );         // add r13,base*4
+        e.Bytes( "\x41\x81\xc7", 3 ); e.Imm32( operation.op0 );                             // add r15d,base
+        e.CallSub( subAddr < maxPC ? subAddr : (unsigned int)JITLABEL_END );
+        e.Bytes( "\x41\x5f\x41\x5d\x41\x5c", 6 );                                           // pop r15; pop r13; pop r12
+      }break;
+    case VM_DOWN:
+    case VM_UP  :
+    case VM_GATT:
+    case VM_NATT:
+    case VM_NEXT:
+      e.CallHelper( (const void*)&ScvalVM::JitNavigate, operation.opcode, 0 );
+      break;
+    case VM_RET:
+#if JIT_FRAMEPAD
+      e.Bytes( "\x48\x83\xc4", 3 ); e.Byte( JIT_FRAMEPAD );                                // add rsp,JIT_FRAMEPAD
+#endif
+      e.Byte( 0xc3 );                                                                       // ret
+      break;
+    case VM_CALL:
+      e.CallHelper( (const void*)&ScvalVM::JitCallback, operation.GetDataAddr(), 0, ScvalJitEmitter::ARG_EBP );
+      e.Bytes( "\x41\x89\xc6", 3 );                                                         // mov r14d,eax
+      break;
+    case VM_SWITCH: // probes the table as ScvalSwitchTarget, then jumps through a table of rel32 per slot
+      {
+        const ScvalHashID* table = code->m_constData+operation.GetDataAddr();
+        e.Bytes( "\x41\x8b\x85", 3 ); e.Imm32( operation.op0*sizeof(ScvalHashID) );        // mov eax,[r13+reg]
+        e.Bytes( "\x48\xb9", 2 ); e.Imm64( (unsigned long long)(size_t)table );             // mov rcx,table
+        e.Bytes( "\x89\xc2", 2 );                                                           // mov edx,eax
+        e.Bytes( "\x81\xe2", 2 ); e.Imm32( table[0] );                                      // and edx,mask
+        e.Bytes( "\x44\x8b\x44\xd1\x04", 5 );                                               // probe: mov r8d,[rcx+rdx*8+4]
+        e.Bytes( "\x41\x39\xc0\x74\x0f", 5 );                                               // cmp r8d,eax; je found
+        e.Bytes( "\x45\x85\xc0\x74\x0a", 5 );                                               // test r8d,r8d; je found
+        e.Bytes( "\xff\xc2", 2 );                                                           // inc edx
+        e.Bytes( "\x81\xe2", 2 ); e.Imm32( table[0] );                                      // and edx,mask
+        e.Bytes( "\xeb\xe7", 2 );                                                           // jmp probe
+        e.Bytes( "\x48\x8d\x05\x09\x00\x00\x00", 7 );                                       // found: lea rax,[jump table]
+        e.Bytes( "\x48\x63\x14\x90", 4 );                                                   // movsxd rdx,[rax+rdx*4]
+        e.Bytes( "\x48\x01\xd0\xff\xe0", 5 );                                               // add rax,rdx; jmp rax
+        const unsigned int jumpTable = e.m_size;
+        for ( unsigned int j = 0; j <= table[0]; ++j )
+        {
+          const unsigned int addr = table[2+j*2];
+          e.Rel32( addr==VM_ERRADDR ? (unsigned int)JITLABEL_ERR : ( addr < maxPC ? addr : (unsigned int)JITLABEL_END ), jumpTable );
+        }
+      }break;
+    default: // unknown operation, fails as the interpreter
+      e.JumpTo( 0, JITLABEL_ERR );
+      break;
+    }
+  }
+  // epilogue
+  const unsigned int endOffset = e.m_size;
+  opOffsets[maxPC] = endOffset;
+  e.Bytes( "\xb8\x01\x00\x00\x00", 5 );                    // mov eax,1
+  e.Bytes( "\xeb\x02", 2 );                                // jmp exit
+  const unsigned int errOffset = e.m_size;
+  e.Bytes( "\x31\xc0", 2 );                                // xor eax,eax
+  e.Bytes( "\x48\x8b\xa3", 3 ); e.Imm32( stackOffset );     // exit: mov rsp,[rbx+m_jitStack]
+  e.Bytes( "\x48\x83\xc4", 3 ); e.Byte( JIT_SHADOWSPACE ); // add rsp, JIT_SHADOWSPACE
+  e.Bytes( "\x41\x5f\x41\x5e\x41\x5d\x41\x5c\x5d\x5b", 10 ); // pop r15-r12, rbp, rbx
+  e.Byte( 0xc3 );                                          // ret
+
+  // resolving jumps
+  for ( unsigned int i = 0; i < e.m_fixups.GetSize() && !e.m_failed; ++i )
+  {
+    const ScvalJitFixup& f = e.m_fixups.Get(i);
+    unsigned int dest = f.target==JITLABEL_END ? endOffset : ( f.target==JITLABEL_ERR ? errOffset : opOffsets[f.target] );
+    const int rel = int(dest) - int(f.from);
+    memcpy( e.m_buf+f.offset, &rel, 4 );
+  }
+  SAFEFREE(opOffsets);
+  if ( e.m_failed )
+    return false;
+
+  // executable copy
+#ifdef _WIN32
+  void* mem = VirtualAlloc( 0, e.m_size, MEM_COMMIT|MEM_RESERVE, PAGE_READWRITE );
+  if ( !mem )
+    return false;
+  memcpy( mem, e.m_buf, e.m_size );
+  DWORD oldProtect;
+  if ( !VirtualProtect( mem, e.m_size, PAGE_EXECUTE_READ, &oldProtect ) )
+  {
+    VirtualFree( mem, 0, MEM_RELEASE );
+    return false;
+  }
+  FlushInstructionCache( GetCurrentProcess(), mem, e.m_size );
+#else
+  void* mem = mmap( 0, e.m_size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0 );
+  if ( mem == MAP_FAILED )
+    return false;
+  memcpy( mem, e.m_buf, e.m_size );
+  if ( mprotect( mem, e.m_size, PROT_READ|PROT_EXEC ) != 0 )
+  {
+    munmap( mem, e.m_size );
+    return false;
+  }
+#endif
+  m_jitCode = mem;
+  m_jitSize = e.m_size;
+  return true;
+#else
+  return false;
+#endif
+}
+// Runs the native code for the bound bytecode, translating it the first time.
+// When there's no JIT in this host or the translation fails, interprets it.
+bool ScvalVM::RunJit( ScvalInstHook* hook )
+{
+  if ( !m_jitCode && !m_jitFailed )
+    m_jitFailed = !CompileJit();
+  if ( !m_jitCode )
+    return RunSwitch( hook );
+#ifdef SCVAL_JIT_X64
+  m_pc = 0; // native code doesn't count operations
+  m_jitHook = hook;
+  const bool result = ((ScvalJitEntry)m_jitCode)( this, m_mainCtx.m_regCounters, m_mainCtx.m_regStrHashes ) != 0;
+  m_jitHook = 0;
+  if ( !result )
+    m_pc = VM_ERRADDR;
+  return result;
+#else
+  return false;
+#endif
+}
+
+#undef JIT_JSRFRAME
+#undef JIT_FRAMEPAD
+#undef JIT_SHADOWSPACE
+#undef SAFEFREE
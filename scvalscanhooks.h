@@ -0,0 +1,530 @@
+#ifndef _SCVALSCANHOOKS_H_
+#define _SCVALSCANHOOKS_H_
+#include "scvaltypes.h"
+#include "tinyxml2/tinyxml2.h"
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SCVAL_SCAN_SSE2
+#include <emmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+// Reads the XML text in place for the validator, without building the
+// DOM nor copying the text. The hook only keeps where the current
+// element of every level is (its name and content in the text), and
+// the names of the elements open while skipping a subtree: nothing is
+// allocated once its buffers have grown to the depth of the documents.
+// Names and values are spans of the text, not zero terminated, copied
+// by the VM; the values with entities or carriage returns are
+// processed as TinyXML does, in a buffer of the hook. The rest of the
+// text is not processed: the elements the validator doesn't go down
+// into are only checked to be well formed, with the rules of TinyXML,
+// and Finish checks what the validator left. Both hooks accept the
+// same documents and read the same strings.
+// The text is searched 16 bytes at a time (SSE2) for the delimiters.
+class ScvalScanHooks : public ScvalInstHookT<ScvalScanHooks>
+{
+public:
+  ScvalScanHooks() : m_text(0), m_end(0), m_depth(0), m_attr(0), m_error(true)
+  {
+    m_levels.reserve( 16 );
+    m_open.reserve( 16 );
+    // the classes of TinyXML, looked up by char
+    for ( int c = 0; c < 256; ++c )
+      m_chars[c] = (tinyxml2::XMLUtil::IsWhiteSpace( (char)c ) ? CHAR_SPACE : 0) |
+                   (tinyxml2::XMLUtil::IsNameStartChar( (unsigned char)c ) ? CHAR_NAMESTART : 0) |
+                   (tinyxml2::XMLUtil::IsNameChar( (unsigned char)c ) ? CHAR_NAME : 0);
+  }
+  // From memory, not copied: the text must outlive the validation
+  bool Parse( const char* xmltext, size_t len=(size_t)-1 )
+  {
+    if ( !xmltext )
+      return Begin( 0, 0 );
+    return Begin( xmltext, len == (size_t)-1 ? strlen(xmltext) : len );
+  }
+  // Reads the file in a buffer of the hook, reused by the next ones
+  bool LoadFile( const char* xmlfile )
+  {
+    FILE* file = fopen( xmlfile, "rb" );
+    size_t size = 0;
+    if ( file && fseek( file, 0, SEEK_END ) == 0 )
+    {
+      const long end = ftell( file );
+      size = end > 0 ? (size_t)end : 0;
+      if ( size > m_buffer.size() )
+        m_buffer.resize( size );
+      fseek( file, 0, SEEK_SET );
+      size = size && fread( &m_buffer[0], 1, size, file ) == size ? size : 0;
+    }
+    if ( file )
+      fclose( file );
+    return Begin( size ? &m_buffer[0] : 0, size );
+  }
+  // Checks the rest of the document after the validation, false when
+  // it is not well formed
+  bool Finish()
+  {
+    if ( !m_error && !m_levels.empty() && m_levels[0].present )
+    {
+      // the root and the elements following it, as TinyXML
+      Level level = m_levels[0];
+      const char* p = Skip( level );
+      while ( p && ReadChild( 0, level, p ) )
+        p = Skip( level );
+    }
+    return !m_error;
+  }
+  // The document is not well formed (or couldn't be read)
+  bool Error()const{ return m_error; }
+  // the strings are spans of the text, or overwritten by the next value
+  virtual bool StableStrings(){ return false; }
+
+  void ElementName( ScvalHookString& out )
+  {
+    const Level& level = m_levels[m_depth];
+    if ( level.present )
+      out.Set( level.name, level.nameLen, tinyxml2::XMLUtil::HashName( level.name, level.nameLen ) );
+    else
+      out.Set( 0 );
+  }
+  // the first child when it's text or CDATA, as XMLElement::GetText
+  void ElementValue( ScvalHookString& out ){ Text( out, false ); }
+  void AttributeName( ScvalHookString& out )
+  {
+    if ( m_attr )
+    {
+      const unsigned int len = (unsigned int)(SkipName( m_attr )-m_attr);
+      out.Set( m_attr, len, tinyxml2::XMLUtil::HashName( m_attr, len ) );
+    }
+    else
+      out.Set( 0 );
+  }
+  void AttributeValue( ScvalHookString& out ){ AttributeText( out, tinyxml2::StrPair::ATTRIBUTE_VALUE ); }
+  // the str values are not inspected by the VM, the spans are handed over
+  // as they are, even with entities
+  void ElementRawValue( ScvalHookString& out ){ Text( out, true ); }
+  void AttributeRawValue( ScvalHookString& out ){ AttributeText( out, 0 ); }
+  // the first child of the current element
+  void Down()
+  {
+    const unsigned int parent = m_depth;
+    if ( ++m_depth == m_levels.size() )
+      m_levels.push_back( Level() );
+    Level& level = m_levels[m_depth];
+    level.present = false;
+    if ( m_levels[parent].present && !m_levels[parent].empty && !m_error )
+      ReadChild( &m_levels[parent], level, m_levels[parent].content );
+  }
+  // the parent skips the children already read
+  void Up()
+  {
+    if ( !m_depth )
+      return;
+    const Level& child = m_levels[m_depth--];
+    if ( child.present && child.end )
+      m_levels[m_depth].scan = child.end;
+  }
+  // the start tags are well formed, the attributes are read again from the name
+  void FirstAttribute()
+  {
+    const Level& level = m_levels[m_depth];
+    m_attr = level.present ? AttributeAt( SkipName( level.name ) ) : 0;
+  }
+  void NextAttribute()
+  {
+    const char* value = m_attr ? AttributeValue( m_attr ) : 0;
+    m_attr = value ? AttributeAt( Find( value+1, *value )+1 ) : 0;
+  }
+  void NextElement()
+  {
+    Level& level = m_levels[m_depth];
+    if ( !level.present )
+      return;
+    const char* p = Skip( level );
+    if ( p )
+      ReadChild( m_depth ? &m_levels[m_depth-1] : 0, level, p );
+    else
+      level.present = false;
+  }
+  // the custom types are checked by the checks registered in the validator
+  virtual bool Checks(){ return false; }
+  // offset of the element name in the text (of its element for an attribute)
+  virtual void* Position( ScvalVMOpcode /*opcode*/ )
+  {
+    const Level& level = m_levels[m_depth];
+    return level.present ? (void*)(size_t)(level.name-m_text) : 0;
+  }
+  // deepest element read, the levels kept in memory
+  size_t MaxDepth()const{ return m_levels.size(); }
+
+protected:
+  enum { NODE_START, NODE_END, NODE_EOF, NODE_ERROR, NODE_SKIPPED };
+  enum { CHAR_SPACE=1, CHAR_NAMESTART=2, CHAR_NAME=4 };
+  // an element of a level, where it is in the text
+  struct Level
+  {
+    Level():name(0), nameLen(0), content(0), scan(0), end(0), empty(false), present(false){}
+    const char* name;
+    unsigned int nameLen;
+    const char* content;  // after the start tag
+    const char* scan;     // in the content, the children before it are well formed
+    const char* end;      // after the end tag, 0 until it is found
+    bool empty;           // closed by />
+    bool present;         // there is an element, false at the end of the siblings
+  };
+  struct Name
+  {
+    Name( const char* s=0, unsigned int l=0 ):str(s), len(l){}
+    const char* str;
+    unsigned int len;
+  };
+  // a tag read by ReadNode
+  struct Tag
+  {
+    const char* start;    // the <
+    Name name;
+    bool empty;
+  };
+
+  bool Begin( const char* text, size_t len )
+  {
+    m_text = text;
+    m_end = text ? text+len : 0;
+    m_depth = 0;
+    m_attr = 0;
+    m_error = !text;
+    if ( m_levels.empty() )
+      m_levels.push_back( Level() );
+    m_levels[0].present = false;
+    if ( m_error )
+      return false;
+    // white space and BOM before the root, as TinyXML
+    const char* p = SkipWhiteSpace( m_text );
+    if ( m_end-p >= 3 && (unsigned char)p[0] == 0xef && (unsigned char)p[1] == 0xbb && (unsigned char)p[2] == 0xbf )
+      p += 3;
+    m_error = p == m_end;  // an empty document
+    return !m_error && ReadChild( 0, m_levels[0], p );
+  }
+  int Fail(){ m_error = true; return NODE_ERROR; }
+
+  // The first of the chars a, b or c from p, or end
+  static const char* Find( const char* p, const char* end, char a, char b, char c )
+  {
+#ifdef SCVAL_SCAN_SSE2
+    const __m128i va = _mm_set1_epi8( a ), vb = _mm_set1_epi8( b ), vc = _mm_set1_epi8( c );
+    for ( ; end-p >= 16; p += 16 )
+    {
+      const __m128i v = _mm_loadu_si128( (const __m128i*)p );
+      const int mask = _mm_movemask_epi8( _mm_or_si128( _mm_or_si128( _mm_cmpeq_epi8( v, va ),
+                                                                       _mm_cmpeq_epi8( v, vb ) ),
+                                                        _mm_cmpeq_epi8( v, vc ) ) );
+      if ( mask )
+      {
+#ifdef _MSC_VER
+        unsigned long first;
+        _BitScanForward( &first, (unsigned long)mask );
+        return p+first;
+#else
+        return p+__builtin_ctz( (unsigned int)mask );
+#endif
+      }
+    }
+#endif
+    for ( ; p < end; ++p )
+      if ( *p == a || *p == b || *p == c )
+        return p;
+    return end;
+  }
+  const char* Find( const char* p, char c )const{ return Find( p, m_end, c, c, c ); }
+  // the end mark from p, or the end of the text
+  const char* FindMark( const char* p, const char* mark, size_t len )const
+  {
+    for ( ; (p = Find( p, *mark )) != m_end; ++p )
+      if ( Match( p, mark, len ) )
+        return p;
+    return m_end;
+  }
+  // after the end mark, 0 when the text ends before
+  const char* Past( const char* p, const char* mark, size_t len )const
+  {
+    p = FindMark( p, mark, len );
+    return p == m_end ? 0 : p+len;
+  }
+  bool Match( const char* p, const char* str, size_t len )const
+  {
+    return (size_t)(m_end-p) >= len && memcmp( p, str, len ) == 0;
+  }
+  bool Is( char c, int type )const{ return (m_chars[(unsigned char)c] & type) != 0; }
+  const char* SkipWhiteSpace( const char* p )const
+  {
+    while ( p < m_end && Is( *p, CHAR_SPACE ) )
+      ++p;
+    return p;
+  }
+  // after the name at p, p when there's no name
+  const char* SkipName( const char* p )const
+  {
+    if ( p == m_end || !Is( *p, CHAR_NAMESTART ) )
+      return p;
+    while ( ++p < m_end && Is( *p, CHAR_NAME ) )
+    {}
+    return p;
+  }
+  // the attribute after white space at p, 0 at the end of the tag
+  const char* AttributeAt( const char* p )const
+  {
+    p = SkipWhiteSpace( p );
+    return p < m_end && Is( *p, CHAR_NAMESTART ) ? p : 0;
+  }
+  // the opening quote of the value of the attribute at p, 0 when badly formed
+  const char* AttributeValue( const char* p )const
+  {
+    p = SkipWhiteSpace( SkipName( p ) );
+    if ( p == m_end || *p != '=' )
+      return 0;
+    p = SkipWhiteSpace( p+1 );
+    return p < m_end && (*p == '\"' || *p == '\'') ? p : 0;
+  }
+  // the text of the current element, processed as TinyXML unless raw
+  void Text( ScvalHookString& out, bool raw )
+  {
+    const Level& level = m_levels[m_depth];
+    out.Set( 0 );
+    if ( !level.present || level.empty )
+      return;
+    const char* p = SkipWhiteSpace( level.content );
+    if ( p == m_end )
+      return;
+    if ( *p != '<' )
+    {
+      const char* end = Find( p, '<' );
+      if ( end != m_end )
+        Value( level.content, end, raw ? 0 : tinyxml2::StrPair::TEXT_ELEMENT, out );
+    }
+    else if ( Match( p, "<![CDATA[", 9 ) )
+    {
+      const char* end = FindMark( p+9, "]]>", 3 );
+      if ( end != m_end )
+        Value( p+9, end, raw ? 0 : tinyxml2::StrPair::NEEDS_NEWLINE_NORMALIZATION, out );
+    }
+  }
+  void AttributeText( ScvalHookString& out, int flags )
+  {
+    const char* value;
+    if ( m_attr && (value = AttributeValue( m_attr )) != 0 )
+      Value( value+1, Find( value+1, *value ), flags, out );
+    else
+      out.Set( 0 );
+  }
+  // A value from start to end, processed by TinyXML when it has entities
+  // or carriage returns. Otherwise (or without flags) it's the span of the text.
+  void Value( const char* start, const char* end, int flags, ScvalHookString& out )
+  {
+    const bool entities = (flags & tinyxml2::StrPair::NEEDS_ENTITY_PROCESSING) != 0;
+    if ( !flags || Find( start, end, '\r', entities ? '&' : '\r', '\r' ) == end )
+    {
+      out.Set( start, (unsigned int)(end-start) );
+      return;
+    }
+    m_value.assign( start, end );
+    m_value.push_back( 0 );
+    size_t len = 0;
+    tinyxml2::StrPair str;
+    str.Set( &m_value[0], &m_value[0]+(end-start), flags );
+    str.GetStr( &len );
+    out.Set( &m_value[0], (unsigned int)len );
+  }
+
+  // The next node from p, moving p after it. Start and end tags fill the
+  // tag; comments, declarations, text and CDATA are skipped.
+  int ReadNode( const char*& p, Tag& tag )
+  {
+    const char* q = SkipWhiteSpace( p );
+    if ( q == m_end )
+    {
+      p = q;
+      return NODE_EOF;
+    }
+    if ( *q != '<' )
+    {
+      // text ends at a tag
+      q = Find( q, '<' );
+      if ( q == m_end )
+        return Fail();
+      p = q;
+      return NODE_SKIPPED;
+    }
+    if ( Match( q, "<?", 2 ) )
+      q = Past( q+2, "?>", 2 );
+    else if ( Match( q, "<!--", 4 ) )
+      q = Past( q+4, "-->", 3 );
+    else if ( Match( q, "<![CDATA[", 9 ) )
+      q = Past( q+9, "]]>", 3 );
+    else if ( Match( q, "<!", 2 ) )
+      q = Past( q+2, ">", 1 );
+    else
+      return ReadTag( p, tag );
+    if ( !q )
+      return Fail();
+    p = q;
+    return NODE_SKIPPED;
+  }
+  // A start or end tag at p. As TinyXML, the attributes are read in both,
+  // and an end tag closed by /> is an empty element.
+  int ReadTag( const char*& p, Tag& tag )
+  {
+    tag.start = SkipWhiteSpace( p );
+    const char* q = SkipWhiteSpace( tag.start+1 );
+    const bool closing = q < m_end && *q == '/';
+    if ( closing )
+      ++q;
+    tag.name.str = q;
+    q = SkipName( q );
+    tag.name.len = (unsigned int)(q-tag.name.str);
+    if ( !tag.name.len )
+      return Fail();
+    m_attrs.clear();
+    for (;;)
+    {
+      q = SkipWhiteSpace( q );
+      if ( q == m_end )
+        return Fail();
+      if ( Is( *q, CHAR_NAMESTART ) )
+      {
+        const Name name( q, (unsigned int)(SkipName( q )-q) );
+        // the attributes can't be repeated
+        for ( size_t i = 0; i < m_attrs.size(); ++i )
+          if ( m_attrs[i].len == name.len && memcmp( m_attrs[i].str, name.str, name.len ) == 0 )
+            return Fail();
+        m_attrs.push_back( name );
+        const char* value = AttributeValue( q );
+        if ( !value )
+          return Fail();
+        q = Find( value+1, *value );
+        if ( q == m_end )
+          return Fail();
+        ++q;
+      }
+      else if ( Match( q, "/>", 2 ) )
+      {
+        p = q+2;
+        tag.empty = true;
+        return NODE_START;
+      }
+      else if ( *q == '>' )
+      {
+        p = q+1;
+        tag.empty = false;
+        return closing ? NODE_END : NODE_START;
+      }
+      else
+        return Fail();
+    }
+  }
+  // The next element among the children of the parent (the document when
+  // 0) from p, false at the end of them. The end tag has to close the
+  // parent; at the document level TinyXML stops reading there.
+  bool ReadChild( Level* parent, Level& level, const char* p )
+  {
+    Tag tag;
+    level.present = false;
+    for (;;)
+    {
+      switch ( ReadNode( p, tag ) )
+      {
+      case NODE_SKIPPED:
+        continue;
+      case NODE_START:
+        level.name = tag.name.str;
+        level.nameLen = tag.name.len;
+        level.content = level.scan = p;
+        level.end = tag.empty ? p : 0;
+        level.empty = tag.empty;
+        level.present = true;
+        if ( parent )
+          parent->scan = tag.start;
+        return true;
+      case NODE_END:
+        if ( parent )
+        {
+          if ( !SameName( tag.name, Name( parent->name, parent->nameLen ) ) )
+            Fail();
+          parent->scan = tag.start;
+          parent->end = p;
+        }
+        return false;
+      case NODE_EOF:
+        if ( parent )
+          Fail();  // not closed
+        return false;
+      default:
+        return false;
+      }
+    }
+  }
+  // After the end of the element, checking the rest of it from where
+  // its children were read. 0 when it is not well formed.
+  const char* Skip( Level& level )
+  {
+    if ( level.end )
+      return level.end;
+    m_open.clear();
+    const char* p = level.scan;
+    Tag tag;
+    for (;;)
+    {
+      switch ( ReadNode( p, tag ) )
+      {
+      case NODE_SKIPPED:
+        break;
+      case NODE_START:
+        if ( !tag.empty )
+          m_open.push_back( tag.name );
+        break;
+      case NODE_END:
+        if ( m_open.empty() )
+        {
+          if ( !SameName( tag.name, Name( level.name, level.nameLen ) ) )
+          {
+            Fail();
+            return 0;
+          }
+          level.scan = tag.start;
+          return level.end = p;
+        }
+        if ( !SameName( tag.name, m_open.back() ) )
+        {
+          Fail();
+          return 0;
+        }
+        m_open.pop_back();
+        break;
+      case NODE_EOF:
+        Fail();  // not closed
+        return 0;
+      default:
+        return 0;
+      }
+    }
+  }
+  static bool SameName( const Name& a, const Name& b ){ return a.len == b.len && memcmp( a.str, b.str, a.len ) == 0; }
+
+protected:
+  const char* m_text;
+  const char* m_end;
+  std::vector<char> m_buffer;    // read from the file
+  std::vector<Level> m_levels;   // current element by depth
+  std::vector<Name> m_open;      // elements open while skipping
+  std::vector<Name> m_attrs;     // of the tag being read
+  std::vector<char> m_value;     // processed value
+  unsigned int m_depth;          // level of the validator
+  const char* m_attr;            // current attribute of the current element, its name
+  bool m_error;
+  unsigned char m_chars[256];    // CHAR_ classes
+};
+
+#endif
@@ -1,5 +1,6 @@
 #ifndef _SCVALTYPES_H_
 #define _SCVALTYPES_H_
+#include <stddef.h>
 //===---------------------------------------------------------===//
 // Static and dynamic arrays. Remains in stack memory when no
 // elements further the STATIC_ELEMENTS threshold are needed
@@ -231,7 +232,7 @@ public:
   ScvalASTNode& GetNode( ScvalHandle hNode );
   ScvalASTLeaf& GetLeaf( ScvalHandle hLeaf );
   bool IsEmpty(){ return m_nodes.GetSize()==0 && m_leaves.GetSize() == 0; }  
-  bool GenerateCode(ScvalVMCode& code);
+  bool GenerateCode(ScvalVMCode& code, unsigned int flags);
 private:
   ScvalHandle AddNode( ScvalASTNodeType type );
   ScvalHandle AddLeaf( const char* idname, unsigned short idlen );  
@@ -239,10 +240,13 @@ private:
 
   bool GenCodeChildrenElements( ScvalASTGenCodeData& code, const ScvalASTNode& node, int rbc, int rbs );
   bool GenCodeChildrenAttributes( ScvalASTGenCodeData& code, const ScvalASTNode& node, int rbc, int rbs );
-  bool GenCodeChildElement( ScvalASTGenCodeData& code, const ScvalASTNode& node, int rbc, int rbs );
+  bool GenCodeChildElement( ScvalASTGenCodeData& code, const ScvalASTNode& node, int rbc, int rbcInner, int rbs );
+  bool GenCodeElementBody( ScvalASTGenCodeData& code, ScvalHandle hFirst, int rbc, int rbs );
   bool GenCodeChildAttribute( ScvalASTGenCodeData& code, const ScvalASTNode& node, int rbc, int rbs );
   bool GenCodeCheckType( ScvalASTGenCodeData& code, const ScvalASTNode& node, int rbs );
   bool GenCodeCountersComparison( ScvalASTGenCodeData& code, const ScvalASTNode& node, int rbc );
+  unsigned int CountAlternatives( const ScvalASTNode& node );
+  bool IsElementType( ScvalHandle hLeaf );
 private:
   friend class ScvalParser;
   ScvalStaticDynArray<ScvalASTNode,320,64>  m_nodes;
@@ -259,16 +263,99 @@ enum ScvalVMOpcode
   VM_LDAN, VM_LDAV,             // LoaD Attribute Name, LoaD Attribute Value
   VM_CMPS, VM_CMPI,             // CoMPare String, CoMPare Integer
   VM_JE, VM_JNE, VM_JG, VM_JMP, // Jump instructions
-  VM_CLR, VM_INC,               // CLeaR integer register, INCrement integer register
+  VM_CLR, VM_INC,               // CLeaR integer registers (see ScvalVMRecords), INCrement integer register
   VM_CHKN, VM_CHKC,             // CHeK Native type, CHeK Custom type
   VM_DOWN, VM_UP,               // go DOWN the xml tree, go UP the xml tree
   VM_GATT, VM_NATT,             // Go to ATTributes, Next ATTribute
   VM_NEXT, VM_RET,              // NEXT element, RETurn from subroutine
   VM_CALL,                      // CALLback
+  // Superinstructions. The fused sequence stays in the code after the
+  // head, so its operations are the operands of the fused one.
+  VM_LENJ,                      // LDEN r; CMPS r,nil; JE addr
+  VM_LANJ,                      // LDAN r; CMPS r,nil; JE addr
+  VM_CJNI,                      // CMPS r,data; JNE addr; INC c
+  VM_SWITCH,                    // jumps through the hash table at data addr, by the hash in r
+  VM_JSR,                       // Jump to SubRoutine at data addr, its register frame starts at r
+  VM_NOOPCODES,
 
+  VM_RAWVALUE=1,                // op1 of VM_LDEV/VM_LDAV: the value isn't inspected, raw text is enough
   VM_NILDATA=0xffff,            // Represents a NULL for data segment comparisons
   VM_ERRADDR=0xffffff           // Represents the error address to jump when we find an error
 };
+//===---------------------------------------------------------===//
+// Switch tables live in the data segment: the mask (size-1) followed
+// by size pairs of (hash, address), open addressing with linear
+// probing. Empty slots have hash 0 and the address of the miss; nil
+// names never reach a switch.
+//===---------------------------------------------------------===//
+inline unsigned int ScvalSwitchTarget( const ScvalHashID* table, ScvalHashID hash )
+{
+  const unsigned int mask = table[0];
+  unsigned int slot = hash & mask;
+  while ( table[1+slot*2] != hash && table[1+slot*2] != 0 )
+    slot = (slot+1) & mask;
+  return table[2+slot*2];
+}
+// Max nesting of element type subroutines (VM_JSR) in a document, deeper is an error
+#ifndef SCVAL_MAX_CALL_DEPTH
+#define SCVAL_MAX_CALL_DEPTH 64
+#endif
+
+//===---------------------------------------------------------===//
+// A string register. It's a view (pointer and length) to the string
+// returned by the hook, always zero terminated. It points to the
+// hook storage when it's stable, or to the register own buffer when
+// the hook storage is temporary.
+//===---------------------------------------------------------===//
+struct ScvalVMString
+{
+  const char* str;
+  unsigned int len;
+};
+
+//===---------------------------------------------------------===//
+// A string loaded by the hook (see ScvalInstHook::Load). Besides the
+// pointer, zero terminated, the hook hands over what it already knows
+// from parsing: the length when sized is true, and the hash (as
+// ScvalHash) when hashed is true, so the VM doesn't scan the string
+// again. A supplied hash needs the length too. The strings of a hook
+// which are not stable (copied by the VM) don't need the terminator
+// when they are sized: they can point into the text of the document.
+//===---------------------------------------------------------===//
+struct ScvalHookString
+{
+  ScvalHookString():str(0), len(0), hash(0), sized(false), hashed(false){}
+  void Set( const char* s ){ str = s; sized = hashed = false; }
+  void Set( const char* s, unsigned int l ){ str = s; len = l; sized = true; hashed = false; }
+  void Set( const char* s, unsigned int l, ScvalHashID h ){ str = s; len = l; hash = h; sized = hashed = true; }
+  const char* str;
+  unsigned int len;
+  ScvalHashID hash;
+  bool sized;
+  bool hashed;
+};
+
+//===---------------------------------------------------------===//
+// A child element or an attribute returned by a batched enumeration
+// (see ScvalInstHook::Enumerate): its name and value, and the hook
+// handle to continue after it, or to move back to it (see Select).
+//===---------------------------------------------------------===//
+struct ScvalHookItem
+{
+  ScvalHookString name;
+  ScvalHookString value;
+  void* node;
+};
+
+//===---------------------------------------------------------===//
+// A frame of the call stack, pushed by VM_JSR and VM_CHKC and
+// popped by VM_RET. The registers of the frame start at base.
+//===---------------------------------------------------------===//
+struct ScvalVMFrame
+{
+  unsigned int retPc;
+  unsigned int base;
+};
 
 //===---------------------------------------------------------===//
 // A context for the VM contains the:
@@ -279,16 +366,30 @@ enum ScvalVMOpcode
 struct ScvalVMContext
 {
   ScvalVMContext():m_regCounters(0),m_regStrHashes(0)
-    ,m_regStrings(0),m_cmpRes(0),m_stringCount(0), m_checkStrReg(0){}
+    ,m_regStrings(0),m_regBuffers(0),m_regBufferCaps(0),m_frames(0),m_cmpRes(0)
+    ,m_counterCount(0),m_stringCount(0),m_frameCount(0), m_checkStrReg(0), m_base(0), m_sp(0), m_stableStrings(false){}
 
   void Clear();
-  void Init( int regC, int regS );
+  bool Init( int regC, int regS, int noFrames );
+  // the register file and call stack needed by the code
+  bool Init( const ScvalVMCode& code );
+  void Reset();
+  ScvalHashID LoadString( int reg, const ScvalHookString& hstr );
+  ScvalHashID LoadRaw( int reg, const ScvalHookString& hstr );
   unsigned short* m_regCounters;
   ScvalHashID* m_regStrHashes;
-  const char** m_regStrings;
+  ScvalVMString* m_regStrings;
+  char** m_regBuffers;           // copies of temporary hook strings, reused between loads
+  unsigned int* m_regBufferCaps;
+  ScvalVMFrame* m_frames;        // call stack
   int m_cmpRes;
+  int m_counterCount;
   int m_stringCount;
-  int m_checkStrReg; // used as argument register when calling to check type subroutines
+  int m_frameCount;
+  int m_checkStrReg; // used as argument register when calling to check type subroutines (absolute)
+  unsigned int m_base; // registers and call stack depth of a suspended run
+  unsigned int m_sp;
+  bool m_stableStrings; // hook strings remain valid during the whole run, no copies
 };
 
 //===---------------------------------------------------------===//
@@ -316,22 +417,629 @@ class ScvalInstHook
 {
 public:
   virtual const char* Do( ScvalVMOpcode opcode, ScvalHashID typeName=INVALIDHASH, const char* value=0 ) = 0;
+  // Loads (VM_LDEN, VM_LDEV, VM_LDAN, VM_LDAV) go through here. Hooks
+  // knowing the length and hash of the string override it, by default
+  // it returns the string of Do.
+  virtual void Load( ScvalVMOpcode opcode, ScvalHookString& out ){ out.Set( Do( opcode ) ); }
+  // Values the code doesn't inspect (VM_LDEV, VM_LDAV marked VM_RAWVALUE,
+  // the str types) go through here instead: the hook can hand over the
+  // text as it is in the document, without decoding the entities nor
+  // normalizing the new lines. By default it's the same as Load.
+  virtual void LoadRaw( ScvalVMOpcode opcode, ScvalHookString& out ){ Load( opcode, out ); }
+  // Batched enumeration, optional. Without moving, fills up to max items
+  // with the current element and its following siblings (VM_NEXT), or
+  // with the attributes of the current element (VM_GATT). When after is
+  // not NULL, they start after that item instead. Returns how many were
+  // filled; when max, the VM asks for the ones after the last one later.
+  // The strings remain valid until the VM goes up from those elements.
+  // The VM then walks the items instead of calling the hook for every
+  // VM_NEXT, VM_NATT and load. Returns -1 when not supported (default),
+  // the VM keeps using the per step protocol.
+  virtual int Enumerate( ScvalVMOpcode /*opcode*/, void* /*after*/, ScvalHookItem* /*items*/, unsigned int /*max*/ ){ return -1; }
+  // Makes the child element of an enumeration the current one, before
+  // the VM goes down into it or reads its attributes.
+  virtual void Select( void* /*node*/ ){}
+  // Handle of the current element (VM_LDEV) or attribute (VM_LDAV), as
+  // the nodes of Enumerate. Only asked by the deferred checks, to tell
+  // where a value is. NULL by default.
+  virtual void* Position( ScvalVMOpcode /*opcode*/ ){ return 0; }
+  // True when the last navigation ran out of input before moving (a hook
+  // fed by chunks). The resumable runs (ScvalVM::Start) suspend there and
+  // run the operation again on Resume, so the hook leaves it undone.
+  virtual bool Starved(){ return false; }
+  // False when the hook doesn't check the custom types (VM_CALL), they have
+  // to be registered in the validator: runs of code calling the hook for
+  // them fail at once (see ScvalVM::Run).
+  virtual bool Checks(){ return true; }
+  // Return true when the strings returned by Do remain valid (and unchanged)
+  // until the validation finishes, so the VM uses them without copying.
+  // By default they are considered temporary and copied on every load.
+  virtual bool StableStrings(){ return false; }
 };
+//===---------------------------------------------------------===//
+// Hook with one method per operation, statically bound by the
+// ScvalVMT<Hook> interpreter (scvalvmt.h) so the calls are inlined
+// in its loop. Deriving from ScvalInstHookT<Hook> provides the
+// virtual interface on top of those methods, for ScvalVM:
+//   void ElementName( ScvalHookString& out );    // VM_LDEN
+//   void ElementValue( ScvalHookString& out );   // VM_LDEV
+//   void AttributeName( ScvalHookString& out );  // VM_LDAN
+//   void AttributeValue( ScvalHookString& out ); // VM_LDAV
+//   void ElementRawValue( ScvalHookString& out );   // VM_LDEV, VM_RAWVALUE
+//   void AttributeRawValue( ScvalHookString& out ); // VM_LDAV, VM_RAWVALUE
+//   void Down();                  // VM_DOWN
+//   void Up();                    // VM_UP
+//   void FirstAttribute();        // VM_GATT
+//   void NextAttribute();         // VM_NATT
+//   void NextElement();           // VM_NEXT
+//   bool Check( ScvalHashID typeName, const char* value ); // VM_CALL, unless Checks() is false
+//   bool StableStrings();
+//===---------------------------------------------------------===//
+template<typename Hook>
+class ScvalInstHookT : public ScvalInstHook
+{
+public:
+  virtual const char* Do( ScvalVMOpcode opcode, ScvalHashID typeName=INVALIDHASH, const char* value=0 )
+  {
+    Hook& hook = static_cast<Hook&>(*this);
+    switch ( opcode )
+    {
+    case VM_LDEN:
+    case VM_LDEV:
+    case VM_LDAN:
+    case VM_LDAV:
+      {
+        ScvalHookString hstr;
+        Load( opcode, hstr );
+        return hstr.str;
+      }
+    case VM_DOWN: hook.Down(); break;
+    case VM_UP  : hook.Up(); break;
+    case VM_GATT: hook.FirstAttribute(); break;
+    case VM_NATT: hook.NextAttribute(); break;
+    case VM_NEXT: hook.NextElement(); break;
+    case VM_CALL: return (const char*)(size_t)( hook.Check( typeName, value ) ? 1 : 0 );
+    default: break;
+    }
+    return 0;
+  }
+  virtual void Load( ScvalVMOpcode opcode, ScvalHookString& out )
+  {
+    Hook& hook = static_cast<Hook&>(*this);
+    switch ( opcode )
+    {
+    case VM_LDEN: hook.ElementName( out ); break;
+    case VM_LDEV: hook.ElementValue( out ); break;
+    case VM_LDAN: hook.AttributeName( out ); break;
+    case VM_LDAV: hook.AttributeValue( out ); break;
+    default: out.Set( 0 ); break;
+    }
+  }
+  virtual void LoadRaw( ScvalVMOpcode opcode, ScvalHookString& out )
+  {
+    Hook& hook = static_cast<Hook&>(*this);
+    switch ( opcode )
+    {
+    case VM_LDEV: hook.ElementRawValue( out ); break;
+    case VM_LDAV: hook.AttributeRawValue( out ); break;
+    default: Load( opcode, out ); break;
+    }
+  }
+  // the raw values are the values, unless the hook knows better
+  void ElementRawValue( ScvalHookString& out ){ static_cast<Hook&>(*this).ElementValue( out ); }
+  void AttributeRawValue( ScvalHookString& out ){ static_cast<Hook&>(*this).AttributeValue( out ); }
+  // for the hooks not checking the custom types (see ScvalInstHook::Checks)
+  bool Check( ScvalHashID /*typeName*/, const char* /*value*/ ){ return false; }
+};
+//===---------------------------------------------------------===//
+// Walker of batched enumerations (see ScvalInstHook::Enumerate).
+// Every element the VM goes down into is a level, walking windows
+// of its children and attributes when batched. The windows of the
+// levels are in a buffer owned by the VM, reused between runs.
+//===---------------------------------------------------------===//
+#ifndef SCVAL_BATCH_SIZE
+#define SCVAL_BATCH_SIZE 32 // items enumerated at once
+#endif
+struct ScvalVMBatchLevel
+{
+  unsigned int count, cur;         // children in the window
+  unsigned int attrCount, attrCur; // attributes in the window
+  bool children;                   // the children are batched
+  bool attrs;                      // the attributes are batched
+};
+struct ScvalVMBatch
+{
+  ScvalVMBatch():m_items(0), m_levels(0), m_levelCap(0)
+    , m_depth(0), m_overflow(0), m_lastLoad(VM_LDEN), m_probed(false), m_enabled(false){}
+  ~ScvalVMBatch(){Clear();}
+  void Clear();
+  // before every run, batching until the hook doesn't support it
+  void Reset();
+  // raw loads only change the per step protocol, the windows have the values
+  void Load( ScvalInstHook* hook, ScvalVMOpcode opcode, ScvalHookString& out, bool raw=false )
+  {
+    m_lastLoad = opcode;
+    if ( !m_enabled )
+      raw ? hook->LoadRaw( opcode, out ) : hook->Load( opcode, out );
+    else if ( !LoadWindow( opcode, out ) )
+      LoadBatched( hook, opcode, out, raw );
+  }
+  void Navigate( ScvalInstHook* hook, ScvalVMOpcode opcode )
+  {
+    if ( !m_enabled )
+      hook->Do( opcode );
+    else if ( !m_overflow && opcode == VM_NEXT && m_levels[m_depth].children )
+      ++m_levels[m_depth].cur;
+    else if ( !m_overflow && opcode == VM_NATT && m_levels[m_depth].attrs )
+      ++m_levels[m_depth].attrCur;
+    else
+      NavigateBatched( hook, opcode );
+  }
+  // element or attribute of the last value loaded (see ScvalInstHook::Position)
+  void* Position( ScvalInstHook* hook );
+private:
+  // loads from the current windows, false when it needs the hook
+  bool LoadWindow( ScvalVMOpcode opcode, ScvalHookString& out )const
+  {
+    const ScvalVMBatchLevel& level = m_levels[m_depth];
+    if ( m_overflow )
+      return false;
+    if ( opcode == VM_LDEN || opcode == VM_LDEV )
+    {
+      if ( !level.children || level.cur >= level.count )
+        return false;
+      const ScvalHookItem& item = m_items[m_depth*2*SCVAL_BATCH_SIZE+level.cur];
+      out = opcode == VM_LDEN ? item.name : item.value;
+      return true;
+    }
+    if ( !level.attrs || level.attrCur >= level.attrCount )
+      return false;
+    const ScvalHookItem& item = m_items[(m_depth*2+1)*SCVAL_BATCH_SIZE+level.attrCur];
+    out = opcode == VM_LDAN ? item.name : item.value;
+    return true;
+  }
+  void LoadBatched( ScvalInstHook* hook, ScvalVMOpcode opcode, ScvalHookString& out, bool raw );
+  void NavigateBatched( ScvalInstHook* hook, ScvalVMOpcode opcode );
+  int Fill( ScvalInstHook* hook, ScvalVMOpcode opcode, ScvalHookItem* window );
+  const ScvalHookItem* Cursor( ScvalInstHook* hook, ScvalVMOpcode opcode, 
+                               ScvalHookItem* window, unsigned int& count, unsigned int& cur );
+  ScvalHookItem* Children( unsigned int depth ){ return m_items+depth*2*SCVAL_BATCH_SIZE; }
+  ScvalHookItem* Attributes( unsigned int depth ){ return m_items+(depth*2+1)*SCVAL_BATCH_SIZE; }
+
+  ScvalHookItem* m_items;       // two windows per level, children and attributes
+  ScvalVMBatchLevel* m_levels;
+  unsigned int m_levelCap;
+  unsigned int m_depth;         // current level
+  unsigned int m_overflow;      // levels below m_depth not tracked (out of memory), step by step
+  ScvalVMOpcode m_lastLoad;
+  bool m_probed;                // the hook was asked for an enumeration in this run
+  bool m_enabled;
+};
+//===---------------------------------------------------------===//
+// Check function of a custom type, registered in the VM to be called
+// for its VM_CALL instead of the hook. Binding resolves the type of
+// every VM_CALL to its function, so a check is a call through the
+// resolved entry, without hashing or searching. value may be NULL
+// when there's no text.
+//===---------------------------------------------------------===//
+typedef bool (*ScvalCheckFunc)( const char* value, unsigned int len, void* user );
+struct ScvalCheck
+{
+  ScvalHashID typeName;
+  ScvalCheckFunc func;  // NULL calls the hook (no check registered in the VM)
+  void* user;
+};
+//===---------------------------------------------------------===//
+// The checks registered for the custom types, and the check of every
+// VM_CALL of the bound code resolved from them (see ScvalVM and
+// ScvalVMT::RegisterCheck).
+//===---------------------------------------------------------===//
+struct ScvalCheckTable
+{
+  ScvalCheckTable():m_checks(0), m_noChecks(0), m_calls(0), m_hookCalls(false){}
+  ~ScvalCheckTable(){Clear();}
+  void Clear();
+  // NULL func unregisters the type
+  bool RegisterCheck( ScvalHashID typeName, ScvalCheckFunc func, void* user=0 );
+  // fails when checks are registered and a type of the code has none
+  bool Resolve( const ScvalVMCode& code );
+
+  ScvalCheck* m_checks;      // registered checks
+  unsigned int m_noChecks;
+  ScvalCheck* m_calls;       // resolved check of every VM_CALL, by data address
+  bool m_hookCalls;          // VM_CALL of the code without check, calling the hook
+};
+struct ScvalVMStats;
+//===---------------------------------------------------------===//
+// Bounded cache of VM_CALL results, keyed by the custom type and the
+// value bytes, for the types marked cacheable (the others always call
+// the hook). Direct mapped by the hash of the value, which the VM
+// already has in the register. Values longer than
+// SCVAL_CALL_CACHE_MAXLEN bytes are not cached. The entries survive
+// between runs, Flush forgets them (registering a check flushes them).
+//===---------------------------------------------------------===//
+#ifndef SCVAL_CALL_CACHE_MAXLEN
+#define SCVAL_CALL_CACHE_MAXLEN 48
+#endif
+struct ScvalCallCacheEntry
+{
+  ScvalHashID typeName;
+  ScvalHashID valueHash;
+  unsigned int len;     // bytes of the value, SCVAL_CALL_CACHE_MAXLEN+1 when empty
+  int result;
+  char value[SCVAL_CALL_CACHE_MAXLEN];
+};
+struct ScvalCallCache
+{
+  ScvalCallCache():m_entries(0), m_mask(0), m_cacheable(0), m_noCacheable(0)
+    , m_hits(0), m_misses(0){}
+  ~ScvalCallCache(){Clear();}
+  void Clear();
+  // noEntries is rounded up to a power of two, 0 disables the cache
+  bool Init( unsigned int noEntries );
+  void Flush();
+  bool SetCacheable( ScvalHashID typeName, bool cacheable );
+  bool IsCacheable( ScvalHashID typeName )const;
+  bool IsEnabled()const{ return m_entries!=0; }
+  // cached result of the check, false on miss (the hook is called and then Store)
+  bool Lookup( ScvalHashID typeName, const ScvalVMString& value, ScvalHashID valueHash, int& result );
+  void Store( ScvalHashID typeName, const ScvalVMString& value, ScvalHashID valueHash, int result );
+  // the check of VM_CALL, through the cache when enabled, counted in stats when not NULL
+  int Call( ScvalInstHook* hook, const ScvalCheck& check, const ScvalVMString& value, ScvalHashID valueHash, ScvalVMStats* stats );
+  void ResetCounters(){ m_hits = m_misses = 0; }
+
+  ScvalCallCacheEntry* m_entries;
+  unsigned int m_mask;
+  ScvalHashID* m_cacheable;   // types marked cacheable
+  unsigned int m_noCacheable;
+  unsigned int m_hits;        // lookups answered by the cache
+  unsigned int m_misses;      // lookups of cacheable types calling the hook
+};
+
+//===---------------------------------------------------------===//
+// Deferred checks of the custom types. Instead of checking the value
+// in the middle of VM_CALL, the VM collects it in a batch, handed to
+// the batch check when it fills and when the walk of the document
+// finishes; VM_CALL passes meanwhile. A failed check of a batch stops
+// the run, the verdict accounts for all the batches. Cached results
+// (see ScvalCallCache) are still answered right away.
+//===---------------------------------------------------------===//
+struct ScvalDeferredCheck
+{
+  ScvalHashID typeName;
+  const char* value;     // zero terminated, NULL when there's no text
+  unsigned int len;
+  ScvalHashID valueHash;
+  void* node;            // element or attribute of the value (see ScvalInstHook::Position)
+  unsigned int index;    // order of the value in the document
+  bool result;           // set by the batch check
+};
+// checks the values of the batch, setting their result
+typedef void (*ScvalBatchCheckFunc)( ScvalDeferredCheck* checks, unsigned int count, void* user );
+struct ScvalDeferredChecks
+{
+  ScvalDeferredChecks():m_checks(0), m_offsets(0), m_count(0), m_cap(0)
+    , m_text(0), m_textSize(0), m_textCap(0), m_index(0), m_func(0), m_user(0), m_failed(false){}
+  ~ScvalDeferredChecks(){Clear();}
+  void Clear();
+  // batches of batchSize values, a NULL func disables it
+  bool Init( ScvalBatchCheckFunc func, void* user, unsigned int batchSize );
+  // before every run
+  void Reset(){ m_count = m_textSize = m_index = 0; m_failed = false; }
+  bool IsEnabled()const{ return m_func!=0; }
+  bool IsFull()const{ return m_count == m_cap; }
+  // adds a value to the batch, copied when the hook strings are temporary
+  bool Add( ScvalHashID typeName, const ScvalVMString& value, ScvalHashID valueHash, void* node, bool copy );
+  // runs the batch check on the pending values, false when one fails
+  bool Check();
+  // forgets the pending values
+  void Drop(){ m_count = m_textSize = 0; }
+
+  ScvalDeferredCheck* m_checks;  // pending values
+  unsigned int* m_offsets;       // in m_text of the copied ones, ~0u otherwise
+  unsigned int m_count;
+  unsigned int m_cap;
+  char* m_text;                  // copies of the temporary values
+  unsigned int m_textSize;
+  unsigned int m_textCap;
+  unsigned int m_index;          // values deferred in this run
+  ScvalBatchCheckFunc m_func;
+  void* m_user;
+  ScvalDeferredCheck m_failure;  // first failed check of the run
+  bool m_failed;
+};
+
+//===---------------------------------------------------------===//
+// Execution engines of the VM.
+// - SWITCH decodes and dispatches every instruction in a switch.
+// - THREADED pre-decodes the code segment into ScvalVMThreadedOp
+//   slots and jumps from handler to handler (computed gotos when the
+//   compiler supports them, a switch over decoded slots otherwise).
+// - JIT translates the code segment into x86-64 native code. Hosts
+//   without JIT support (see ScvalJitSupported) use SWITCH instead.
+//===---------------------------------------------------------===//
+enum ScvalVMEngine
+{
+  VMENGINE_SWITCH=0,
+  VMENGINE_THREADED,
+  VMENGINE_JIT
+};
+
+// Result of the resumable runs (ScvalVM::Start)
+enum ScvalVMStatus
+{
+  VMSTATUS_INVALID=0,
+  VMSTATUS_VALID,
+  VMSTATUS_SUSPENDED, // the hook is starved, Resume when it has more input
+  VMSTATUS_RECORDS    // at the loop of the records, see ScvalVM::StartRecords
+};
+
+//===---------------------------------------------------------===//
+// Loop of the code over the records, the children of the root
+// element. The compiler heads it with VM_CLR c,n: its n counters
+// from c, already zero there, so the engines don't clear them.
+// The loop keeps nothing between the records but those counters,
+// so slices of the records can be validated apart, by other VMs
+// (see ScvalRecordsCode), and their counters added up before
+// comparing them.
+//===---------------------------------------------------------===//
+struct ScvalVMRecords
+{
+  ScvalVMRecords():loopPc(0), endPc(0), counter(0), noCounters(0){}
+  unsigned int loopPc;      // first operation of the loop, right after VM_CLR
+  unsigned int endPc;       // where the loop exits, comparing the counters
+  unsigned int counter;     // first counter of the loop
+  unsigned int noCounters;
+};
+
+//===---------------------------------------------------------===//
+// Pre-decoded instruction for the threaded engine. Jump targets are
+// already resolved to slot indices (error and end of code included)
+// and constant data is already fetched from the data segment.
+//===---------------------------------------------------------===//
+struct ScvalVMThreadedOp
+{
+  const void* handler;   // handler label address (computed gotos only)
+  unsigned int arg;      // jump target slot, constant hash, chkc or data addr
+  unsigned int jmp;      // jump target slot of fused operations
+  unsigned char reg;     // register operand
+  unsigned char imm;     // immediate operand (cmpi value, chkn type, raw load, fused inc counter)
+  unsigned short opcode; // original opcode, used by the portable dispatch
+};
+
+//===---------------------------------------------------------===//
+// Execution statistics of the last run. Only collected when enabled
+// in the VM. SCVAL_NO_STATS removes the collection and the API to
+// enable and get them, the type remains for the call cache. The JIT
+// engine doesn't count operations, only the hook calls.
+//===---------------------------------------------------------===//
+struct ScvalVMCallStats
+{
+  ScvalHashID typeName;  // custom type
+  unsigned int count;    // VM_CALL of this type, checked by the hook, a registered check, the cache or deferred
+};
+struct ScvalVMStats
+{
+  ScvalVMStats():m_executed(0), m_hashedLoads(0), m_enumerations(0), m_calls(0), m_noCalls(0){ Reset(); }
+  void Reset()
+  {
+    m_executed = 0;
+    m_hashedLoads = 0;
+    m_enumerations = 0;
+    for ( int i = 0; i < VM_NOOPCODES; ++i )
+      m_opCount[i] = m_hookCount[i] = 0;
+    for ( unsigned int i = 0; i < m_noCalls; ++i )
+      m_calls[i].count = 0;
+  }
+  // a VM_CALL of the custom type
+  void CountCall( ScvalHashID typeName )
+  {
+    for ( unsigned int i = 0; i < m_noCalls; ++i )
+      if ( m_calls[i].typeName == typeName )
+      {
+        m_calls[i].count++;
+        break;
+      }
+  }
+  unsigned int GetCallCount( ScvalHashID typeName )const
+  {
+    for ( unsigned int i = 0; i < m_noCalls; ++i )
+      if ( m_calls[i].typeName == typeName )
+        return m_calls[i].count;
+    return 0;
+  }
+  unsigned int m_executed;                // operations executed
+  unsigned int m_opCount[VM_NOOPCODES];   // operations executed, by opcode
+  unsigned int m_hookCount[VM_NOOPCODES]; // hook calls, by opcode
+  unsigned int m_hashedLoads;             // loads with the hash supplied by the hook
+  unsigned int m_enumerations;            // batched enumerations
+  ScvalVMCallStats* m_calls;              // one per custom type of the bound code
+  unsigned int m_noCalls;
+};
+
+inline int ScvalCallCache::Call( ScvalInstHook* hook, const ScvalCheck& check, const ScvalVMString& value, ScvalHashID valueHash, ScvalVMStats* stats )
+{
+  int result;
+  if ( stats )
+    stats->CountCall( check.typeName );
+  if ( m_entries && Lookup( check.typeName, value, valueHash, result ) )
+    return result;
+  if ( check.func )
+    result = int(check.func( value.str, value.len, check.user ));
+  else
+    result = int(hook->Do( VM_CALL, check.typeName, value.str ) != 0);
+  if ( m_entries )
+    Store( check.typeName, value, valueHash, result );
+  return result;
+}
+
 class ScvalVM
 {
 public:
+  ScvalVM():m_code(0), m_pc(0), m_engine(VMENGINE_SWITCH), m_resumable(false), m_suspended(false)
+    , m_stopAtRecords(false), m_atRecords(false)
+    , m_threaded(0), m_threadedCap(0), m_threadedReady(false)
+    , m_jitCode(0), m_jitSize(0), m_jitStack(0), m_jitHook(0), m_jitFailed(false)
+#ifndef SCVAL_NO_STATS
+    , m_statsEnabled(false)
+#endif
+    {}
   ~ScvalVM(){Clear();}
   void Clear();
+  // Allocates the register file for the code. The code must outlive the binding.
+  // Fails when checks are registered and one of the custom types of the code has none.
+  bool Bind( const ScvalVMCode* code );
+  // Runs the bound code. The register file is reset, not reallocated. Fails
+  // at once when the code calls the hook for custom types and the hook doesn't
+  // check them (see ScvalInstHook::Checks), unless the checks are deferred.
+  bool Run( ScvalInstHook* hook );
+  // Binds and runs the code
   bool Run( const ScvalVMCode* code, ScvalInstHook* hook );
+  // Resumable run, for hooks fed by chunks: when a navigation starves the
+  // hook (see ScvalInstHook::Starved) the VM keeps its state (pc, registers,
+  // call stack, counters) and returns VMSTATUS_SUSPENDED, Resume goes on
+  // from there. Interpreted by the switch engine whatever the engine set,
+  // the others keep that state in locals and machine registers.
+  ScvalVMStatus Start( ScvalInstHook* hook );
+  ScvalVMStatus Resume( ScvalInstHook* hook );
+  bool IsSuspended()const{ return m_suspended; }
+  // Resumable run stopping at the loop of the records (VMSTATUS_RECORDS), the
+  // hook down in the root element at the first record. GetRecords tells which
+  // loop, the records are validated by slices (see ScvalRecordsCode) and
+  // ResumeRecords goes on after the loop with the counters of the slices added
+  // up. Resume runs the loop here instead. Interpreted by the switch engine.
+  ScvalVMStatus StartRecords( ScvalInstHook* hook );
+  ScvalVMStatus ResumeRecords( ScvalInstHook* hook, const unsigned short* counters );
+  const ScvalVMRecords& GetRecords()const{ return m_records; }
+  // the counter registers after the last run, the ones of a slice of records
+  const unsigned short* GetCounters()const{ return m_mainCtx.m_regCounters; }
+  const ScvalVMCode* GetCode()const{ return m_code; }
+  void SetEngine( ScvalVMEngine engine ){ m_engine = engine; }
+  ScvalVMEngine GetEngine()const{ return m_engine; }
+#ifndef SCVAL_NO_STATS
+  // Statistics of the next runs. Disabled by default, it costs a bit per operation.
+  // Compiled out with SCVAL_NO_STATS.
+  void EnableStats( bool enable ){ m_statsEnabled = enable; }
+  // Statistics of the last run, NULL when disabled
+  const ScvalVMStats* GetStats()const;
+  unsigned int GetExecutedCount()const{ const ScvalVMStats* stats=GetStats(); return stats ? stats->m_executed : 0; }
+#endif
+  // Cache of VM_CALL results with noEntries slots (0 disables it), only
+  // for the custom types marked cacheable. The others always call the hook.
+  bool EnableCallCache( unsigned int noEntries ){ return m_callCache.Init( noEntries ); }
+  bool SetCallCacheable( ScvalHashID typeName, bool cacheable=true ){ return m_callCache.SetCacheable( typeName, cacheable ); }
+  // entries and hit/miss counters, cumulative between runs
+  ScvalCallCache& GetCallCache(){ return m_callCache; }
+  // Check function of a custom type (NULL func unregisters it). With no checks
+  // registered, VM_CALL calls the hook. Otherwise all the custom types of the
+  // code need one, to be resolved when binding: register them before Bind, a
+  // bound VM resolves again and is unbound when a type is missing. The call
+  // cache is flushed.
+  bool RegisterCheck( ScvalHashID typeName, ScvalCheckFunc func, void* user=0 );
+  // Defers the checks of the custom types to func, in batches of batchSize
+  // values (see ScvalDeferredCheck). A NULL func checks them in VM_CALL again.
+  bool EnableDeferredChecks( ScvalBatchCheckFunc func, void* user=0, unsigned int batchSize=256 ){ return m_deferred.Init( func, user, batchSize ); }
+  // The failed check when the last run failed in a deferred check, NULL
+  // otherwise. Valid until the next run.
+  const ScvalDeferredCheck* GetFailedCheck()const{ return m_deferred.m_failed ? &m_deferred.m_failure : 0; }
+  // native types checks (chkn), shared with ScvalVMT
+  static bool IsInteger( const char* str );
+  static bool IsReal( const char* str );
+  static bool IsBool( ScvalHashID strhash );
 private:
-  bool IsInteger( const char* str );
-  bool IsReal( const char* str );
-  bool IsBool( ScvalHashID strhash );
+  bool CanRun( ScvalInstHook* hook )const{ return m_code && ( !m_checks.m_hookCalls || m_deferred.IsEnabled() || hook->Checks() ); }
+  void BeginRun( ScvalInstHook* hook );
+  bool RunEngine( ScvalInstHook* hook, ScvalVMEngine engine );
+  bool EndRun( bool result );
+  ScvalVMStatus Continue( ScvalInstHook* hook );
+  bool StopAtRecords( unsigned int clrPc, unsigned int base );
+  class SwitchExec;
+  bool RunSwitch( ScvalInstHook* hook );
+  bool RunThreaded( ScvalInstHook* hook );
+  bool RunJit( ScvalInstHook* hook );
+  int DeferCheck( ScvalInstHook* hook, const ScvalCheck& check, int reg );
+  // the statistics counting the checks of this run, NULL when not collected
+  ScvalVMStats* RunStats()
+  {
+#ifndef SCVAL_NO_STATS
+    if ( m_statsEnabled )
+      return &m_stats;
+#endif
+    return 0;
+  }
+  bool CheckDeferred();
+  bool CompileJit();
+  void FreeJit();
+  // native code calls back into these for everything but the control flow
+  static ScvalHashID JitLoad( ScvalVM* vm, int opcode, int reg );
+  static ScvalHashID JitLoadRaw( ScvalVM* vm, int opcode, int reg );
+  static int JitNavigate( ScvalVM* vm, int opcode, int unused );
+  static int JitCheckNative( ScvalVM* vm, int nativeType, int reg );
+  static int JitCallback( ScvalVM* vm, int dataAddr, int reg );
 private:
+  const ScvalVMCode* m_code;
   unsigned int m_pc;
-  unsigned int m_lastPc;
-  unsigned int m_opExecuted;
+  ScvalVMEngine m_engine;
+  bool m_resumable;              // the run suspends when the hook starves
+  bool m_suspended;              // m_pc and the context of the suspended run
+  bool m_stopAtRecords;          // the run suspends at the loop of the records
+  bool m_atRecords;              // suspended there, m_records is the loop
+  ScvalVMRecords m_records;
+  ScvalVMThreadedOp* m_threaded; // decoded code for the threaded engine
+  unsigned int m_threadedCap;
+  bool m_threadedReady;          // m_threaded is decoded from m_code
+  void* m_jitCode;               // native code translated from m_code
+  unsigned int m_jitSize;
+  void* m_jitStack;              // native stack pointer when entering the native code
+  ScvalInstHook* m_jitHook;      // hook of the current native run
+  bool m_jitFailed;              // m_code couldn't be translated, interpreted instead
   ScvalVMContext m_mainCtx;
+  ScvalVMBatch m_batch;
+  ScvalCallCache m_callCache;
+  ScvalCheckTable m_checks;      // registered checks, resolved for every VM_CALL
+  ScvalDeferredChecks m_deferred;
+#ifndef SCVAL_NO_STATS
+  ScvalVMStats m_stats;
+  bool m_statsEnabled;
+#endif
+};
+
+//===---------------------------------------------------------===//
+// Validation session bound to one bytecode. The VM register file
+// (and the decoded code of the threaded engine) is allocated once
+// when binding and only reset between documents, so this is the
+// way to validate many documents against the same schema.
+// The bytecode must outlive the session.
+//===---------------------------------------------------------===//
+class ScvalValidator
+{
+public:
+  ScvalValidator(){}
+  ScvalValidator( const ScvalVMCode& code, ScvalVMEngine engine=VMENGINE_SWITCH ){ Bind(code,engine); }
+  bool Bind( const ScvalVMCode& code, ScvalVMEngine engine=VMENGINE_SWITCH );
+  bool Validate( ScvalInstHook* xmlReader );
+  // resumable validation, see ScvalVM::Start
+  ScvalVMStatus Start( ScvalInstHook* xmlReader ){ return m_vm.Start( xmlReader ); }
+  ScvalVMStatus Resume( ScvalInstHook* xmlReader ){ return m_vm.Resume( xmlReader ); }
+  // validation of the records by slices, see ScvalVM::StartRecords
+  ScvalVMStatus StartRecords( ScvalInstHook* xmlReader ){ return m_vm.StartRecords( xmlReader ); }
+  ScvalVMStatus ResumeRecords( ScvalInstHook* xmlReader, const unsigned short* counters ){ return m_vm.ResumeRecords( xmlReader, counters ); }
+  const ScvalVMRecords& GetRecords()const{ return m_vm.GetRecords(); }
+  const unsigned short* GetCounters()const{ return m_vm.GetCounters(); }
+  bool IsBound()const{ return m_vm.GetCode()!=0; }
+#ifndef SCVAL_NO_STATS
+  void EnableStats( bool enable ){ m_vm.EnableStats( enable ); }
+  const ScvalVMStats* GetStats()const{ return m_vm.GetStats(); }
+#endif
+  bool EnableCallCache( unsigned int noEntries ){ return m_vm.EnableCallCache( noEntries ); }
+  bool SetCallCacheable( ScvalHashID typeName, bool cacheable=true ){ return m_vm.SetCallCacheable( typeName, cacheable ); }
+  ScvalCallCache& GetCallCache(){ return m_vm.GetCallCache(); }
+  bool RegisterCheck( ScvalHashID typeName, ScvalCheckFunc func, void* user=0 ){ return m_vm.RegisterCheck( typeName, func, user ); }
+  bool EnableDeferredChecks( ScvalBatchCheckFunc func, void* user=0, unsigned int batchSize=256 ){ return m_vm.EnableDeferredChecks( func, user, batchSize ); }
+  const ScvalDeferredCheck* GetFailedCheck()const{ return m_vm.GetFailedCheck(); }
+  ScvalVM& GetVM(){ return m_vm; }
+private:
+  ScvalVM m_vm;
 };
 
 //===---------------------------------------------------------===//
@@ -339,9 +1047,21 @@ private:
 //===---------------------------------------------------------===//
 // Generates a hash from a string using the internal hash function
 ScvalHashID ScvalHash(const char* str);
+// Same hash, also returning the length of the string (0 for NULL)
+ScvalHashID ScvalHashLen(const char* str, unsigned int& outLen);
+// Same hash, of a string whose length is already known
+ScvalHashID ScvalHashN(const char* str, unsigned int len);
+
+// Compilation flags
+enum ScvalCompileFlags
+{
+  COMPILE_DEFAULT=0,
+  COMPILE_NOFUSION=1<<0,  // don't fuse common sequences into superinstructions
+  COMPILE_NOSWITCH=1<<1   // always compare children names one by one, no hashed switch
+};
 
 // Generates the bytecode from the text program
-bool ScvalCompile(const char* text, ScvalVMCode& outBytecode );
+bool ScvalCompile(const char* text, ScvalVMCode& outBytecode, unsigned int flags=COMPILE_DEFAULT );
 void ScvalPrintCode( ScvalVMCode& code );
 
 // Load the bytecode from binary chunk
@@ -351,7 +1071,21 @@ bool ScvalLoadFromBinary( const void* binChunk, ScvalVMCode& outBytecode );
 bool ScvalSaveToBinary( const ScvalVMCode& inBytecode, void** outBinChunk, unsigned int& chunkSizeBytes );
 void ScvalBinaryDeallocate( void** binChunk );
 
+// Writes the bytecode as a C++ function template 'bool functionName(Hook&)' into
+// outFile, which validates without the VM when compiled into the application.
+// The hook has one method per operation, as for ScvalVMT (see ScvalInstHookT)
+bool ScvalGenerateCpp( const ScvalVMCode& code, const char* functionName, const char* outFile );
+
+// The loop of the records alone (see ScvalVMRecords), to validate a slice of
+// them: the run starts at the loop, on the first record of the slice as the
+// current element, and ends when the hook has no more records (a NULL name),
+// valid, leaving the counters of the loop (ScvalVM::GetCounters).
+bool ScvalRecordsCode( const ScvalVMCode& code, const ScvalVMRecords& records, ScvalVMCode& outBytecode );
+
+// True when the JIT engine is available in this host (x86-64)
+bool ScvalJitSupported();
+
 // Validates the XML from the bytecode
-bool ScvalValidate(const ScvalVMCode& inBytecode, ScvalInstHook* xmlReader );
+bool ScvalValidate(const ScvalVMCode& inBytecode, ScvalInstHook* xmlReader, ScvalVMEngine engine=VMENGINE_SWITCH );
 
 #endif
\ No newline at end of file
@@ -0,0 +1,287 @@
+#ifndef _SCVALVMT_H_
+#define _SCVALVMT_H_
+#include "scvaltypes.h"
+
+//===---------------------------------------------------------===//
+// Switch interpreter of the bytecode, shared by the switch engine of
+// ScvalVM and by ScvalVMT. What reaches the hook goes through the
+// executor, which the interpreter is instantiated for:
+//   void Count( unsigned char opcode );  // every operation, statistics
+//   void Load( ScvalVMOpcode opcode, ScvalHookString& out, bool raw ); // VM_LDxx
+//   bool Navigate( ScvalVMOpcode opcode ); // false to suspend before it
+//   bool StopAtRecords( unsigned int clrPc, unsigned int base ); // true to suspend at VM_CLR
+//   int Call( unsigned int check, int reg ); // VM_CALL, result for CMPRES
+// A suspended run leaves the frame (base and call stack depth) in the
+// context and returns false, resume goes on from pc with it.
+//===---------------------------------------------------------===//
+template<typename Exec>
+bool ScvalRunSwitch( Exec& exec, const ScvalVMCode* code, ScvalVMContext& ctx, unsigned int& pc, bool resume )
+{
+  int& CMPRES = ctx.m_cmpRes;
+  // registers of the current frame, where the suspended run was
+  unsigned int base = 0;
+  unsigned int sp = 0;
+  if ( resume )
+  {
+    base = ctx.m_base;
+    sp = ctx.m_sp;
+  }
+  else
+    pc = 0;
+  ScvalHashID* R_HASHES = ctx.m_regStrHashes+base;
+  const ScvalVMString* R_STRS = ctx.m_regStrings+base;
+  unsigned short* R_CNTS = ctx.m_regCounters+base;
+  ScvalVMFrame* frames = ctx.m_frames;
+  ScvalHookString hstr; // last load
+  const unsigned int maxPC = code->m_noOperations;
+  while ( pc < maxPC )
+  {
+    const ScvalVMOperation& operation = code->m_code[pc++];
+    exec.Count( operation.opcode );
+    switch ( operation.opcode )
+    {
+    case VM_LDEN:
+    case VM_LDEV:
+    case VM_LDAN:
+    case VM_LDAV:
+      if ( operation.op1 == VM_RAWVALUE )
+      {
+        exec.Load( (ScvalVMOpcode)operation.opcode, hstr, true );
+        R_HASHES[operation.op0] = ctx.LoadRaw( base+operation.op0, hstr );
+      }
+      else
+      {
+        exec.Load( (ScvalVMOpcode)operation.opcode, hstr, false );
+        R_HASHES[operation.op0] = ctx.LoadString( base+operation.op0, hstr );
+      }
+      break;
+    case VM_CMPS:
+      {
+        unsigned int dataAddr = operation.GetDataAddr();
+        const int op2 = dataAddr==VM_NILDATA ? 0 : code->m_constData[dataAddr];
+        CMPRES = R_HASHES[operation.op0] - op2;
+      }break;
+    case VM_CMPI:
+      CMPRES = R_CNTS[operation.op0] - operation.op1;
+      R_CNTS[operation.op0]=0;
+      break;
+    case VM_JE:
+      if ( CMPRES == 0 )
+        pc = operation.GetAddr();
+      break;
+    case VM_JNE:
+      if ( CMPRES != 0 )
+        pc = operation.GetAddr();
+      break;
+    case VM_JG:
+      if ( CMPRES > 0 )
+        pc = operation.GetAddr();
+      break;
+    case VM_JMP:
+      pc = operation.GetAddr();
+      break;
+    case VM_CLR:
+      if ( exec.StopAtRecords( pc-1, base ) )
+        goto l_suspended;
+      break;
+    case VM_INC:
+      R_CNTS[operation.op0]++;
+      break;
+    case VM_CHKN:
+      switch ( operation.op1 ) // native type to check
+      {
+      case 0: if ( !ScvalVM::IsReal(R_STRS[operation.op0].str) ) pc = VM_ERRADDR; break;
+      case 1: break;
+      case 2: if ( !ScvalVM::IsInteger(R_STRS[operation.op0].str) ) pc = VM_ERRADDR; break;
+      case 3: if ( !ScvalVM::IsBool(R_HASHES[operation.op0] ) ) pc = VM_ERRADDR; break;
+      default: break;
+      }break;
+    case VM_CHKC:
+      if ( sp >= (unsigned int)ctx.m_frameCount )
+      {
+        pc = VM_ERRADDR;
+        break;
+      }
+      ctx.m_checkStrReg = base+operation.op0;
+      frames[sp].retPc = pc;
+      frames[sp++].base = base;
+      pc = operation.GetDataAddr();// in chkc operation, only 2 bytes for address
+      break;
+    case VM_JSR:
+      if ( sp >= SCVAL_MAX_CALL_DEPTH )
+      {
+        pc = VM_ERRADDR;
+        break;
+      }
+      frames[sp].retPc = pc;
+      frames[sp++].base = base;
+      base += operation.op0;
+      R_HASHES = ctx.m_regStrHashes+base;
+      R_STRS = ctx.m_regStrings+base;
+      R_CNTS = ctx.m_regCounters+base;
+      pc = operation.GetDataAddr();
+      break;
+    case VM_DOWN:
+    case VM_UP  :
+    case VM_GATT:
+    case VM_NATT:
+    case VM_NEXT:
+      if ( !exec.Navigate( (ScvalVMOpcode)operation.opcode ) )
+        goto l_starved;
+      break;
+    case VM_RET:
+      if ( sp == 0 )
+      {
+        pc = VM_ERRADDR;
+        break;
+      }
+      pc = frames[--sp].retPc;
+      base = frames[sp].base;
+      R_HASHES = ctx.m_regStrHashes+base;
+      R_STRS = ctx.m_regStrings+base;
+      R_CNTS = ctx.m_regCounters+base;
+      break;
+    case VM_CALL:
+      CMPRES = exec.Call( operation.GetDataAddr(), ctx.m_checkStrReg );
+      break;
+    case VM_LENJ: // LDxN r; CMPS r,nil; JE addr
+    case VM_LANJ:
+      exec.Load( operation.opcode==VM_LENJ ? VM_LDEN : VM_LDAN, hstr, false );
+      R_HASHES[operation.op0] = ctx.LoadString( base+operation.op0, hstr );
+      CMPRES = R_HASHES[operation.op0];
+      pc = CMPRES==0 ? code->m_code[pc+1].GetAddr() : pc+2;
+      break;
+    case VM_CJNI: // CMPS r,data; JNE addr; INC c
+      CMPRES = R_HASHES[operation.op0] - code->m_constData[operation.GetDataAddr()];
+      if ( CMPRES != 0 )
+        pc = code->m_code[pc].GetAddr();
+      else
+      {
+        R_CNTS[code->m_code[pc+1].op0]++;
+        pc += 2;
+      }
+      break;
+    case VM_SWITCH:
+      pc = ScvalSwitchTarget( code->m_constData+operation.GetDataAddr(), R_HASHES[operation.op0] );
+      break;
+    default: return false;
+    }
+  }
+  // this special pc address is considered that there was an error
+  return pc != VM_ERRADDR;
+l_starved:
+  // back to this operation, run again on resume
+  --pc;
+l_suspended:
+  ctx.m_base = base;
+  ctx.m_sp = sp;
+  return false;
+}
+
+//===---------------------------------------------------------===//
+// Interpreter statically bound to the hook type. The hook provides
+// one method per operation (see ScvalInstHookT), called without
+// going through the virtual ScvalInstHook::Do, so the XML navigation
+// gets inlined in the loop. The operations are the ones of the switch
+// engine of ScvalVM (ScvalRunSwitch), without what ScvalVM does around
+// the hook: no statistics, batching, call cache, deferred checks nor
+// suspension.
+// As ScvalValidator, the register file is allocated when binding and
+// reset between documents, and the checks registered for the custom
+// types are resolved for every VM_CALL (the hook's Check otherwise).
+// The bytecode must outlive the binding.
+//===---------------------------------------------------------===//
+template<typename Hook>
+class ScvalVMT
+{
+public:
+  ScvalVMT():m_code(0), m_pc(0){}
+  ScvalVMT( const ScvalVMCode& code ):m_code(0), m_pc(0){ Bind(code); }
+  ~ScvalVMT(){ m_ctx.Clear(); }
+  // Fails when checks are registered and one of the custom types of the code has none
+  bool Bind( const ScvalVMCode& code )
+  {
+    m_code = 0;
+    if ( !m_ctx.Init( code ) || !m_checks.Resolve( code ) )
+      return false;
+    m_code = &code;
+    return true;
+  }
+  bool IsBound()const{ return m_code!=0; }
+  // as ScvalVM::RegisterCheck, a bound interpreter resolves again
+  bool RegisterCheck( ScvalHashID typeName, ScvalCheckFunc func, void* user=0 )
+  {
+    if ( !m_checks.RegisterCheck( typeName, func, user ) )
+      return false;
+    if ( m_code && !m_checks.Resolve( *m_code ) )
+    {
+      m_code = 0;
+      return false;
+    }
+    return true;
+  }
+  bool Validate( Hook& hook );
+private:
+  // the operations on the hook, for ScvalRunSwitch
+  class Exec
+  {
+  public:
+    Exec( Hook& hook, const ScvalCheckTable& checks, const ScvalVMContext& ctx ):m_hook(hook), m_checks(checks), m_ctx(ctx){}
+    void Count( unsigned char /*opcode*/ ){}
+    void Load( ScvalVMOpcode opcode, ScvalHookString& out, bool raw )
+    {
+      switch ( opcode )
+      {
+      case VM_LDEN: m_hook.ElementName( out ); break;
+      case VM_LDEV: if ( raw ) m_hook.ElementRawValue( out ); else m_hook.ElementValue( out ); break;
+      case VM_LDAN: m_hook.AttributeName( out ); break;
+      case VM_LDAV: if ( raw ) m_hook.AttributeRawValue( out ); else m_hook.AttributeValue( out ); break;
+      default: out.Set( 0 ); break;
+      }
+    }
+    bool Navigate( ScvalVMOpcode opcode )
+    {
+      switch ( opcode )
+      {
+      case VM_DOWN: m_hook.Down(); break;
+      case VM_UP  : m_hook.Up(); break;
+      case VM_GATT: m_hook.FirstAttribute(); break;
+      case VM_NATT: m_hook.NextAttribute(); break;
+      case VM_NEXT: m_hook.NextElement(); break;
+      default: break;
+      }
+      return true;
+    }
+    bool StopAtRecords( unsigned int /*clrPc*/, unsigned int /*base*/ ){ return false; }
+    int Call( unsigned int check, int reg )
+    {
+      const ScvalCheck& c = m_checks.m_calls[check];
+      const ScvalVMString& value = m_ctx.m_regStrings[reg];
+      return ( c.func ? c.func( value.str, value.len, c.user ) : m_hook.Check( c.typeName, value.str ) ) ? 1 : 0;
+    }
+  private:
+    Hook& m_hook;
+    const ScvalCheckTable& m_checks;
+    const ScvalVMContext& m_ctx;
+  };
+
+  const ScvalVMCode* m_code;
+  unsigned int m_pc;
+  ScvalVMContext m_ctx;
+  ScvalCheckTable m_checks;
+};
+
+template<typename Hook>
+bool ScvalVMT<Hook>::Validate( Hook& hook )
+{
+  const ScvalVMCode* code = m_code;
+  // the custom types without check need a hook checking them
+  if ( !code || ( m_checks.m_hookCalls && !hook.Checks() ) )
+    return false;
+  m_ctx.Reset();
+  m_ctx.m_stableStrings = hook.StableStrings();
+  Exec exec( hook, m_checks, m_ctx );
+  return ScvalRunSwitch( exec, code, m_ctx, m_pc, false );
+}
+
+#endif
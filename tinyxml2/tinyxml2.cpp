@@ -29,6 +29,31 @@ distribution.
 #else
 #   include <cstddef>
 #endif
+#if defined(_WIN32)
+#   ifndef WIN32_LEAN_AND_MEAN
+#       define WIN32_LEAN_AND_MEAN
+#   endif
+#   include <windows.h>
+#else
+#   include <sys/mman.h>
+#   include <sys/stat.h>
+#   include <fcntl.h>
+#   include <unistd.h>
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || ( defined(_M_IX86_FP) && _M_IX86_FP >= 2 )
+#   define TIXML_SSE2
+#   include <emmintrin.h>
+#   if defined(_MSC_VER)
+#       include <intrin.h>
+#       if _MSC_VER >= 1700
+#           define TIXML_AVX2
+#           include <immintrin.h>
+#       endif
+#   elif defined(__clang__) || ( defined(__GNUC__) && ( __GNUC__ > 4 || ( __GNUC__ == 4 && __GNUC_MINOR__ >= 9 ) ) )
+#       define TIXML_AVX2
+#       include <immintrin.h>
+#   endif
+#endif
 
 static const char LINE_FEED				= (char)0x0a;			// all line endings are normalized to LF
 static const char LF = LINE_FEED;
@@ -117,8 +142,8 @@ char* StrPair::ParseText( char* p, const char* endTag, int strFlags )
     size_t length = strlen( endTag );
 
     // Inner loop of text parsing.
-    while ( *p ) {
-        if ( *p == endChar && strncmp( p, endTag, length ) == 0 ) {
+    while ( *( p = const_cast<char*>( XMLUtil::FindChar( p, endChar ) ) ) ) {
+        if ( strncmp( p, endTag, length ) == 0 ) {
             Set( start, p, strFlags );
             return p + length;
         }
@@ -136,11 +161,8 @@ char* StrPair::ParseName( char* p )
         return 0;
     }
 
-    while( *p && ( p == start ? XMLUtil::IsNameStartChar( *p ) : XMLUtil::IsNameChar( *p ) )) {
-        ++p;
-    }
-
-    if ( p > start ) {
+    if ( XMLUtil::IsNameStartChar( *p ) ) {
+        p = const_cast<char*>( XMLUtil::SkipNameChars( p+1 ) );
         Set( start, p, 0 );
         return p;
     }
@@ -171,6 +193,10 @@ void StrPair::CollapseWhitespace()
             ++p;
         }
         *q = 0;
+        _end = q;
+    }
+    else {
+        _end = _start;
     }
 }
 
@@ -181,7 +207,7 @@ const char* StrPair::GetStr()
         *_end = 0;
         _flags ^= NEEDS_FLUSH;
 
-        if ( _flags ) {
+        if ( _flags & NEEDS_PROCESSING ) {
             char* p = _start;	// the read pointer
             char* q = _start;	// the write pointer
 
@@ -215,10 +241,19 @@ const char* StrPair::GetStr()
 
                     if ( *(p+1) == '#' ) {
                         char buf[10] = { 0 };
-                        int len;
-                        p = const_cast<char*>( XMLUtil::GetCharacterRef( p, buf, &len ) );
-                        for( int i=0; i<len; ++i ) {
-                            *q++ = buf[i];
+                        int len = 0;
+                        char* adjusted = const_cast<char*>( XMLUtil::GetCharacterRef( p, buf, &len ) );
+                        if ( adjusted == 0 ) {
+                            // not a character reference, copied as is
+                            *q = *p;
+                            ++p;
+                            ++q;
+                        }
+                        else {
+                            p = adjusted;
+                            for( int i=0; i<len; ++i ) {
+                                *q++ = buf[i];
+                            }
                         }
                         TIXMLASSERT( q <= p );
                     }
@@ -248,22 +283,256 @@ const char* StrPair::GetStr()
                 }
             }
             *q = 0;
+            _end = q;
         }
         // The loop below has plenty going on, and this
         // is a less useful mode. Break it out.
         if ( _flags & COLLAPSE_WHITESPACE ) {
             CollapseWhitespace();
         }
-        _flags = (_flags & NEEDS_DELETE);
+        _flags = (_flags & (NEEDS_DELETE|HASHED));
     }
     return _start;
 }
 
 
+const char* StrPair::GetStr( size_t* length )
+{
+    const char* str = GetStr();
+    *length = str ? _end - _start : 0;
+    return str;
+}
+
+
 
 
 // --------- XMLUtil ----------- //
 
+// The scanning loops. The vector ones load aligned blocks, which never cross
+// a page: they may read after the terminating zero, not out of its page.
+static const char* SkipWhiteSpaceScalar( const char* p )
+{
+    while( XMLUtil::IsWhiteSpace( *p ) ) {
+        ++p;
+    }
+    return p;
+}
+
+
+static const char* FindCharScalar( const char* p, char c )
+{
+    while( *p && *p != c ) {
+        ++p;
+    }
+    return p;
+}
+
+
+static const char* SkipNameCharsScalar( const char* p )
+{
+    while( *p && XMLUtil::IsNameChar( *p ) ) {
+        ++p;
+    }
+    return p;
+}
+
+
+#if defined(TIXML_SSE2)
+#if defined(_MSC_VER)
+#   define TIXML_NO_SANITIZE
+#   define TIXML_TARGET_AVX2
+static inline int TIXML_CTZ( unsigned int mask )
+{
+    unsigned long first;
+    _BitScanForward( &first, mask );
+    return (int)first;
+}
+#else
+#   define TIXML_NO_SANITIZE __attribute__((no_sanitize_address))
+#   define TIXML_TARGET_AVX2 __attribute__((target("avx2")))
+#   define TIXML_CTZ( mask ) __builtin_ctz( mask )
+#endif
+
+// Bytes from lo to hi, unsigned
+static inline __m128i InRange16( __m128i v, char lo, char hi )
+{
+    return _mm_cmpeq_epi8( _mm_subs_epu8( _mm_sub_epi8( v, _mm_set1_epi8( lo ) ), _mm_set1_epi8( (char)(hi-lo) ) ), _mm_setzero_si128() );
+}
+
+
+// ' ', and '\t' to '\r' as isspace
+static inline __m128i WhiteSpace16( __m128i v )
+{
+    return _mm_or_si128( _mm_cmpeq_epi8( v, _mm_set1_epi8( ' ' ) ), InRange16( v, '\t', '\r' ) );
+}
+
+
+// Letters, digits, '-', '.', ':', '_' and UTF-8 (high bit set) as IsNameChar
+static inline __m128i NameChars16( __m128i v )
+{
+    const __m128i letters = InRange16( _mm_or_si128( v, _mm_set1_epi8( 0x20 ) ), 'a', 'z' );
+    const __m128i digits = InRange16( v, '0', '9' );
+    const __m128i punct = _mm_or_si128( InRange16( v, '-', '.' ),
+                                        _mm_or_si128( _mm_cmpeq_epi8( v, _mm_set1_epi8( ':' ) ), _mm_cmpeq_epi8( v, _mm_set1_epi8( '_' ) ) ) );
+    const __m128i utf8 = _mm_cmplt_epi8( v, _mm_setzero_si128() );
+    return _mm_or_si128( _mm_or_si128( letters, digits ), _mm_or_si128( punct, utf8 ) );
+}
+
+
+#define TIXML_SCAN16( p, stopMask )	{															\
+    const char* block = reinterpret_cast<const char*>( reinterpret_cast<size_t>( p ) & ~size_t( 15 ) );	\
+    __m128i v = _mm_load_si128( reinterpret_cast<const __m128i*>( block ) );							\
+    unsigned int mask = ( stopMask ) & ( 0xffffu << ( p - block ) ) & 0xffffu;						\
+    while ( !mask ) {																				\
+        block += 16;																				\
+        v = _mm_load_si128( reinterpret_cast<const __m128i*>( block ) );							\
+        mask = ( stopMask ) & 0xffffu;																\
+    }																								\
+    return block + TIXML_CTZ( mask );																\
+}
+
+
+TIXML_NO_SANITIZE static const char* SkipWhiteSpaceSSE2( const char* p )
+{
+    TIXML_SCAN16( p, ~(unsigned int)_mm_movemask_epi8( WhiteSpace16( v ) ) );
+}
+
+
+TIXML_NO_SANITIZE static const char* FindCharSSE2( const char* p, char c )
+{
+    const __m128i vc = _mm_set1_epi8( c );
+    TIXML_SCAN16( p, (unsigned int)_mm_movemask_epi8( _mm_or_si128( _mm_cmpeq_epi8( v, vc ), _mm_cmpeq_epi8( v, _mm_setzero_si128() ) ) ) );
+}
+
+
+TIXML_NO_SANITIZE static const char* SkipNameCharsSSE2( const char* p )
+{
+    TIXML_SCAN16( p, ~(unsigned int)_mm_movemask_epi8( NameChars16( v ) ) );
+}
+#endif
+
+
+#if defined(TIXML_AVX2)
+TIXML_TARGET_AVX2 static inline __m256i InRange32( __m256i v, char lo, char hi )
+{
+    return _mm256_cmpeq_epi8( _mm256_subs_epu8( _mm256_sub_epi8( v, _mm256_set1_epi8( lo ) ), _mm256_set1_epi8( (char)(hi-lo) ) ), _mm256_setzero_si256() );
+}
+
+
+TIXML_TARGET_AVX2 static inline __m256i WhiteSpace32( __m256i v )
+{
+    return _mm256_or_si256( _mm256_cmpeq_epi8( v, _mm256_set1_epi8( ' ' ) ), InRange32( v, '\t', '\r' ) );
+}
+
+
+TIXML_TARGET_AVX2 static inline __m256i NameChars32( __m256i v )
+{
+    const __m256i letters = InRange32( _mm256_or_si256( v, _mm256_set1_epi8( 0x20 ) ), 'a', 'z' );
+    const __m256i digits = InRange32( v, '0', '9' );
+    const __m256i punct = _mm256_or_si256( InRange32( v, '-', '.' ),
+                                           _mm256_or_si256( _mm256_cmpeq_epi8( v, _mm256_set1_epi8( ':' ) ), _mm256_cmpeq_epi8( v, _mm256_set1_epi8( '_' ) ) ) );
+    const __m256i utf8 = _mm256_cmpgt_epi8( _mm256_setzero_si256(), v );
+    return _mm256_or_si256( _mm256_or_si256( letters, digits ), _mm256_or_si256( punct, utf8 ) );
+}
+
+
+#define TIXML_SCAN32( p, stopMask )	{															\
+    const char* block = reinterpret_cast<const char*>( reinterpret_cast<size_t>( p ) & ~size_t( 31 ) );	\
+    __m256i v = _mm256_load_si256( reinterpret_cast<const __m256i*>( block ) );						\
+    unsigned int mask = ( stopMask ) & ( 0xffffffffu << ( p - block ) );								\
+    while ( !mask ) {																				\
+        block += 32;																				\
+        v = _mm256_load_si256( reinterpret_cast<const __m256i*>( block ) );							\
+        mask = ( stopMask );																		\
+    }																								\
+    return block + TIXML_CTZ( mask );																\
+}
+
+
+TIXML_NO_SANITIZE TIXML_TARGET_AVX2 static const char* SkipWhiteSpaceAVX2( const char* p )
+{
+    TIXML_SCAN32( p, ~(unsigned int)_mm256_movemask_epi8( WhiteSpace32( v ) ) );
+}
+
+
+TIXML_NO_SANITIZE TIXML_TARGET_AVX2 static const char* FindCharAVX2( const char* p, char c )
+{
+    const __m256i vc = _mm256_set1_epi8( c );
+    TIXML_SCAN32( p, (unsigned int)_mm256_movemask_epi8( _mm256_or_si256( _mm256_cmpeq_epi8( v, vc ), _mm256_cmpeq_epi8( v, _mm256_setzero_si256() ) ) ) );
+}
+
+
+TIXML_NO_SANITIZE TIXML_TARGET_AVX2 static const char* SkipNameCharsAVX2( const char* p )
+{
+    TIXML_SCAN32( p, ~(unsigned int)_mm256_movemask_epi8( NameChars32( v ) ) );
+}
+#endif
+
+
+static XMLUtil::ScanMode BestScanMode()
+{
+#if defined(TIXML_AVX2)
+#   if defined(_MSC_VER)
+    int info[4];
+    __cpuid( info, 0 );
+    if ( info[0] >= 7 ) {
+        __cpuid( info, 1 );
+        // AVX2, with the registers saved by the OS
+        const bool osxsave = ( info[2] & ( 1 << 27 ) ) != 0;
+        __cpuidex( info, 7, 0 );
+        if ( osxsave && ( info[1] & ( 1 << 5 ) ) && ( _xgetbv( 0 ) & 6 ) == 6 ) {
+            return XMLUtil::SCAN_AVX2;
+        }
+    }
+#   else
+    __builtin_cpu_init();
+    if ( __builtin_cpu_supports( "avx2" ) ) {
+        return XMLUtil::SCAN_AVX2;
+    }
+#   endif
+#endif
+#if defined(TIXML_SSE2)
+    return XMLUtil::SCAN_SSE2;
+#else
+    return XMLUtil::SCAN_SCALAR;
+#endif
+}
+
+
+const char* (*XMLUtil::_skipWhiteSpace)( const char* p ) = SkipWhiteSpaceScalar;
+const char* (*XMLUtil::_findChar)( const char* p, char c ) = FindCharScalar;
+const char* (*XMLUtil::_skipNameChars)( const char* p ) = SkipNameCharsScalar;
+XMLUtil::ScanMode XMLUtil::_scanMode = XMLUtil::SetScanMode( XMLUtil::SCAN_AUTO );
+
+
+XMLUtil::ScanMode XMLUtil::SetScanMode( ScanMode mode )
+{
+    static const ScanMode best = BestScanMode();
+    if ( mode == SCAN_AUTO || mode > best ) {
+        mode = best;
+    }
+    _skipWhiteSpace = SkipWhiteSpaceScalar;
+    _findChar = FindCharScalar;
+    _skipNameChars = SkipNameCharsScalar;
+#if defined(TIXML_SSE2)
+    if ( mode == SCAN_SSE2 ) {
+        _skipWhiteSpace = SkipWhiteSpaceSSE2;
+        _findChar = FindCharSSE2;
+        _skipNameChars = SkipNameCharsSSE2;
+    }
+#endif
+#if defined(TIXML_AVX2)
+    if ( mode == SCAN_AVX2 ) {
+        _skipWhiteSpace = SkipWhiteSpaceAVX2;
+        _findChar = FindCharAVX2;
+        _skipNameChars = SkipNameCharsAVX2;
+    }
+#endif
+    _scanMode = mode;
+    return mode;
+}
+
+
 const char* XMLUtil::ReadBOM( const char* p, bool* bom )
 {
     *bom = false;
@@ -603,6 +872,7 @@ void XMLNode::SetValue( const char* str, bool staticMem )
     }
     else {
         _value.SetStr( str );
+        _document->_ownedStrings = true;
     }
 }
 
@@ -1227,6 +1497,26 @@ const char* XMLElement::GetText() const
 }
 
 
+const char* XMLElement::GetText( size_t* length ) const
+{
+    if ( FirstChild() && FirstChild()->ToText() ) {
+        return FirstChild()->ToText()->Value( length );
+    }
+    *length = 0;
+    return 0;
+}
+
+
+const char* XMLElement::GetRawText( size_t* length ) const
+{
+    if ( FirstChild() && FirstChild()->ToText() ) {
+        return FirstChild()->ToText()->RawValue( length );
+    }
+    *length = 0;
+    return 0;
+}
+
+
 XMLError XMLElement::QueryIntText( int* ival ) const
 {
     if ( FirstChild() && FirstChild()->ToText() ) {
@@ -1304,6 +1594,7 @@ XMLAttribute* XMLElement::FindOrCreateAttribute( const char* name )
             break;
         }
     }
+    _document->_ownedStrings = true;
     if ( !attrib ) {
         attrib = new (_document->_attributePool.Alloc() ) XMLAttribute();
         attrib->_memPool = &_document->_attributePool;
@@ -1359,6 +1650,9 @@ char* XMLElement::ParseAttributes( char* p )
 			attrib->_memPool->SetTracked();
 
             p = attrib->ParseDeep( p, _document->ProcessEntities() );
+            if ( p && _document->_hashNames ) {
+                _document->HashName( attrib->_name );
+            }
             if ( !p || Attribute( attrib->Name() ) ) {
                 DELETE_ATTRIBUTE( attrib );
                 _document->SetError( XML_ERROR_PARSING_ATTRIBUTE, start, p );
@@ -1420,6 +1714,9 @@ char* XMLElement::ParseDeep( char* p, StrPair* strPair )
     if ( _value.Empty() ) {
         return 0;
     }
+    if ( !_closingType && _document->_hashNames ) {
+        _document->HashName( _value );
+    }
 
     p = ParseAttributes( p );
     if ( !p || !*p || _closingType ) {
@@ -1483,6 +1780,80 @@ bool XMLElement::Accept( XMLVisitor* visitor ) const
 }
 
 
+// Maps the file copy on write, for the parser to work on it in place. The
+// parser stops at a null char, so the mapping ends with one after the file.
+#if defined(_WIN32)
+static char* MapFile( const char* filename, size_t* mappingSize )
+{
+    HANDLE file = CreateFileA( filename, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, 0 );
+    if ( file == INVALID_HANDLE_VALUE ) {
+        return 0;
+    }
+    char* view = 0;
+    LARGE_INTEGER size;
+    SYSTEM_INFO info;
+    GetSystemInfo( &info );
+    // the rest of the last page is zero, unless the file fills it
+    if ( GetFileSizeEx( file, &size ) && size.QuadPart > 0 && (unsigned long long)size.QuadPart < (size_t)-1
+         && size.QuadPart % info.dwPageSize ) {
+        HANDLE mapping = CreateFileMappingA( file, 0, PAGE_WRITECOPY, 0, 0, 0 );
+        if ( mapping ) {
+            view = (char*)MapViewOfFile( mapping, FILE_MAP_COPY, 0, 0, 0 );
+            CloseHandle( mapping );
+        }
+        *mappingSize = (size_t)size.QuadPart;
+    }
+    CloseHandle( file );
+    return view;
+}
+
+
+static void UnmapFile( char* view, size_t /*mappingSize*/ )
+{
+    if ( view ) {
+        UnmapViewOfFile( view );
+    }
+}
+#else
+static char* MapFile( const char* filename, size_t* mappingSize )
+{
+    int fd = open( filename, O_RDONLY );
+    if ( fd < 0 ) {
+        return 0;
+    }
+    char* view = 0;
+    struct stat st;
+    if ( fstat( fd, &st ) == 0 && st.st_size > 0 ) {
+        // zero pages reserved past the file (at least a byte), the file mapped over them
+        const size_t page = (size_t)sysconf( _SC_PAGESIZE );
+        const size_t size = (size_t)st.st_size;
+        const size_t areaSize = (size/page+1)*page;
+        void* area = mmap( 0, areaSize, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANON, -1, 0 );
+        if ( area != MAP_FAILED ) {
+            if ( mmap( area, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_FIXED, fd, 0 ) != MAP_FAILED ) {
+                madvise( area, size, MADV_SEQUENTIAL );
+                view = (char*)area;
+                *mappingSize = areaSize;
+            }
+            else {
+                munmap( area, areaSize );
+            }
+        }
+    }
+    close( fd );
+    return view;
+}
+
+
+static void UnmapFile( char* view, size_t mappingSize )
+{
+    if ( view ) {
+        munmap( view, mappingSize );
+    }
+}
+#endif
+
+
 // --------- XMLDocument ----------- //
 XMLDocument::XMLDocument( bool processEntities, Whitespace whitespace ) :
     XMLNode( 0 ),
@@ -1492,7 +1863,17 @@ XMLDocument::XMLDocument( bool processEntities, Whitespace whitespace ) :
     _whitespace( whitespace ),
     _errorStr1( 0 ),
     _errorStr2( 0 ),
-    _charBuffer( 0 )
+    _charBuffer( 0 ),
+    _charBufferSize( 0 ),
+    _arena( false ),
+    _ownedStrings( false ),
+    _mapping( 0 ),
+    _mappingSize( 0 ),
+    _hashNames( false ),
+    _internNames( false ),
+    _names( 0 ),
+    _namesCap( 0 ),
+    _namesCount( 0 )
 {
     _document = this;	// avoid warning about 'this' in initializer list
 }
@@ -1502,6 +1883,8 @@ XMLDocument::~XMLDocument()
 {
     DeleteChildren();
     delete [] _charBuffer;
+    UnmapFile( _mapping, _mappingSize );
+    delete [] _names;
 
 #if 0
     _textPool.Trace( "text" );
@@ -1523,14 +1906,82 @@ XMLDocument::~XMLDocument()
 
 void XMLDocument::Clear()
 {
-    DeleteChildren();
+    if ( _arena && !_ownedStrings ) {
+        // the nodes own nothing, the pools forget them at once
+        _firstChild = _lastChild = 0;
+        _elementPool.Reset();
+        _attributePool.Reset();
+        _textPool.Reset();
+        _commentPool.Reset();
+    }
+    else {
+        DeleteChildren();
+    }
+    _ownedStrings = false;
 
     _errorID = XML_NO_ERROR;
     _errorStr1 = 0;
     _errorStr2 = 0;
 
-    delete [] _charBuffer;
-    _charBuffer = 0;
+    if ( !_arena ) {
+        delete [] _charBuffer;
+        _charBuffer = 0;
+        _charBufferSize = 0;
+    }
+    UnmapFile( _mapping, _mappingSize );
+    _mapping = 0;
+
+    // the interned names point to the buffer
+    for( int i=0; i<_namesCap; ++i ) {
+        _names[i].start = 0;
+    }
+    _namesCount = 0;
+}
+
+
+void XMLDocument::HashName( StrPair& name )
+{
+    const size_t len = name._end - name._start;
+    const unsigned int hash = XMLUtil::HashName( name._start, len );
+    if ( _internNames ) {
+        if ( _namesCount*2 >= _namesCap ) {
+            // grow and rehash, keeping the load under one half
+            int cap = _namesCap ? _namesCap*2 : 64;
+            Name* names = new Name[cap];
+            for( int i=0; i<cap; ++i ) {
+                names[i].start = 0;
+            }
+            for( int i=0; i<_namesCap; ++i ) {
+                if ( _names[i].start ) {
+                    int j = _names[i].hash & (cap-1);
+                    while ( names[j].start ) {
+                        j = (j+1) & (cap-1);
+                    }
+                    names[j] = _names[i];
+                }
+            }
+            delete [] _names;
+            _names = names;
+            _namesCap = cap;
+        }
+        int i = hash & (_namesCap-1);
+        while ( _names[i].start ) {
+            const Name& n = _names[i];
+            if ( n.hash == hash && (size_t)(n.end - n.start) == len && memcmp( n.start, name._start, len ) == 0 ) {
+                name.Set( n.start, n.end, 0 );
+                break;
+            }
+            i = (i+1) & (_namesCap-1);
+        }
+        if ( !_names[i].start ) {
+            _names[i].start = name._start;
+            _names[i].end = name._end;
+            _names[i].hash = hash;
+            ++_namesCount;
+        }
+    }
+    name._hash = hash;
+    name._flags |= StrPair::HASHED;
 }
 
 
@@ -1613,7 +2064,7 @@ XMLError XMLDocument::LoadFile( FILE* fp )
         return _errorID;
     }
 
-    _charBuffer = new char[size+1];
+    ReserveCharBuffer( size+1 );
     size_t read = fread( _charBuffer, 1, size, fp );
     if ( read != size ) {
         SetError( XML_ERROR_FILE_READ_ERROR, 0, 0 );
@@ -1635,6 +2086,38 @@ XMLError XMLDocument::LoadFile( FILE* fp )
 }
 
 
+void XMLDocument::ReserveCharBuffer( size_t size )
+{
+    if ( _charBufferSize < size ) {
+        delete [] _charBuffer;
+        _charBuffer = new char[size];
+        _charBufferSize = size;
+    }
+}
+
+
+XMLError XMLDocument::LoadFileMapped( const char* filename )
+{
+    Clear();
+
+    _mapping = MapFile( filename, &_mappingSize );
+    if ( !_mapping ) {
+        return LoadFile( filename );
+    }
+
+    const char* p = _mapping;
+    p = XMLUtil::SkipWhiteSpace( p );
+    p = XMLUtil::ReadBOM( p, &_writeBOM );
+    if ( !p || !*p ) {
+        SetError( XML_ERROR_EMPTY_DOCUMENT, 0, 0 );
+        return _errorID;
+    }
+
+    ParseDeep( _mapping + (p-_mapping), 0 );
+    return _errorID;
+}
+
+
 XMLError XMLDocument::SaveFile( const char* filename, bool compact )
 {
     FILE* fp = 0;
@@ -1674,7 +2157,7 @@ XMLError XMLDocument::Parse( const char* p, size_t len )
     if ( len == (size_t)(-1) ) {
         len = strlen( p );
     }
-    _charBuffer = new char[ len+1 ];
+    ReserveCharBuffer( len+1 );
     memcpy( _charBuffer, p, len );
     _charBuffer[len] = 0;
 
@@ -123,6 +123,7 @@ class XMLPrinter;
 */
 class StrPair
 {
+    friend class XMLDocument;
 public:
     enum {
         NEEDS_ENTITY_PROCESSING			= 0x01,
@@ -137,7 +138,7 @@ public:
         COMMENT				        = NEEDS_NEWLINE_NORMALIZATION
     };
 
-    StrPair() : _flags( 0 ), _start( 0 ), _end( 0 ) {}
+    StrPair() : _flags( 0 ), _start( 0 ), _end( 0 ), _hash( 0 ) {}
     ~StrPair();
 
     void Set( char* start, char* end, int flags ) {
@@ -148,14 +149,33 @@ public:
     }
 
     const char* GetStr();
+    // Same, also returning the length of the string
+    const char* GetStr( size_t* length );
+    // The string as it is in the document until GetStr processes it: the
+    // entities and new lines are left as they are, and it isn't terminated.
+    const char* GetRaw( size_t* length ) const {
+        *length = _start ? _end - _start : 0;
+        return _start;
+    }
 
     bool Empty() const {
         return _start == _end;
     }
 
+    // Hash of the name computed while parsing, in the name hashing
+    // mode (see XMLDocument::SetNameHashing). False if there is none.
+    bool GetHash( unsigned int* hash ) const {
+        if ( !(_flags & HASHED) ) {
+            return false;
+        }
+        *hash = _hash;
+        return true;
+    }
+
     void SetInternedStr( const char* str ) {
         Reset();
         _start = const_cast<char*>(str);
+        _end = _start + strlen( str );
     }
 
     void SetStr( const char* str, int flags=0 );
@@ -169,13 +189,16 @@ private:
 
     enum {
         NEEDS_FLUSH = 0x100,
-        NEEDS_DELETE = 0x200
+        NEEDS_DELETE = 0x200,
+        HASHED = 0x400,
+        NEEDS_PROCESSING = NEEDS_ENTITY_PROCESSING | NEEDS_NEWLINE_NORMALIZATION | COLLAPSE_WHITESPACE
     };
 
     // After parsing, if *_end != 0, it can be set to zero.
     int     _flags;
     char*   _start;
     char*   _end;
+    unsigned int _hash;
 };
 
 
@@ -296,7 +319,7 @@ template< int SIZE >
 class MemPoolT : public MemPool
 {
 public:
-    MemPoolT() : _root(0), _currentAllocs(0), _nAllocs(0), _maxAllocs(0), _nUntracked(0)	{}
+    MemPoolT() : _root(0), _bumpBlock(0), _bumpItem(0), _currentAllocs(0), _nAllocs(0), _maxAllocs(0), _nUntracked(0)	{}
     ~MemPoolT() {
         // Delete the blocks.
         for( int i=0; i<_blockPtrs.Size(); ++i ) {
@@ -312,19 +335,22 @@ public:
     }
 
     virtual void* Alloc() {
-        if ( !_root ) {
-            // Need a new block.
-            Block* block = new Block();
-            _blockPtrs.Push( block );
-
-            for( int i=0; i<COUNT-1; ++i ) {
-                block->chunk[i].next = &block->chunk[i+1];
+        void* result = _root;
+        if ( _root ) {
+            _root = _root->next;
+        }
+        else {
+            // The chunks of the blocks are handed out in order, the
+            // freed ones first. Need a new block past the last one.
+            if ( _bumpBlock == _blockPtrs.Size() ) {
+                _blockPtrs.Push( new Block() );
+            }
+            result = &_blockPtrs[_bumpBlock]->chunk[_bumpItem];
+            if ( ++_bumpItem == COUNT ) {
+                ++_bumpBlock;
+                _bumpItem = 0;
             }
-            block->chunk[COUNT-1].next = 0;
-            _root = block->chunk;
         }
-        void* result = _root;
-        _root = _root->next;
 
         ++_currentAllocs;
         if ( _currentAllocs > _maxAllocs ) {
@@ -346,6 +372,19 @@ public:
         chunk->next = _root;
         _root = chunk;
     }
+    // Forgets all the items at once, without freeing them. The blocks
+    // are kept for the next allocations.
+    void Reset() {
+        _root = 0;
+        _bumpBlock = 0;
+        _bumpItem = 0;
+        _currentAllocs = 0;
+        _nUntracked = 0;
+    }
+    int Blocks() const {
+        return _blockPtrs.Size();
+    }
+
     void Trace( const char* name ) {
         printf( "Mempool %s watermark=%d [%dk] current=%d size=%d nAlloc=%d blocks=%d\n",
                 name, _maxAllocs, _maxAllocs*SIZE/1024, _currentAllocs, SIZE, _nAllocs, _blockPtrs.Size() );
@@ -380,6 +419,8 @@ private:
     };
     DynArray< Block*, 10 > _blockPtrs;
     Chunk* _root;
+    int _bumpBlock;     // next chunk never handed out
+    int _bumpItem;
 
     int _currentAllocs;
     int _nAllocs;
@@ -459,16 +500,40 @@ public:
     // Anything in the high order range of UTF-8 is assumed to not be whitespace. This isn't
     // correct, but simple, and usually works.
     static const char* SkipWhiteSpace( const char* p )	{
-        while( !IsUTF8Continuation(*p) && isspace( *reinterpret_cast<const unsigned char*>(p) ) ) {
-            ++p;
+        // most of the times there's none, the run is searched when there is
+        if ( IsWhiteSpace( *p ) ) {
+            p = _skipWhiteSpace( p+1 );
         }
         return p;
     }
     static char* SkipWhiteSpace( char* p )				{
-        while( !IsUTF8Continuation(*p) && isspace( *reinterpret_cast<unsigned char*>(p) ) )		{
-            ++p;
-        }
-        return p;
+        return const_cast<char*>( SkipWhiteSpace( const_cast<const char*>( p ) ) );
+    }
+    // The first c from p, or the terminating zero.
+    static const char* FindChar( const char* p, char c ) {
+        return _findChar( p, c );
+    }
+    // After the name chars (IsNameChar) from p.
+    static const char* SkipNameChars( const char* p ) {
+        return _skipNameChars( p );
+    }
+
+    /** The scanning of the text (SkipWhiteSpace, FindChar, SkipNameChars)
+        goes 16 bytes at a time with SSE2 or 32 with AVX2, the best one the
+        CPU supports. All the modes give the same result, as the scalar one
+        in the "C" locale. SetScanMode forces one (the best one supported
+        when the CPU doesn't have it), and returns the mode set. Not while
+        parsing.
+    */
+    enum ScanMode {
+        SCAN_AUTO,
+        SCAN_SCALAR,
+        SCAN_SSE2,
+        SCAN_AVX2
+    };
+    static ScanMode SetScanMode( ScanMode mode );
+    static ScanMode GetScanMode()	{
+        return _scanMode;
     }
     static bool IsWhiteSpace( char p )					{
         return !IsUTF8Continuation(p) && isspace( static_cast<unsigned char>(p) );
@@ -487,6 +552,15 @@ public:
                || ch == '-';
     }
 
+    // Hash of a name, the same function as ScvalHash of scval (djb2 xor).
+    inline static unsigned int HashName( const char* p, size_t len ) {
+        int hash = 5381;
+        for( size_t i=0; i<len; ++i ) {
+            hash = ((hash << 5) + hash) ^ p[i];
+        }
+        return (unsigned int)hash;
+    }
+
     inline static bool StringEqual( const char* p, const char* q, int nChar=INT_MAX )  {
         int n = 0;
         if ( p == q ) {
@@ -526,6 +600,12 @@ public:
     static bool	ToBool( const char* str, bool* value );
     static bool	ToFloat( const char* str, float* value );
     static bool ToDouble( const char* str, double* value );
+
+private:
+    static const char* (*_skipWhiteSpace)( const char* p );
+    static const char* (*_findChar)( const char* p, char c );
+    static const char* (*_skipNameChars)( const char* p );
+    static ScanMode _scanMode;
 };
 
 
@@ -625,6 +705,17 @@ public:
     const char* Value() const			{
         return _value.GetStr();
     }
+    /// Value(), also returning its length.
+    const char* Value( size_t* length ) const	{
+        return _value.GetStr( length );
+    }
+    /** The value as it is in the document, without processing the entities
+        nor the new lines (unless Value() was called before). It isn't null
+        terminated, use the length.
+    */
+    const char* RawValue( size_t* length ) const	{
+        return _value.GetRaw( length );
+    }
 
     /** Set the Value of an XML node.
     	@sa Value()
@@ -996,10 +1087,26 @@ public:
     const char* Name() const {
         return _name.GetStr();
     }
+    /// The name of the attribute, also returning its length.
+    const char* Name( size_t* length ) const {
+        return _name.GetStr( length );
+    }
+    /// The hash of the name computed while parsing (see XMLDocument::SetNameHashing). False if there is none.
+    bool NameHash( unsigned int* hash ) const {
+        return _name.GetHash( hash );
+    }
     /// The value of the attribute.
     const char* Value() const {
         return _value.GetStr();
     }
+    /// The value of the attribute, also returning its length.
+    const char* Value( size_t* length ) const {
+        return _value.GetStr( length );
+    }
+    /// The value as it is in the document, not processed nor null terminated (see XMLNode::RawValue).
+    const char* RawValue( size_t* length ) const {
+        return _value.GetRaw( length );
+    }
     /// The next attribute in the list.
     const XMLAttribute* Next() const {
         return _next;
@@ -1098,6 +1205,14 @@ public:
     const char* Name() const		{
         return Value();
     }
+    /// Name(), also returning its length.
+    const char* Name( size_t* length ) const	{
+        return Value( length );
+    }
+    /// The hash of the name computed while parsing (see XMLDocument::SetNameHashing). False if there is none.
+    bool NameHash( unsigned int* hash ) const	{
+        return _value.GetHash( hash );
+    }
     /// Set the name of the element.
     void SetName( const char* str, bool staticMem=false )	{
         SetValue( str, staticMem );
@@ -1329,6 +1444,10 @@ public:
     	GetText() will return "This is ".
     */
     const char* GetText() const;
+    /// GetText(), also returning the length of the text (0 when there is no text).
+    const char* GetText( size_t* length ) const;
+    /// GetText() as it is in the document, not processed nor null terminated (see XMLNode::RawValue).
+    const char* GetRawText( size_t* length ) const;
 
     /**
     	Convenience method to query the value of a child text node. This is probably best
@@ -1411,6 +1530,7 @@ enum Whitespace {
 */
 class XMLDocument : public XMLNode
 {
+    friend class XMLNode;
     friend class XMLElement;
 public:
     /// constructor
@@ -1452,6 +1572,20 @@ public:
     */
     XMLError LoadFile( FILE* );
 
+    /**
+    	Load an XML file from disk, mapping it in memory instead of
+    	reading it into a buffer. The mapping is copy on write: the
+    	parser works on it in place, so only the pages where strings
+    	are terminated or processed are copied, and the rest of the
+    	file is never read into the heap. The mapping lives until the
+    	document is cleared. Falls back to LoadFile when the file
+    	can't be mapped.
+
+    	Returns XML_NO_ERROR (0) on success, or
+    	an errorID.
+    */
+    XMLError LoadFileMapped( const char* filename );
+
     /**
     	Save the XML file to disk.
     	Returns XML_NO_ERROR (0) on success, or
@@ -1475,6 +1609,44 @@ public:
         return _whitespace;
     }
 
+    /**
+    	Hash the element and attribute names while parsing, with
+    	XMLUtil::HashName, so they can be looked up by hash without
+    	reading them (see XMLElement::NameHash). With 'intern', equal
+    	names share the storage of their first occurrence, found in a
+    	per-document name table. Applies to the next parse.
+    */
+    void SetNameHashing( bool hash, bool intern=false ) {
+        _hashNames = hash;
+        _internNames = hash && intern;
+    }
+    bool NameHashing() const {
+        return _hashNames;
+    }
+
+    /**
+    	Arena mode, for a document reused for many documents: Clear
+    	(and the loads, which clear first) drops all the nodes at once,
+    	keeping the blocks of the pools and the text buffer for the next
+    	document, so the steady state doesn't allocate. Nodes with
+    	strings set by the program (SetValue, SetAttribute...) own them,
+    	those documents are cleared node by node as before.
+    */
+    void SetArena( bool arena ) {
+        _arena = arena;
+    }
+    bool Arena() const {
+        return _arena;
+    }
+    /// Blocks allocated by the pools of the nodes and attributes.
+    int PoolBlocks() const {
+        return _elementPool.Blocks() + _attributePool.Blocks() + _textPool.Blocks() + _commentPool.Blocks();
+    }
+    /// Number of distinct names interned by the last parse.
+    int InternedNames() const {
+        return _namesCount;
+    }
+
     /**
     	Returns true if this document has a leading Byte Order Mark of UTF8.
     */
@@ -1585,6 +1757,7 @@ public:
 
     // internal
     char* Identify( char* p, XMLNode** node );
+    void HashName( StrPair& name );
 
     virtual XMLNode* ShallowClone( XMLDocument* /*document*/ ) const	{
         return 0;
@@ -1596,6 +1769,7 @@ public:
 private:
     XMLDocument( const XMLDocument& );	// not supported
     void operator=( const XMLDocument& );	// not supported
+    void ReserveCharBuffer( size_t size );
 
     bool        _writeBOM;
     bool        _processEntities;
@@ -1604,6 +1778,23 @@ private:
     const char* _errorStr1;
     const char* _errorStr2;
     char*       _charBuffer;
+    size_t      _charBufferSize;    // kept between documents in arena mode
+    bool        _arena;
+    bool        _ownedStrings;      // some node owns a string, set by the program
+    char*       _mapping;       // of LoadFileMapped, instead of _charBuffer
+    size_t      _mappingSize;
+
+    // name table of the interning mode, open addressing
+    struct Name {
+        char*           start;
+        char*           end;
+        unsigned int    hash;
+    };
+    bool        _hashNames;
+    bool        _internNames;
+    Name*       _names;
+    int         _namesCap;
+    int         _namesCount;
 
     MemPoolT< sizeof(XMLElement) >	 _elementPool;
     MemPoolT< sizeof(XMLAttribute) > _attributePool;
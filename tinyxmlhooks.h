@@ -0,0 +1,282 @@
+#ifndef _TINYXMLHOOKS_H_
+#define _TINYXMLHOOKS_H_
+#include "scvaltypes.h"
+#include "tinyxml2/tinyxml2.h"
+#include <stack>
+#include <ctype.h>
+
+// Provide callbacks for specific operations in the validator,
+// based on TinyXML library. One method per operation, statically
+// bound by ScvalVMT<TinyXMLHooks>; ScvalInstHookT adds the virtual
+// interface for ScvalVM.
+// The document is in arena mode (see XMLDocument::SetArena): a hook
+// reused for many documents (Parse, LoadFile) keeps its memory between
+// them instead of allocating it again.
+class TinyXMLHooks : public ScvalInstHookT<TinyXMLHooks>
+{
+public:
+  TinyXMLHooks() : m_xmlElmt(0), m_xmlAttr(0), m_last(0), m_batching(false)
+  {
+    doc.SetNameHashing( true, true );
+    doc.SetArena( true );
+  }
+  TinyXMLHooks(const char* xmlfile) : m_xmlElmt(0), m_xmlAttr(0), m_last(0), m_batching(false)
+  {
+    doc.SetNameHashing( true, true );
+    doc.SetArena( true );
+    if ( doc.LoadFile(xmlfile) == tinyxml2::XML_SUCCESS )
+      m_xmlElmt = doc.FirstChildElement();
+    else
+      doc.PrintError();
+  }
+  // loads the file read into a buffer, or mapped in memory for the large ones
+  bool LoadFile(const char* xmlfile, bool mapped=false)
+  {
+    if ( (mapped ? doc.LoadFileMapped(xmlfile) : doc.LoadFile(xmlfile)) != tinyxml2::XML_SUCCESS )
+    {
+      doc.PrintError();
+      return false;
+    }
+    Rewind();
+    return true;
+  }
+  // parses the xml from memory instead of a file
+  bool Parse(const char* xmltext)
+  {
+    if ( doc.Parse(xmltext) != tinyxml2::XML_SUCCESS )
+    {
+      doc.PrintError();
+      return false;
+    }
+    Rewind();
+    return true;
+  }
+  // back to the root element, so the same document can be validated again
+  void Rewind()
+  {
+    Slice( doc.FirstChildElement(), NULL );
+  }
+  // Reads the siblings from first to last alone, first being the current
+  // element: a slice of the records of the document of another hook, for a
+  // worker of the parallel validation (see TinyXMLParallelValidator)
+  void Slice( tinyxml2::XMLElement* first, tinyxml2::XMLElement* last )
+  {
+    m_xmlElmt = first;
+    m_xmlAttr = NULL;
+    m_last = last;
+    while ( !m_elmstack.empty() ) 
+      m_elmstack.pop();
+  }
+  // The current element, or the one the VM is down in when it's past its
+  // last child: where a failed validation stopped
+  const tinyxml2::XMLElement* Current()const
+  {
+    return m_xmlElmt || m_elmstack.empty() ? m_xmlElmt : m_elmstack.top();
+  }
+  int PoolBlocks()const{ return doc.PoolBlocks(); }
+  // names and texts live in the DOM until the document is destroyed
+  virtual bool StableStrings(){ return true; }
+
+  // the parser already knows where the strings end, hand over the length.
+  // Names are hashed (and interned) while parsing, so the VM doesn't read them.
+  void ElementName( ScvalHookString& out ){ LoadName( m_xmlElmt, out ); }
+  void ElementValue( ScvalHookString& out ){ LoadText( m_xmlElmt, out ); }
+  void AttributeName( ScvalHookString& out ){ LoadName( m_xmlAttr, out ); }
+  void AttributeValue( ScvalHookString& out )
+  {
+    size_t len = 0;
+    const char* str = m_xmlAttr ? m_xmlAttr->Value( &len ) : NULL;
+    out.Set( str, (unsigned int)len );
+  }
+  // the str values are not inspected by the VM: the text as it is in the
+  // document, tinyxml2 doesn't decode it (it's still decoded when asked)
+  void ElementRawValue( ScvalHookString& out )
+  {
+    size_t len = 0;
+    const char* str = m_xmlElmt ? m_xmlElmt->GetRawText( &len ) : NULL;
+    out.Set( str, (unsigned int)len );
+  }
+  void AttributeRawValue( ScvalHookString& out )
+  {
+    size_t len = 0;
+    const char* str = m_xmlAttr ? m_xmlAttr->RawValue( &len ) : NULL;
+    out.Set( str, (unsigned int)len );
+  }
+  // The siblings or attributes by windows, the VM walks them. Disabled by
+  // default: moving in the DOM is cheaper than the walk, it pays off when
+  // the calls to the hook are expensive.
+  void EnableBatching( bool enable ){ m_batching = enable; }
+  virtual int Enumerate( ScvalVMOpcode opcode, void* after, ScvalHookItem* items, unsigned int max )
+  {
+    if ( !m_batching )
+      return -1;
+    unsigned int n = 0;
+    if ( opcode == VM_GATT )
+    {
+      const tinyxml2::XMLAttribute* a = after ? ((const tinyxml2::XMLAttribute*)after)->Next() : m_xmlElmt->FirstAttribute();
+      for ( ; a && n < max; a = a->Next(), ++n )
+      {
+        size_t len;
+        const char* str = a->Value( &len );
+        LoadName( a, items[n].name );
+        items[n].value.Set( str, (unsigned int)len );
+        items[n].node = (void*)a;
+      }
+    }
+    else
+    {
+      tinyxml2::XMLElement* e = !after ? m_xmlElmt : after != m_last ? ((tinyxml2::XMLElement*)after)->NextSiblingElement() : NULL;
+      for ( ; e && n < max; e = e != m_last ? e->NextSiblingElement() : NULL, ++n )
+      {
+        LoadName( e, items[n].name );
+        LoadText( e, items[n].value );
+        items[n].node = e;
+      }
+    }
+    return (int)n;
+  }
+  virtual void Select( void* node ){ m_xmlElmt = (tinyxml2::XMLElement*)node; }
+  virtual void* Position( ScvalVMOpcode opcode ){ return opcode == VM_LDAV ? (void*)m_xmlAttr : (void*)m_xmlElmt; }
+  void Down()
+  {
+    m_elmstack.push( m_xmlElmt );
+    m_xmlElmt = m_xmlElmt->FirstChildElement(); 
+  }
+  void Up()
+  {
+    m_xmlElmt = m_elmstack.top();
+    m_elmstack.pop();
+  }
+  void FirstAttribute(){ m_xmlAttr = m_xmlElmt->FirstAttribute(); }
+  void NextAttribute(){ m_xmlAttr = m_xmlAttr->Next(); }
+  void NextElement(){ m_xmlElmt = m_xmlElmt != m_last ? m_xmlElmt->NextSiblingElement() : NULL; }
+  // VM_CALL when the checks are not registered in the VM (ScvalVMT, ahead-of-time)
+  bool Check( ScvalHashID typeName, const char* value )
+  {
+    static const ScvalHashID hAuthor = ScvalHash("AUTHOR");
+    static const ScvalHashID hDate = ScvalHash("DATE");
+    static const ScvalHashID hPrice = ScvalHash("PRICE");
+    const unsigned int len = value ? (unsigned int)strlen(value) : 0;
+    if ( typeName == hAuthor )      return CheckAuthor(value, len, 0);
+    else if ( typeName == hDate )   return CheckDate(value, len, 0);
+    else if ( typeName == hPrice )  return CheckPrice(value, len, 0);
+    return false;
+  }
+  // the checks of the custom types of a batch, when they are deferred
+  static void CheckBatch( ScvalDeferredCheck* checks, unsigned int count, void* user )
+  {
+    static const ScvalHashID hAuthor = ScvalHash("AUTHOR");
+    static const ScvalHashID hDate = ScvalHash("DATE");
+    static const ScvalHashID hPrice = ScvalHash("PRICE");
+    for ( unsigned int i = 0; i < count; ++i )
+    {
+      ScvalDeferredCheck& c = checks[i];
+      if ( c.typeName == hAuthor )      c.result = CheckAuthor(c.value, c.len, user);
+      else if ( c.typeName == hDate )   c.result = CheckDate(c.value, c.len, user);
+      else if ( c.typeName == hPrice )  c.result = CheckPrice(c.value, c.len, user);
+      else c.result = false;
+    }
+  }
+  // the checks of the custom types, resolved by the VM when binding (a
+  // ScvalValidator, a ScvalVMT, or a TinyXMLParallelValidator for all its
+  // VMs), or in a ScvalCheckTable for the ahead-of-time validators
+  template<typename Validator>
+  static bool RegisterChecks( Validator& validator )
+  {
+    return validator.RegisterCheck( ScvalHash("AUTHOR"), CheckAuthor ) &&
+           validator.RegisterCheck( ScvalHash("DATE"), CheckDate ) &&
+           validator.RegisterCheck( ScvalHash("PRICE"), CheckPrice );
+  }
+protected:
+  template<typename Node>
+  static void LoadName( const Node* node, ScvalHookString& out )
+  {
+    size_t len = 0;
+    unsigned int hash;
+    const char* str = node ? node->Name( &len ) : NULL;
+    if ( str && node->NameHash( &hash ) )
+      out.Set( str, (unsigned int)len, hash );
+    else
+      out.Set( str, (unsigned int)len );
+  }
+  static void LoadText( const tinyxml2::XMLElement* elmt, ScvalHookString& out )
+  {
+    size_t len = 0;
+    const char* str = elmt ? elmt->GetText( &len ) : NULL;
+    out.Set( str, (unsigned int)len );
+  }
+  static bool CheckAuthor(const char* /*authorStr*/, unsigned int /*len*/, void* /*user*/)
+  {
+    // might check a DB with Authors (for example)
+
+    return true;
+  }
+  static bool CheckDate(const char* dateStr, unsigned int len, void* /*user*/)
+  {
+    // yyyy-mm-dd
+    if ( len != 10 || dateStr[4] != '-' || dateStr[7] != '-' )
+      return false;
+    for ( unsigned int i = 0; i < len; ++i )
+      if ( i != 4 && i != 7 && !isdigit((unsigned char)dateStr[i]) )
+        return false;
+    return true;
+  }
+  static bool CheckPrice(const char* priceStr, unsigned int len, void* /*user*/)
+  {
+    // digits, with the cents after a point
+    unsigned int i = 0;
+    while ( i < len && isdigit((unsigned char)priceStr[i]) )
+      ++i;
+    if ( !i )
+      return false;
+    if ( i < len && priceStr[i] == '.' )
+      while ( ++i < len && isdigit((unsigned char)priceStr[i]) )
+      {}
+    return i == len;
+  }
+protected:
+  tinyxml2::XMLDocument doc;
+  tinyxml2::XMLElement* m_xmlElmt;
+  const tinyxml2::XMLAttribute* m_xmlAttr;
+  tinyxml2::XMLElement* m_last;      // of the slice, NULL when reading the whole document
+  std::stack<tinyxml2::XMLElement*> m_elmstack;
+  bool m_batching;
+};
+
+// Schema of books.xml, shared by the sample and the ahead-of-time build
+static const char* const g_booksSchema ="\
+  @author #AUTHOR\
+  @date #DATE\
+  @price #PRICE\
+  !catalog\
+  {\
+    *book[id(str)]\
+    {\
+        !author(author)\
+        !title(str)\
+        !genre(str)\
+        !price(price)\
+        !publish_date(date)\
+        !description(str)\
+    }\
+  }";
+
+// The same with typed attributes of the books, for the ahead-of-time cross-check
+static const char* const g_booksTypedSchema ="\
+  @author #AUTHOR\
+  @date #DATE\
+  @price #PRICE\
+  !catalog\
+  {\
+    *book[id(str) ?pages(int) ?rating(real) ?available(bool)]\
+    {\
+        !author(author)\
+        !title(str)\
+        !genre(str)\
+        !price(price)\
+        !publish_date(date)\
+        !description(str)\
+    }\
+  }";
+
+#endif
@@ -0,0 +1,324 @@
+#ifndef _TINYXMLPARALLEL_H_
+#define _TINYXMLPARALLEL_H_
+#include "scvaltypes.h"
+#include "tinyxmlhooks.h"
+#include <vector>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+// Validation of a document loaded in a TinyXMLHooks (or a hook derived
+// from it) by several workers, for the documents made of many records,
+// the children of the root element. The VM stops at the loop of the
+// records (ScvalVM::StartRecords) and the records are split in chunks
+// of consecutive ones, which the workers take in order: each one
+// validates them with its own VM, bound to the loop of the records alone
+// (ScvalRecordsCode), and its own hook reading a slice of the DOM
+// (TinyXMLHooks::Slice). Then the counters of the chunks are added up
+// and the VM goes on after the loop.
+// The first chunk failing in the order of the document decides, the
+// workers don't take the ones after it: the result, and where it failed,
+// are the ones of the validation by a single VM.
+// The DOM is only read, each record by a single worker, but the checks
+// of the custom types (registered or of the hook) are called by the
+// workers at once and have to be thread safe.
+template<typename Hook>
+class TinyXMLParallelValidator
+{
+public:
+  // The caller is one of the workers, the others are threads started here,
+  // waiting for the records of every validation
+  TinyXMLParallelValidator( unsigned int noWorkers, unsigned int chunkSize=64 ) : m_code(0), m_engine(VMENGINE_SWITCH)
+    , m_chunkSize(chunkSize ? chunkSize : 1), m_nextChunk(0), m_firstFailed(0), m_bound(false)
+    , m_failedElmt(0), m_failedRecord(-1), m_batch(0), m_busy(0), m_quit(false)
+  {
+    for ( unsigned int i = 0; i < (noWorkers ? noWorkers : 1); ++i )
+    {
+      m_workers.push_back( new Worker );
+      m_workers.back()->owner = this;
+    }
+#ifdef _WIN32
+    InitializeCriticalSection( &m_lock );
+    InitializeConditionVariable( &m_started );
+    InitializeConditionVariable( &m_done );
+#else
+    pthread_mutex_init( &m_lock, 0 );
+    pthread_cond_init( &m_started, 0 );
+    pthread_cond_init( &m_done, 0 );
+#endif
+    // a worker without its thread is left out, the others take its chunks
+    for ( size_t i = 1; i < m_workers.size(); ++i )
+    {
+      Thread thread;
+#ifdef _WIN32
+      thread = CreateThread( NULL, 0, WorkerMain, m_workers[i], 0, NULL );
+      if ( thread )
+#else
+      if ( pthread_create( &thread, 0, WorkerMain, m_workers[i] ) == 0 )
+#endif
+        m_threads.push_back( thread );
+    }
+  }
+  ~TinyXMLParallelValidator()
+  {
+    Lock();
+    m_quit = true;
+    Unlock();
+    WakeAll( m_started );
+    for ( size_t i = 0; i < m_threads.size(); ++i )
+    {
+#ifdef _WIN32
+      WaitForSingleObject( m_threads[i], INFINITE );
+      CloseHandle( m_threads[i] );
+#else
+      pthread_join( m_threads[i], 0 );
+#endif
+    }
+    for ( size_t i = 0; i < m_workers.size(); ++i )
+      delete m_workers[i];
+#ifdef _WIN32
+    DeleteCriticalSection( &m_lock );
+#else
+    pthread_cond_destroy( &m_done );
+    pthread_cond_destroy( &m_started );
+    pthread_mutex_destroy( &m_lock );
+#endif
+  }
+  // before Bind, as ScvalValidator::RegisterCheck
+  bool RegisterCheck( ScvalHashID typeName, ScvalCheckFunc func, void* user=0 )
+  {
+    bool registered = m_validator.RegisterCheck( typeName, func, user );
+    for ( size_t i = 0; i < m_workers.size(); ++i )
+      registered = m_workers[i]->validator.RegisterCheck( typeName, func, user ) && registered;
+    return registered;
+  }
+  // The workers run the engine on the records, the rest of the document is
+  // interpreted by the switch engine. The code must outlive the binding.
+  bool Bind( const ScvalVMCode& code, ScvalVMEngine engine=VMENGINE_SWITCH )
+  {
+    m_code = &code;
+    m_engine = engine;
+    m_bound = false;
+    return m_validator.Bind( code );
+  }
+  // validates the document of the hook, from its root element
+  bool Validate( Hook& hook )
+  {
+    m_failedElmt = NULL;
+    m_failedRecord = -1;
+    ScvalVMStatus status = m_validator.StartRecords( &hook );
+    while ( status == VMSTATUS_RECORDS )
+    {
+      if ( !BindWorkers( m_validator.GetRecords() ) )
+        status = m_validator.Resume( &hook ); // the loop by this VM
+      else if ( !ValidateRecords( hook ) )
+        return false;
+      else
+        status = m_validator.ResumeRecords( &hook, m_sums.empty() ? NULL : &m_sums[0] );
+    }
+    if ( status != VMSTATUS_VALID )
+      m_failedElmt = hook.Current();
+    return status == VMSTATUS_VALID;
+  }
+  // Where the last validation failed: the element, as TinyXMLHooks::Current
+  // after the validation by a single VM, and the index of the record when
+  // it's in one (-1 otherwise)
+  const tinyxml2::XMLElement* GetFailedElement()const{ return m_failedElmt; }
+  int GetFailedRecord()const{ return m_failedRecord; }
+  unsigned int GetWorkers()const{ return (unsigned int)m_threads.size()+1; }
+
+protected:
+  struct Worker
+  {
+    TinyXMLParallelValidator* owner;
+    ScvalValidator validator;  // bound to the loop of the records
+    Hook hook;                 // a slice of the DOM of the validated hook
+  };
+  struct Chunk
+  {
+    tinyxml2::XMLElement* first;
+    tinyxml2::XMLElement* last;
+    unsigned int record;                 // index of the first record
+    const tinyxml2::XMLElement* failed;  // where its validation failed, NULL when valid
+  };
+  // the workers run the loop of the records the VM stopped at
+  bool BindWorkers( const ScvalVMRecords& records )
+  {
+    if ( m_bound && records.loopPc == m_records.loopPc )
+      return true;
+    m_bound = false;
+    if ( !m_code || !ScvalRecordsCode( *m_code, records, m_recordsCode ) )
+      return false;
+    for ( size_t i = 0; i < m_workers.size(); ++i )
+      if ( !m_workers[i]->validator.Bind( m_recordsCode, m_engine ) )
+        return false;
+    m_records = records;
+    m_bound = true;
+    return true;
+  }
+  // The records from the current element of the hook, by chunks. False
+  // when one of them is not valid, otherwise the counters of the loop are
+  // in m_sums and the hook is past the records, as after the loop.
+  bool ValidateRecords( Hook& hook )
+  {
+    tinyxml2::XMLElement* first = (tinyxml2::XMLElement*)hook.Position( VM_LDEV );
+    m_chunks.clear();
+    unsigned int record = 0;
+    for ( tinyxml2::XMLElement* e = first; e; e = e->NextSiblingElement() )
+    {
+      if ( record++ % m_chunkSize == 0 )
+      {
+        Chunk chunk = { e, e, record-1, NULL };
+        m_chunks.push_back( chunk );
+      }
+      m_chunks.back().last = e;
+    }
+    const unsigned int noCounters = m_records.noCounters;
+    m_counters.assign( m_chunks.size()*noCounters, 0 );
+    m_nextChunk = 0;
+    m_firstFailed = (unsigned int)m_chunks.size();
+    // the caller works too, the threads only when there are chunks left
+    const bool batch = !m_threads.empty() && m_chunks.size() > 1;
+    if ( batch )
+    {
+      Lock();
+      m_busy = (unsigned int)m_threads.size();
+      ++m_batch;
+      Unlock();
+      WakeAll( m_started );
+    }
+    Work( *m_workers[0] );
+    if ( batch )
+    {
+      Lock();
+      while ( m_busy )
+        Wait( m_done );
+      Unlock();
+    }
+    if ( m_firstFailed < m_chunks.size() )
+    {
+      // the record of the element where it failed, a child of the root
+      const Chunk& chunk = m_chunks[m_firstFailed];
+      const tinyxml2::XMLNode* failed = chunk.failed;
+      while ( failed && failed->Parent() != first->Parent() )
+        failed = failed->Parent();
+      m_failedElmt = chunk.failed;
+      m_failedRecord = (int)chunk.record;
+      for ( const tinyxml2::XMLElement* e = chunk.first; e && e != failed; e = e->NextSiblingElement() )
+        ++m_failedRecord;
+      return false;
+    }
+    // the counters wrap around as in a single VM
+    m_sums.assign( noCounters, 0 );
+    for ( size_t c = 0; c < m_chunks.size(); ++c )
+      for ( unsigned int i = 0; i < noCounters; ++i )
+        m_sums[i] = (unsigned short)( m_sums[i]+m_counters[c*noCounters+i] );
+    hook.Select( NULL );
+    return true;
+  }
+  // Takes the chunks in order until there are no more, or they are after a
+  // failed one
+  void Work( Worker& worker )
+  {
+    const unsigned int noCounters = m_records.noCounters;
+    for ( ;; )
+    {
+      Lock();
+      const unsigned int c = m_nextChunk < m_firstFailed ? m_nextChunk++ : m_firstFailed;
+      const bool stop = c == m_firstFailed;
+      Unlock();
+      if ( stop )
+        break;
+      Chunk& chunk = m_chunks[c];
+      worker.hook.Slice( chunk.first, chunk.last );
+      const bool valid = worker.validator.Validate( &worker.hook );
+      const unsigned short* counters = worker.validator.GetCounters()+m_records.counter;
+      for ( unsigned int i = 0; i < noCounters; ++i )
+        m_counters[c*noCounters+i] = counters[i];
+      if ( valid )
+        continue;
+      chunk.failed = worker.hook.Current();
+      Lock();
+      m_firstFailed = c < m_firstFailed ? c : m_firstFailed;
+      Unlock();
+    }
+  }
+  // The thread of a worker, it takes part in every batch of chunks until
+  // the validator goes away
+  void Serve( Worker& worker )
+  {
+    unsigned int batch = 0;
+    Lock();
+    for ( ;; )
+    {
+      while ( !m_quit && batch == m_batch )
+        Wait( m_started );
+      if ( m_quit )
+        break;
+      batch = m_batch;
+      Unlock();
+      Work( worker );
+      Lock();
+      if ( --m_busy == 0 )
+        WakeAll( m_done );
+    }
+    Unlock();
+  }
+#ifdef _WIN32
+  typedef HANDLE Thread;
+  typedef CONDITION_VARIABLE Condition;
+  static DWORD WINAPI WorkerMain( LPVOID worker )
+  {
+    ((Worker*)worker)->owner->Serve( *(Worker*)worker );
+    return 0;
+  }
+  void Lock(){ EnterCriticalSection( &m_lock ); }
+  void Unlock(){ LeaveCriticalSection( &m_lock ); }
+  void Wait( Condition& condition ){ SleepConditionVariableCS( &condition, &m_lock, INFINITE ); }
+  void WakeAll( Condition& condition ){ WakeAllConditionVariable( &condition ); }
+#else
+  typedef pthread_t Thread;
+  typedef pthread_cond_t Condition;
+  static void* WorkerMain( void* worker )
+  {
+    ((Worker*)worker)->owner->Serve( *(Worker*)worker );
+    return 0;
+  }
+  void Lock(){ pthread_mutex_lock( &m_lock ); }
+  void Unlock(){ pthread_mutex_unlock( &m_lock ); }
+  void Wait( Condition& condition ){ pthread_cond_wait( &condition, &m_lock ); }
+  void WakeAll( Condition& condition ){ pthread_cond_broadcast( &condition ); }
+#endif
+
+protected:
+  ScvalValidator m_validator;          // the document but the records
+  const ScvalVMCode* m_code;
+  ScvalVMEngine m_engine;
+  ScvalVMCode m_recordsCode;           // the loop of m_records alone
+  ScvalVMRecords m_records;
+  std::vector<Worker*> m_workers;
+  unsigned int m_chunkSize;            // records
+  std::vector<Chunk> m_chunks;
+  std::vector<unsigned short> m_counters; // of the loop, by chunk
+  std::vector<unsigned short> m_sums;
+  unsigned int m_nextChunk;            // the next chunk to take, under m_lock
+  unsigned int m_firstFailed;          // the first failed chunk, under m_lock
+  bool m_bound;                        // the workers are bound to m_recordsCode
+  const tinyxml2::XMLElement* m_failedElmt;
+  int m_failedRecord;
+  std::vector<Thread> m_threads;       // of the workers but the first one
+  unsigned int m_batch;                // the batch of chunks the threads take, under m_lock
+  unsigned int m_busy;                 // the threads still in the batch, under m_lock
+  bool m_quit;                         // the threads end, under m_lock
+  Condition m_started;                 // a batch, or the end
+  Condition m_done;                    // the threads are done with the batch
+#ifdef _WIN32
+  CRITICAL_SECTION m_lock;
+#else
+  pthread_mutex_t m_lock;
+#endif
+};
+
+#endif
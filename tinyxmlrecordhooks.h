@@ -0,0 +1,245 @@
+#ifndef _TINYXMLRECORDHOOKS_H_
+#define _TINYXMLRECORDHOOKS_H_
+#include "scvaltypes.h"
+#include "tinyxmlstreamhooks.h"
+#include <stack>
+
+// Validation of large documents made of records, many children of the
+// root element (the books of a catalog), one record in memory at once.
+// The root and the text between the records are streamed as by
+// TinyXMLStreamHooks, reading the file by chunks. Every child of the
+// root is read whole and parsed into a DOM, where the VM walks it as
+// with TinyXMLHooks, and dropped when the VM goes to the next one: the
+// document is in arena mode (see XMLDocument::SetArena), so the next
+// record reuses the blocks of its pools and its text buffer. The memory
+// grows with the largest record, not with the size of the document.
+// As the stream only goes forward, the custom types are checked by the
+// checks registered in the validator, and Finish reads the rest of the
+// document after the validation.
+class TinyXMLRecordHooks : public ScvalInstHookT<TinyXMLRecordHooks>
+{
+public:
+  TinyXMLRecordHooks( size_t chunkSize=64*1024 ) : m_reader(chunkSize), m_depth(0), m_records(0), m_maxRecord(0)
+    , m_xmlElmt(0), m_xmlAttr(0), m_error(false)
+  {
+    m_doc.SetNameHashing( true, true );
+    m_doc.SetArena( true );
+  }
+  // Opens the file and reads up to the start tag of the root element
+  bool LoadFile( const char* xmlfile ){ Rewind(); return m_reader.LoadFile( xmlfile ); }
+  // Reads from an open file (not closed), a pipe...
+  bool Open( FILE* file ){ Rewind(); return m_reader.Open( file ); }
+  // From memory, not copied: the text must outlive the validation
+  bool Parse( const char* xmltext, size_t len=(size_t)-1 ){ Rewind(); return m_reader.Parse( xmltext, len ); }
+  // Reads the rest of the document after the validation, false when it is
+  // not well formed
+  bool Finish(){ return !m_error && m_reader.Finish(); }
+  // The document is not well formed (or couldn't be read)
+  bool Error()const{ return m_error || m_reader.Error(); }
+  // records read, and the size of the largest one
+  size_t Records()const{ return m_records; }
+  size_t MaxRecord()const{ return m_maxRecord; }
+  int PoolBlocks()const{ return m_doc.PoolBlocks(); }
+  // the strings of a record are dropped with it, the VM copies them
+  virtual bool StableStrings(){ return false; }
+
+  // the root from the stream, the elements of the records from their DOM
+  void ElementName( ScvalHookString& out )
+  {
+    if ( !m_depth )
+      m_reader.ElementName( out );
+    else
+      LoadName( m_xmlElmt, out );
+  }
+  void ElementValue( ScvalHookString& out )
+  {
+    if ( !m_depth )
+      m_reader.ElementValue( out );
+    else
+    {
+      size_t len = 0;
+      const char* str = m_xmlElmt ? m_xmlElmt->GetText( &len ) : NULL;
+      out.Set( str, (unsigned int)len );
+    }
+  }
+  void ElementRawValue( ScvalHookString& out )
+  {
+    if ( !m_depth )
+      m_reader.ElementValue( out );
+    else
+    {
+      size_t len = 0;
+      const char* str = m_xmlElmt ? m_xmlElmt->GetRawText( &len ) : NULL;
+      out.Set( str, (unsigned int)len );
+    }
+  }
+  void AttributeName( ScvalHookString& out )
+  {
+    if ( !m_depth )
+      m_reader.AttributeName( out );
+    else
+      LoadName( m_xmlAttr, out );
+  }
+  void AttributeValue( ScvalHookString& out )
+  {
+    if ( !m_depth )
+      m_reader.AttributeValue( out );
+    else
+    {
+      size_t len = 0;
+      const char* str = m_xmlAttr ? m_xmlAttr->Value( &len ) : NULL;
+      out.Set( str, (unsigned int)len );
+    }
+  }
+  void AttributeRawValue( ScvalHookString& out )
+  {
+    if ( !m_depth )
+      m_reader.AttributeValue( out );
+    else
+    {
+      size_t len = 0;
+      const char* str = m_xmlAttr ? m_xmlAttr->RawValue( &len ) : NULL;
+      out.Set( str, (unsigned int)len );
+    }
+  }
+  // down from the root reads the first record
+  void Down()
+  {
+    if ( !m_depth++ )
+      m_xmlElmt = NextRecord();
+    else
+    {
+      m_elmstack.push( m_xmlElmt );
+      m_xmlElmt = m_xmlElmt->FirstChildElement();
+    }
+  }
+  void Up()
+  {
+    if ( !--m_depth )
+      m_xmlElmt = NULL;
+    else
+    {
+      m_xmlElmt = m_elmstack.top();
+      m_elmstack.pop();
+    }
+  }
+  void FirstAttribute()
+  {
+    if ( !m_depth )
+      m_reader.FirstAttribute();
+    else
+      m_xmlAttr = m_xmlElmt->FirstAttribute();
+  }
+  void NextAttribute()
+  {
+    if ( !m_depth )
+      m_reader.NextAttribute();
+    else
+      m_xmlAttr = m_xmlAttr->Next();
+  }
+  // the next record drops the current one
+  void NextElement()
+  {
+    if ( !m_depth )
+      m_reader.NextElement();
+    else if ( m_depth == 1 )
+      m_xmlElmt = NextRecord();
+    else
+      m_xmlElmt = m_xmlElmt->NextSiblingElement();
+  }
+  // the custom types are checked by the checks registered in the validator
+  virtual bool Checks(){ return false; }
+  // The offset of the root in the stream, the element or attribute in the
+  // DOM of a record (until the next record is read)
+  virtual void* Position( ScvalVMOpcode opcode )
+  {
+    if ( !m_depth )
+      return m_reader.Position( opcode );
+    return opcode == VM_LDAV ? (void*)m_xmlAttr : (void*)m_xmlElmt;
+  }
+
+protected:
+  // The stream of the document, reading whole records
+  class Reader : public TinyXMLStreamHooks
+  {
+  public:
+    Reader( size_t chunkSize ) : TinyXMLStreamHooks( chunkSize ){}
+    // The text of the next child element of the root, from its start tag
+    // to its end tag. False at the end of the root or when the document
+    // is not well formed.
+    bool ReadRecord( const char*& text, size_t& len )
+    {
+      if ( m_error || m_open != 1 )
+        return false;
+      int node;
+      do
+      {
+        m_keep = m_pos;
+        node = ReadNode();
+      }
+      while ( node == NODE_SKIPPED && !m_error );
+      // inside the record, TinyXML reads the attributes and texts
+      m_skim = true;
+      while ( (node == NODE_START || node == NODE_END) && m_open > 1 )
+        node = ReadTag();
+      m_skim = false;
+      text = m_keep;
+      len = m_pos-m_keep;
+      m_keep = 0;
+      // the end tag of the root leaves none open
+      return (node == NODE_START || node == NODE_END) && m_open == 1 && !m_error;
+    }
+  };
+
+  void Rewind()
+  {
+    m_depth = 0;
+    m_records = 0;
+    m_xmlElmt = NULL;
+    m_xmlAttr = NULL;
+    m_error = false;
+    while ( !m_elmstack.empty() )
+      m_elmstack.pop();
+  }
+  // Reads and parses the next record, NULL after the last one. TinyXML has
+  // to find the same element in its text, and nothing else.
+  tinyxml2::XMLElement* NextRecord()
+  {
+    const char* text;
+    size_t len;
+    m_xmlAttr = NULL;
+    if ( m_error || !m_reader.ReadRecord( text, len ) )
+      return NULL;
+    ++m_records;
+    m_maxRecord = len > m_maxRecord ? len : m_maxRecord;
+    tinyxml2::XMLElement* record = NULL;
+    if ( m_doc.Parse( text, len ) == tinyxml2::XML_SUCCESS && m_doc.FirstChild() == m_doc.LastChild() )
+      record = m_doc.FirstChildElement();
+    m_error = !record;
+    return record;
+  }
+  template<typename Node>
+  static void LoadName( const Node* node, ScvalHookString& out )
+  {
+    size_t len = 0;
+    unsigned int hash;
+    const char* str = node ? node->Name( &len ) : NULL;
+    if ( str && node->NameHash( &hash ) )
+      out.Set( str, (unsigned int)len, hash );
+    else
+      out.Set( str, (unsigned int)len );
+  }
+
+protected:
+  Reader m_reader;
+  tinyxml2::XMLDocument m_doc;     // the current record
+  unsigned int m_depth;            // of the validator, 0 at the root
+  size_t m_records;
+  size_t m_maxRecord;
+  tinyxml2::XMLElement* m_xmlElmt;
+  const tinyxml2::XMLAttribute* m_xmlAttr;
+  std::stack<tinyxml2::XMLElement*> m_elmstack;
+  bool m_error;                    // a record TinyXML doesn't parse
+};
+
+#endif
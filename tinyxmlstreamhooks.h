@@ -0,0 +1,656 @@
+#ifndef _TINYXMLSTREAMHOOKS_H_
+#define _TINYXMLSTREAMHOOKS_H_
+#include "scvaltypes.h"
+#include "tinyxml2/tinyxml2.h"
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+// Streaming validation, without building the DOM. The hook pulls the
+// tags from the XML text as the validator walks the elements, reading
+// the file by chunks, so the validation overlaps the reading. Only the
+// start tag (name, attributes and text) of the current element and of
+// its ancestors is kept: the memory grows with the depth of the
+// document, not with its size. Names and values are processed with
+// the TinyXML functions (entities, new lines), and the text of an
+// element is its first child text as XMLElement::GetText, so both
+// hooks see the same strings.
+// The stream only goes forward: the children the validator doesn't go
+// down into are skipped. A document badly formed stops the hook (see
+// Error), and Finish reads what the validator left, as the whole
+// document has to be well formed.
+// The input can also be pushed by chunks (BeginPush, Feed), for the
+// resumable runs of the VM: a tag cut by the end of a chunk starves the
+// hook, the operation is undone and the VM suspends until the next one.
+// See TinyXMLPushValidator.
+class TinyXMLStreamHooks : public ScvalInstHookT<TinyXMLStreamHooks>
+{
+public:
+  TinyXMLStreamHooks( size_t chunkSize=64*1024 ) : m_file(0), m_ownFile(false), m_base(0), m_pos(0), m_end(0)
+    , m_offset(0), m_keep(0), m_chunk(chunkSize < 16 ? 16 : chunkSize), m_depth(0), m_open(0), m_attr(0), m_error(true)
+    , m_pushing(false), m_final(false), m_starved(false), m_stopped(false), m_skim(false)
+  {
+    m_levels.reserve( 16 );
+  }
+  ~TinyXMLStreamHooks(){ Close(); }
+  // Opens the file and reads up to the start tag of the root element
+  bool LoadFile( const char* xmlfile )
+  {
+    Close();
+    m_file = fopen( xmlfile, "rb" );
+    m_ownFile = m_file != 0;
+    return Begin( 0, 0 );
+  }
+  // Reads from an open file (not closed), a pipe...
+  bool Open( FILE* file )
+  {
+    Close();
+    m_file = file;
+    return Begin( 0, 0 );
+  }
+  // From memory, not copied: the text must outlive the validation
+  bool Parse( const char* xmltext, size_t len=(size_t)-1 )
+  {
+    Close();
+    if ( !xmltext )
+      return Begin( 0, 0 );
+    return Begin( xmltext, len == (size_t)-1 ? strlen(xmltext) : len );
+  }
+  // Pushed input: no input until Feed, ReadRoot when there's enough
+  void BeginPush()
+  {
+    Close();
+    Start( 0, 0 );
+    m_error = false;
+    m_pushing = true;
+  }
+  // Appends a chunk of the document. The bytes already read are dropped,
+  // only the ones of a tag cut by the end of the previous chunk remain.
+  void Feed( const char* data, size_t len )
+  {
+    const size_t read = m_pos-m_base;
+    m_chunk.erase( m_chunk.begin(), m_chunk.begin()+read );
+    m_chunk.insert( m_chunk.end(), data, data+len );
+    m_offset += read;
+    m_base = m_pos = m_chunk.empty() ? 0 : &m_chunk[0];
+    m_end = m_pos+m_chunk.size();
+    m_starved = false;
+  }
+  // No more chunks, the hook doesn't starve anymore
+  void EndOfInput()
+  {
+    m_final = true;
+    m_starved = false;
+  }
+  // Up to the start tag of the root element, skipping the white space and
+  // BOM as TinyXML. False when starved or there's no root element.
+  bool ReadRoot()
+  {
+    SkipWhiteSpace();
+    if ( Ensure(3) >= 3 && (unsigned char)m_pos[0] == 0xef && (unsigned char)m_pos[1] == 0xbb && (unsigned char)m_pos[2] == 0xbf )
+      m_pos += 3;
+    else if ( m_starved )
+      return false;
+    m_levels[0].present = ReadTag() == NODE_START;
+    m_error = m_error || (!m_levels[0].present && !m_starved); // an empty document
+    return m_levels[0].present;
+  }
+  // Reads the rest of the document after the validation, false when it is
+  // not well formed (or starved, pushing)
+  bool Finish()
+  {
+    while ( !m_error && !m_starved && ReadTag() != NODE_EOF )
+    {}
+    return !m_error && !m_starved;
+  }
+  // The document is not well formed (or couldn't be read)
+  bool Error()const{ return m_error; }
+  // the last operation needs the next chunk
+  virtual bool Starved(){ return m_starved; }
+  // the strings are overwritten by the next elements, the VM copies them
+  virtual bool StableStrings(){ return false; }
+
+  void ElementName( ScvalHookString& out )
+  {
+    const Level& level = m_levels[m_depth];
+    if ( level.present )
+      out.Set( &level.chars[0], level.nameLen, level.hash );
+    else
+      out.Set( 0 );
+  }
+  void ElementValue( ScvalHookString& out )
+  {
+    const Level& level = m_levels[m_depth];
+    if ( level.present && level.hasText )
+      out.Set( &level.chars[level.text], level.textLen );
+    else
+      out.Set( 0 );
+  }
+  void AttributeName( ScvalHookString& out )
+  {
+    const Level& level = m_levels[m_depth];
+    if ( level.present && m_attr < level.attrs.size() )
+      out.Set( &level.chars[level.attrs[m_attr].name], level.attrs[m_attr].nameLen, level.attrs[m_attr].hash );
+    else
+      out.Set( 0 );
+  }
+  void AttributeValue( ScvalHookString& out )
+  {
+    const Level& level = m_levels[m_depth];
+    if ( level.present && m_attr < level.attrs.size() )
+      out.Set( &level.chars[level.attrs[m_attr].value], level.attrs[m_attr].valueLen );
+    else
+      out.Set( 0 );
+  }
+  // the first child, read when the stream is right after the start tag
+  void Down()
+  {
+    const bool inside = m_levels[m_depth].present && m_open == m_depth+1;
+    if ( ++m_depth == m_levels.size() )
+      m_levels.push_back( Level() );
+    m_levels[m_depth].present = inside && ReadTag() == NODE_START;
+    if ( m_starved )
+      --m_depth;
+  }
+  // the parent is still there, its children are skipped by NextElement
+  void Up()
+  {
+    if ( m_depth )
+      --m_depth;
+  }
+  void FirstAttribute(){ m_attr = 0; }
+  void NextAttribute(){ ++m_attr; }
+  void NextElement()
+  {
+    if ( !m_levels[m_depth].present )
+      return;
+    // skips the rest of the current element, then the next sibling or the end of the parent
+    // (the levels grow with the skipped elements, no reference to them is kept)
+    while ( !m_error && !m_starved && m_open > m_depth )
+      ReadTag();
+    // starved, the current one stays until the operation runs again
+    if ( !m_starved )
+    {
+      const bool present = (!m_error && ReadTag() == NODE_START) || m_starved;
+      m_levels[m_depth].present = present;
+    }
+  }
+  // the custom types are checked by the checks registered in the validator
+  virtual bool Checks(){ return false; }
+  // offset of the element name in the stream (of its element for an attribute)
+  virtual void* Position( ScvalVMOpcode /*opcode*/ )
+  {
+    const Level& level = m_levels[m_depth];
+    return level.present ? (void*)level.offset : 0;
+  }
+  // deepest element read, the levels kept in memory
+  size_t MaxDepth()const{ return m_levels.size(); }
+
+protected:
+  enum { NODE_START, NODE_END, NODE_EOF, NODE_ERROR, NODE_SKIPPED };
+  struct Attr
+  {
+    unsigned int name, nameLen;   // in the chars of the level
+    unsigned int value, valueLen;
+    ScvalHashID hash;
+  };
+  // start tag of an element: name at 0, attributes and text, zero terminated
+  struct Level
+  {
+    Level():nameLen(0), hash(0), text(0), textLen(0), offset(0), hasText(false), open(false), present(false){}
+    std::vector<char> chars;
+    std::vector<Attr> attrs;
+    unsigned int nameLen;
+    ScvalHashID hash;
+    unsigned int text, textLen;
+    size_t offset;
+    bool hasText;
+    bool open;     // not closed by />, nor by its end tag yet
+    bool present;  // there is an element, false at the end of the siblings
+  };
+
+  void Close()
+  {
+    if ( m_file && m_ownFile )
+      fclose( m_file );
+    m_file = 0;
+    m_ownFile = false;
+    m_pushing = m_final = m_starved = false;
+    m_base = m_pos = m_end = m_keep = 0;
+    m_offset = 0;
+  }
+  void Start( const char* text, size_t len )
+  {
+    m_base = m_pos = text;
+    m_end = text ? text+len : 0;
+    m_keep = 0;
+    m_offset = 0;
+    m_depth = m_open = 0;
+    m_stopped = false;
+    m_attr = 0;
+    if ( m_levels.empty() )
+      m_levels.push_back( Level() );
+    m_levels[0].present = false;
+  }
+  bool Begin( const char* text, size_t len )
+  {
+    Start( text, len );
+    m_error = !text && !m_file;
+    return !m_error && ReadRoot();
+  }
+
+  // at least n bytes ahead, unless the input ends; the ones ahead move to the
+  // beginning of the chunk and the rest is read. Pushing, the hook starves
+  // until the next chunk. The bytes from m_keep on (when set) are kept
+  // too, the chunk grows to hold them.
+  size_t Ensure( size_t n )
+  {
+    size_t avail = m_end-m_pos;
+    if ( avail >= n || !m_file )
+    {
+      m_starved = m_starved || (avail < n && m_pushing && !m_final);
+      return avail;
+    }
+    const char* from = m_keep ? m_keep : m_pos;
+    const size_t kept = m_pos-from;
+    m_offset += from-m_base;
+    if ( kept+avail )
+      memmove( &m_chunk[0], from, kept+avail );
+    if ( m_chunk.size() < kept+n || kept > m_chunk.size()/2 )
+      m_chunk.resize( m_chunk.size()*2+n );
+    size_t got;
+    while ( avail < n && (got = fread( &m_chunk[kept+avail], 1, m_chunk.size()-kept-avail, m_file )) > 0 )
+      avail += got;
+    m_base = &m_chunk[0];
+    m_keep = m_keep ? m_base : 0;
+    m_pos = m_base+kept;
+    m_end = m_pos+avail;
+    return avail;
+  }
+  int Peek(){ return m_pos < m_end || Ensure(1) ? (unsigned char)*m_pos : -1; }
+  bool Match( const char* str, size_t len ){ return Ensure( len ) >= len && memcmp( m_pos, str, len ) == 0; }
+  size_t Offset()const{ return m_offset+(m_pos-m_base); }
+  // a starved hook is not an error, the operation is undone
+  int Fail(){ m_error = m_error || !m_starved; return NODE_ERROR; }
+  void SkipWhiteSpace()
+  {
+    while ( Peek() >= 0 && tinyxml2::XMLUtil::IsWhiteSpace( *m_pos ) )
+      ++m_pos;
+  }
+  // up to the char c (not included), appending it to out; false when the input ends
+  bool ReadUntil( char c, std::vector<char>* out )
+  {
+    for (;;)
+    {
+      if ( m_pos == m_end && !Ensure(1) )
+        return false;
+      const char* found = (const char*)memchr( m_pos, c, m_end-m_pos );
+      const char* stop = found ? found : m_end;
+      if ( out )
+        out->insert( out->end(), m_pos, stop );
+      m_pos = stop;
+      if ( found )
+        return true;
+    }
+  }
+  // past the end mark (up to 3 chars), appending what's before it to out
+  bool ReadPast( const char* mark, std::vector<char>* out )
+  {
+    const size_t len = strlen( mark );
+    char tail[3] = { 0, 0, 0 };
+    while ( m_pos < m_end || Ensure(1) )
+    {
+      const char c = *m_pos++;
+      if ( out )
+        out->push_back( c );
+      tail[0] = tail[1]; tail[1] = tail[2]; tail[2] = c;
+      if ( memcmp( tail+3-len, mark, len ) == 0 )
+      {
+        if ( out )
+          out->resize( out->size()-len );
+        return true;
+      }
+    }
+    return false;
+  }
+  bool ReadName( std::vector<char>& out )
+  {
+    if ( Peek() < 0 || !tinyxml2::XMLUtil::IsNameStartChar( (unsigned char)*m_pos ) )
+      return false;
+    do
+      out.push_back( *m_pos++ );
+    while ( Peek() >= 0 && tinyxml2::XMLUtil::IsNameChar( (unsigned char)*m_pos ) );
+    return true;
+  }
+  // processes the raw string from start to the end of chars, as TinyXML does
+  static unsigned int Process( std::vector<char>& chars, unsigned int start, int flags )
+  {
+    const size_t end = chars.size();
+    chars.push_back( 0 );
+    size_t len = 0;
+    tinyxml2::StrPair str;
+    str.Set( &chars[start], &chars[end], flags );
+    str.GetStr( &len );
+    chars.resize( start+len+1 );
+    return (unsigned int)len;
+  }
+
+  // The next start or end tag, skipping text, comments, declarations and
+  // CDATA. A start tag is read in the level of the elements open, with its
+  // text when it's the first child. A node cut by the end of the input
+  // when the hook starves is read again from its beginning.
+  int ReadTag()
+  {
+    while ( !m_error )
+    {
+      const char* mark = m_pos;
+      const unsigned int open = m_open;
+      const int node = ReadNode();
+      if ( node == NODE_SKIPPED )
+        continue;
+      if ( node == NODE_ERROR && m_starved )
+      {
+        m_pos = mark;
+        m_open = open;
+      }
+      return node;
+    }
+    return NODE_ERROR;
+  }
+  int ReadNode()
+  {
+    if ( m_stopped )
+      return NODE_EOF;
+    SkipWhiteSpace();
+    if ( Peek() < 0 )
+      return m_open || m_starved ? Fail() : NODE_EOF;
+    if ( *m_pos != '<' )
+    {
+      // text ends before a tag, also the one out of the root
+      if ( !ReadUntil( '<', 0 ) )
+        return Fail();
+      return NODE_SKIPPED;
+    }
+    // the longest mark, before telling what it is
+    if ( Ensure(9) < 9 && m_starved )
+      return Fail();
+    if ( Match( "<?", 2 ) )
+    {
+      m_pos += 2;
+      if ( !ReadPast( "?>", 0 ) )
+        return Fail();
+    }
+    else if ( Match( "<!--", 4 ) )
+    {
+      m_pos += 4;
+      if ( !ReadPast( "-->", 0 ) )
+        return Fail();
+    }
+    else if ( Match( "<![CDATA[", 9 ) )
+    {
+      m_pos += 9;
+      if ( !ReadPast( "]]>", 0 ) )
+        return Fail();
+    }
+    else if ( Match( "<!", 2 ) )
+    {
+      m_pos += 2;
+      if ( !ReadUntil( '>', 0 ) )
+        return Fail();
+      ++m_pos;
+    }
+    else
+    {
+      ++m_pos;
+      SkipWhiteSpace();
+      if ( m_open == m_levels.size() )
+        m_levels.push_back( Level() );
+      if ( Peek() == '/' )
+        return ReadEndTag( m_levels[m_open] );
+      return ReadStartTag( m_levels[m_open] );
+    }
+    return NODE_SKIPPED;
+  }
+  // As TinyXML, an end tag is read as a start tag (in the level after the
+  // open ones): it can have attributes, with /> it's an empty element, and
+  // out of the root it ends the document.
+  int ReadEndTag( Level& tag )
+  {
+    ++m_pos;
+    const int node = ReadTagName( tag );
+    if ( node != NODE_END )
+      return node;
+    if ( !m_open )
+    {
+      m_stopped = true;
+      return NODE_EOF;
+    }
+    const Level& level = m_levels[m_open-1];
+    if ( tag.nameLen != level.nameLen || memcmp( &tag.chars[0], &level.chars[0], level.nameLen ) != 0 )
+      return Fail();
+    --m_open;
+    return NODE_END;
+  }
+  int ReadStartTag( Level& level )
+  {
+    const int node = ReadTagName( level );
+    if ( node != NODE_END )
+      return node;
+    level.open = true;
+    ++m_open;
+    ReadText( level );
+    return m_error || m_starved ? NODE_ERROR : NODE_START;
+  }
+  // The name and attributes of a tag: NODE_START when it's closed by />,
+  // NODE_END by >
+  int ReadTagName( Level& level )
+  {
+    level.chars.clear();
+    level.attrs.clear();
+    level.hasText = level.open = false;
+    level.present = true;
+    level.offset = Offset();
+    if ( !ReadName( level.chars ) )
+      return Fail();
+    level.nameLen = (unsigned int)level.chars.size();
+    level.hash = m_skim ? 0 : tinyxml2::XMLUtil::HashName( &level.chars[0], level.nameLen );
+    level.chars.push_back( 0 );
+    for (;;)
+    {
+      SkipWhiteSpace();
+      const int c = Peek();
+      if ( c < 0 )
+        return Fail();
+      if ( c == '>' )
+      {
+        ++m_pos;
+        return NODE_END;
+      }
+      if ( c == '/' )
+      {
+        if ( !Match( "/>", 2 ) )
+          return Fail();
+        m_pos += 2;
+        return NODE_START;
+      }
+      if ( !ReadAttribute( level ) )
+        return Fail();
+    }
+  }
+  bool ReadAttribute( Level& level )
+  {
+    if ( m_skim )
+      return SkimAttribute();
+    Attr attr;
+    attr.name = (unsigned int)level.chars.size();
+    if ( !ReadName( level.chars ) )
+      return false;
+    attr.nameLen = (unsigned int)level.chars.size()-attr.name;
+    attr.hash = tinyxml2::XMLUtil::HashName( &level.chars[attr.name], attr.nameLen );
+    level.chars.push_back( 0 );
+    // the attributes can't be repeated
+    for ( size_t i = 0; i < level.attrs.size(); ++i )
+      if ( level.attrs[i].nameLen == attr.nameLen &&
+           memcmp( &level.chars[level.attrs[i].name], &level.chars[attr.name], attr.nameLen ) == 0 )
+        return false;
+    SkipWhiteSpace();
+    if ( Peek() != '=' )
+      return false;
+    ++m_pos;
+    SkipWhiteSpace();
+    const int quote = Peek();
+    if ( quote != '\"' && quote != '\'' )
+      return false;
+    ++m_pos;
+    attr.value = (unsigned int)level.chars.size();
+    if ( !ReadUntil( (char)quote, &level.chars ) )
+      return false;
+    ++m_pos;
+    attr.valueLen = Process( level.chars, attr.value, tinyxml2::StrPair::ATTRIBUTE_VALUE );
+    level.attrs.push_back( attr );
+    return true;
+  }
+  bool SkimAttribute()
+  {
+    if ( Peek() < 0 || !tinyxml2::XMLUtil::IsNameStartChar( (unsigned char)*m_pos ) )
+      return false;
+    while ( Peek() >= 0 && tinyxml2::XMLUtil::IsNameChar( (unsigned char)*m_pos ) )
+      ++m_pos;
+    SkipWhiteSpace();
+    if ( Peek() != '=' )
+      return false;
+    ++m_pos;
+    SkipWhiteSpace();
+    const int quote = Peek();
+    if ( quote != '\"' && quote != '\'' )
+      return false;
+    ++m_pos;
+    if ( !ReadUntil( (char)quote, 0 ) )
+      return false;
+    ++m_pos;
+    return true;
+  }
+  // Text of an element, when its first child is text or CDATA. As TinyXML,
+  // white space alone before a tag is no text. Skimming, it's read as the
+  // nodes after the start tag.
+  void ReadText( Level& level )
+  {
+    if ( m_skim )
+      return;
+    const unsigned int start = (unsigned int)level.chars.size();
+    while ( Peek() >= 0 && tinyxml2::XMLUtil::IsWhiteSpace( *m_pos ) )
+      level.chars.push_back( *m_pos++ );
+    if ( Peek() < 0 )
+    {
+      Fail();
+      return;
+    }
+    int flags = tinyxml2::StrPair::TEXT_ELEMENT;
+    if ( *m_pos == '<' )
+    {
+      level.chars.resize( start );
+      if ( !Match( "<![CDATA[", 9 ) )
+      {
+        if ( m_starved )
+          Fail();
+        return;
+      }
+      m_pos += 9;
+      if ( !ReadPast( "]]>", &level.chars ) )
+      {
+        Fail();
+        return;
+      }
+      flags = tinyxml2::StrPair::NEEDS_NEWLINE_NORMALIZATION;
+    }
+    else if ( !ReadUntil( '<', &level.chars ) )
+    {
+      Fail();
+      return;
+    }
+    level.text = start;
+    level.textLen = Process( level.chars, start, flags );
+    level.hasText = true;
+  }
+
+protected:
+  FILE* m_file;
+  bool m_ownFile;
+  const char* m_base;            // the buffer, at m_offset in the stream
+  const char* m_pos;
+  const char* m_end;
+  size_t m_offset;
+  const char* m_keep;            // start of the bytes Ensure doesn't drop, 0 for none
+  std::vector<char> m_chunk;     // read from the file
+  std::vector<Level> m_levels;   // elements by depth, the current one of each level
+  unsigned int m_depth;          // level of the validator
+  unsigned int m_open;           // elements open in the stream
+  unsigned int m_attr;           // current attribute of the current element
+  bool m_error;
+  bool m_pushing;                // the input comes by Feed, in m_chunk
+  bool m_final;                  // no more chunks
+  bool m_starved;                // the last operation needs the next chunk
+  bool m_stopped;                // an end tag at the document level, TinyXML stops there
+  bool m_skim;                   // the tags are only delimited, their attributes and text aren't kept
+};
+
+// Validation of a document received by chunks (from a socket...): every
+// chunk goes through the tokenizer and the VM as far as it can, and the
+// VM suspends until the next one. Feed returns false as soon as the
+// document is known to be not valid, End gives the result.
+class TinyXMLPushValidator
+{
+public:
+  TinyXMLPushValidator( ScvalValidator& validator ) : m_validator(validator), m_status(VMSTATUS_INVALID), m_started(false){}
+  void Begin()
+  {
+    m_hook.BeginPush();
+    m_status = VMSTATUS_SUSPENDED;
+    m_started = false;
+  }
+  bool Feed( const char* data, size_t len )
+  {
+    if ( m_status == VMSTATUS_INVALID )
+      return false;
+    m_hook.Feed( data, len );
+    return Advance();
+  }
+  bool End()
+  {
+    if ( m_status == VMSTATUS_INVALID )
+      return false;
+    m_hook.EndOfInput();
+    return Advance() && m_status == VMSTATUS_VALID;
+  }
+  TinyXMLStreamHooks& GetHook(){ return m_hook; }
+protected:
+  bool Advance()
+  {
+    if ( !m_started )
+    {
+      // the VM starts on the root element
+      if ( !m_hook.ReadRoot() )
+      {
+        m_status = m_hook.Error() ? VMSTATUS_INVALID : m_status;
+        return m_status != VMSTATUS_INVALID;
+      }
+      m_started = true;
+      m_status = m_validator.Start( &m_hook );
+    }
+    else if ( m_status == VMSTATUS_SUSPENDED )
+      m_status = m_validator.Resume( &m_hook );
+    // once validated, the rest of the document has to be well formed
+    if ( m_status == VMSTATUS_VALID )
+      m_hook.Finish();
+    if ( m_hook.Error() )
+      m_status = VMSTATUS_INVALID;
+    return m_status != VMSTATUS_INVALID;
+  }
+protected:
+  ScvalValidator& m_validator;
+  TinyXMLStreamHooks m_hook;
+  ScvalVMStatus m_status;
+  bool m_started;
+};
+
+#endif